@@ -0,0 +1,140 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include "admission.h"
+#include "metrics.h"
+
+/*
+*   A token bucket for one source address. Tokens are kept in thousandths
+*   of a connection so that slow rates still refill every millisecond.
+*/
+typedef struct {
+    uint32_t address;
+    long updated;
+    long tokens;
+} SourceBucket;
+
+/*
+*   The limits new connections are checked against and the buckets of the
+*   sources seen recently. A limit of 0 is no limit. Every reactor admits
+*   through the same buckets, since a source's connections are spread over
+*   all of them.
+*/
+static struct {
+    pthread_mutex_t lock;
+    long rate;
+    long burst;
+    long connections;
+    long handshakes;
+    SourceBucket sources[SOURCE_SLOTS];
+} admission = {PTHREAD_MUTEX_INITIALIZER};
+
+/*
+*   Limits each source address to rate new connections a second, with
+*   bursts of up to burst, given as "rate" or "rate/burst". The burst is
+*   twice the rate if it is not given. Returns 0 if the text is not valid.
+*/
+int admission_set_rate(const char* text) {
+    char* end;
+    long rate = strtol(text, &end, 10);
+    long burst = rate * 2;
+    if (*end == '/') {
+        burst = strtol(end + 1, &end, 10);
+    }
+    if (*end != '\0' || rate < 0 || burst < 1 || burst > 1000000) {
+        return 0;
+    }
+    admission.rate = rate;
+    admission.burst = burst;
+    return 1;
+}
+
+/*
+*   Sets the most connections open at once and the most of those still in
+*   their handshake. A negative connection limit leaves room for every
+*   descriptor the process may open, less those the server keeps for
+*   itself.
+*/
+void admission_set_limits(long connections, long handshakes) {
+    struct rlimit files;
+    if (connections < 0) {
+        connections = 0;
+        if (!getrlimit(RLIMIT_NOFILE, &files) &&
+                files.rlim_cur != RLIM_INFINITY &&
+                files.rlim_cur > 2 * RESERVED_DESCRIPTORS) {
+            connections = files.rlim_cur - RESERVED_DESCRIPTORS;
+        }
+    }
+    admission.connections = connections;
+    admission.handshakes = handshakes;
+}
+
+/*
+*   Takes a token from the source's bucket. Returns 0 if it has none left.
+*   A slot whose bucket has filled up again is as good as empty, so it is
+*   given to whichever source needs it next.
+*/
+static int take_token(uint32_t address) {
+    long now = monotonic_ms();
+    long full = admission.burst * 1000;
+    uint32_t hash = (address * 2654435761u) & (SOURCE_SLOTS - 1);
+    SourceBucket* bucket = NULL;
+    SourceBucket* unused = NULL;
+    pthread_mutex_lock(&admission.lock);
+    for (int i = 0; i < SOURCE_PROBES && bucket == NULL; i++) {
+        SourceBucket* slot =
+                &admission.sources[(hash + i) & (SOURCE_SLOTS - 1)];
+        long tokens = slot->tokens + (now - slot->updated) * admission.rate;
+        if (slot->address == address) {
+            bucket = slot;
+            bucket->tokens = tokens < full ? tokens : full;
+        } else if (unused == NULL && (slot->address == 0 || tokens >= full)) {
+            unused = slot;
+        }
+    }
+    if (bucket == NULL && unused != NULL) {
+        bucket = unused;
+        bucket->address = address;
+        bucket->tokens = full;
+    }
+    int allowed = 1;
+    // A source that finds no slot is let through rather than refused for
+    // sharing its slots with busier ones
+    if (bucket != NULL) {
+        bucket->updated = now;
+        if (bucket->tokens >= 1000) {
+            bucket->tokens -= 1000;
+        } else {
+            allowed = 0;
+        }
+    }
+    pthread_mutex_unlock(&admission.lock);
+    return allowed;
+}
+
+/*
+*   Decides whether a connection just accepted from address is let in,
+*   before anything is allocated for it. Returns ADMIT_OK and counts the
+*   connection and its handshake as open, or the reason it was refused.
+*   Local connections have no address, given as 0, and no rate limit.
+*/
+int admit_connection(uint32_t address) {
+    if (admission.rate && address != 0 && !take_token(address)) {
+        METRIC_ADD(rejectedRate, 1);
+        return ADMIT_RATE;
+    }
+    long open = METRIC_ADD(connectionsOpen, 1);
+    if (admission.connections && open >= admission.connections) {
+        METRIC_ADD(connectionsOpen, -1);
+        METRIC_ADD(rejectedConnections, 1);
+        return ADMIT_CONNECTIONS;
+    }
+    open = METRIC_ADD(handshakesOpen, 1);
+    if (admission.handshakes && open >= admission.handshakes) {
+        METRIC_ADD(handshakesOpen, -1);
+        METRIC_ADD(connectionsOpen, -1);
+        METRIC_ADD(rejectedHandshakes, 1);
+        return ADMIT_HANDSHAKES;
+    }
+    return ADMIT_OK;
+}
@@ -0,0 +1,26 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+
+// Source addresses whose connection rate is tracked, a power of two, and
+// how many neighbouring slots an address may be kept in
+#define SOURCE_SLOTS 16384
+#define SOURCE_PROBES 8
+// Default most connections still sending their name and game at once
+#define DEFAULT_HANDSHAKE_LIMIT 1024
+// Descriptors kept back from the connection limit for the server's own
+// files and sockets
+#define RESERVED_DESCRIPTORS 64
+
+// Why a connection was refused
+#define ADMIT_OK 0
+#define ADMIT_RATE 1
+#define ADMIT_CONNECTIONS 2
+#define ADMIT_HANDSHAKES 3
+
+int admission_set_rate(const char*);
+void admission_set_limits(long, long);
+int admit_connection(uint32_t);
+
+#endif
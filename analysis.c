@@ -0,0 +1,93 @@
+#include <string.h>
+#include "analysis.h"
+#include "cards.h"
+
+/*
+*   Returns a 64 bit FNV-1a hash of the decks, so that analyses can be
+*   matched to the deck file they came from.
+*/
+uint64_t deck_hash(char** decks, int count) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < count; i++) {
+        for (const char* c = decks[i]; *c; c++) {
+            hash = (hash ^ (unsigned char)*c) * 0x100000001B3ULL;
+        }
+        // Keep "AB" "C" apart from "A" "BC"
+        hash = (hash ^ '\n') * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+/*
+*   Solves a deal for every trump suit and declarer, finds its par and
+*   measures each hand. Returns 0 if the deck does not hold 52 different
+*   cards.
+*/
+int analyse_deal(Solver* solver, const char* deck, DealAnalysis* analysis) {
+    uint64_t hands[4];
+    hands_from_deck(deck, hands);
+    for (int i = 0; i < 4; i++) {
+        if (hand_size(hands[i]) != CARD_COUNT / 4) {
+            return 0;
+        }
+    }
+    memset(analysis, 0, sizeof(DealAnalysis));
+    for (int seat = 0; seat < 4; seat++) {
+        for (int s = 0; s < 4; s++) {
+            uint64_t suit = hands[seat] >> (s * 13);
+            int length = hand_size(suit & 0x1FFF);
+            if (length > analysis->longest[seat]) {
+                analysis->longest[seat] = length;
+            }
+            // Jack, queen, king and ace count 1 to 4
+            for (int rank = 9; rank < 13; rank++) {
+                analysis->points[seat] += ((suit >> rank) & 1) * (rank - 8);
+            }
+        }
+    }
+    for (int s = 0; s < 4; s++) {
+        for (int declarer = 0; declarer < 4; declarer++) {
+            analysis->tricks[s][declarer] = solve_hands(solver, hands,
+                    "SCDH"[s], declarer);
+        }
+    }
+    find_par(analysis);
+    analysis->solved = 1;
+    return 1;
+}
+
+/*
+*   Finds the par contract from the tricks each declarer takes. Nobody can
+*   gain by outbidding a contract the other side makes, since every higher
+*   contract loses more than the lower one wins, so par is the highest
+*   contract either side makes. The first bidder is in team 1, so team 1
+*   gets it when both sides make it. If nothing can be made, everyone
+*   passes.
+*/
+void find_par(DealAnalysis* analysis) {
+    analysis->par = NO_PAR;
+    analysis->parTeam = 0;
+    analysis->parScore = 0;
+    for (int bid = 23; bid >= 0; bid--) {
+        int suit = bid % 4;
+        int goal = bid / 4 + 4;
+        for (int team = 0; team < 2; team++) {
+            uint8_t* tricks = analysis->tricks[suit];
+            if (tricks[team] >= goal || tricks[team + 2] >= goal) {
+                analysis->par = bid;
+                analysis->parTeam = team + 1;
+                analysis->parScore = team ? -contract_score(bid) :
+                        contract_score(bid);
+                return;
+            }
+        }
+    }
+}
+
+/*
+*   Returns the points a contract is worth, as calculate_contract_points
+*   does for the bid value.
+*/
+int contract_score(int bid) {
+    return (bid / 4) * 50 + (bid % 4) * 10 + 20;
+}
@@ -0,0 +1,50 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <stdint.h>
+#include "solver.h"
+
+#define ANALYSIS_MAGIC "P499PAR"
+#define ANALYSIS_VERSION 2
+// par when there is no contract either side can make
+#define NO_PAR 0xFF
+
+/*
+*   The start of a file of deal analyses. deckHash identifies the deck
+*   file the deckCount analyses that follow were made from.
+*/
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t deckCount;
+    uint32_t reserved;
+    uint64_t deckHash;
+} AnalysisHeader;
+
+/*
+*   What perfect play makes of one deal. tricks[trump][declarer] is how
+*   many tricks the declarer's side takes when the declarer leads, with
+*   trumps in bidding order. par is the bid value of the contract the
+*   auction ends in when both sides bid perfectly, parTeam the team that
+*   declares it and parScore what it is worth to team 1. points holds each
+*   seat's high card points and longest the length of its longest suit.
+*   solved is set once everything else is filled in.
+*/
+typedef struct {
+    uint8_t tricks[4][4];
+    uint8_t par;
+    uint8_t parTeam;
+    int16_t parScore;
+    uint8_t points[4];
+    uint8_t longest[4];
+    uint8_t solved;
+    uint8_t reserved[3];
+} DealAnalysis;
+
+uint64_t deck_hash(char**, int);
+int analyse_deal(Solver*, const char*, DealAnalysis*);
+void find_par(DealAnalysis*);
+int contract_score(int);
+
+#endif
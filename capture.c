@@ -0,0 +1,123 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "capture.h"
+#include "journal.h"
+#include "metrics.h"
+
+/*
+*   The capture file shared by every reactor and game thread. Records are
+*   few and small next to the journal's, so they are simply written under
+*   a lock through a buffered stream.
+*/
+static struct {
+    pthread_mutex_t lock;
+    FILE* file;
+    int enabled;
+    uint64_t last;
+    long lastFlush;
+} capture = {PTHREAD_MUTEX_INITIALIZER};
+
+/*
+*   Returns the monotonic time in microseconds.
+*/
+static uint64_t monotonic_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/*
+*   Starts capturing client traffic to a new file at path. Returns 0 on
+*   failure.
+*/
+int capture_open(const char* path) {
+    CaptureHeader header;
+    capture.file = fopen(path, "w");
+    if (capture.file == NULL) {
+        return 0;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    header.version = CAPTURE_VERSION;
+    header.recordSize = sizeof(CaptureRecord);
+    header.created = realtime_ns();
+    if (fwrite(&header, sizeof(header), 1, capture.file) != 1 ||
+            fflush(capture.file)) {
+        return 0;
+    }
+    capture.last = monotonic_us();
+    capture.lastFlush = monotonic_ms();
+    capture.enabled = 1;
+    return 1;
+}
+
+/*
+*   Returns whether client traffic is being captured.
+*/
+int capture_enabled(void) {
+    return capture.enabled;
+}
+
+/*
+*   Appends a record and its bytes. The stream is flushed at most every
+*   CAPTURE_FLUSH_INTERVAL while traffic flows, and whenever a table ends.
+*/
+static void capture_record(uint32_t connection, int type, const char* data,
+        int length) {
+    CaptureRecord record;
+    pthread_mutex_lock(&capture.lock);
+    uint64_t now = monotonic_us();
+    uint64_t delay = now - capture.last;
+    capture.last = now;
+    record.connection = connection;
+    record.delay = delay > UINT32_MAX ? UINT32_MAX : delay;
+    record.length = length;
+    record.type = type;
+    record.reserved = 0;
+    fwrite(&record, sizeof(record), 1, capture.file);
+    if (length) {
+        fwrite(data, 1, length, capture.file);
+    }
+    if (now / 1000 - capture.lastFlush >= CAPTURE_FLUSH_INTERVAL) {
+        fflush(capture.file);
+        capture.lastFlush = now / 1000;
+    }
+    pthread_mutex_unlock(&capture.lock);
+    METRIC_ADD(captureRecords, 1);
+}
+
+/*
+*   Records a line a client sent, without its newline.
+*/
+void capture_line(uint32_t connection, const char* line, int length) {
+    if (!capture.enabled) {
+        return;
+    }
+    capture_record(connection, CAPTURE_LINE, line,
+            length > UINT16_MAX ? UINT16_MAX : length);
+}
+
+/*
+*   Writes out every record captured so far.
+*/
+void capture_flush(void) {
+    if (!capture.enabled) {
+        return;
+    }
+    pthread_mutex_lock(&capture.lock);
+    fflush(capture.file);
+    capture.lastFlush = monotonic_ms();
+    pthread_mutex_unlock(&capture.lock);
+}
+
+/*
+*   Records a client closing its connection.
+*/
+void capture_close(uint32_t connection) {
+    if (!capture.enabled) {
+        return;
+    }
+    capture_record(connection, CAPTURE_CLOSE, NULL, 0);
+}
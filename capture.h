@@ -0,0 +1,46 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "C499CAP"
+#define CAPTURE_VERSION 1
+// Most milliseconds a captured line waits in memory before it is written
+#define CAPTURE_FLUSH_INTERVAL 100
+
+// Types of captured events
+#define CAPTURE_LINE 1
+#define CAPTURE_CLOSE 2
+
+/*
+*   The start of a capture file.
+*/
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t created;
+} CaptureHeader;
+
+/*
+*   One line a client sent, without its newline, or the client closing its
+*   connection. The line's bytes follow the record. Times are microseconds
+*   since the previous record. Connections are numbered in the order the
+*   server accepted them, and a connection's first two lines are its
+*   handshake.
+*/
+typedef struct {
+    uint32_t connection;
+    uint32_t delay;
+    uint16_t length;
+    uint8_t type;
+    uint8_t reserved;
+} CaptureRecord;
+
+int capture_open(const char*);
+int capture_enabled(void);
+void capture_line(uint32_t, const char*, int);
+void capture_close(uint32_t);
+void capture_flush(void);
+
+#endif
@@ -0,0 +1,99 @@
+#include "cards.h"
+
+// Rank and suit of each character, plus one so that zero means invalid
+static const signed char rankIndex[256] = {
+    ['2'] = 1, ['3'] = 2, ['4'] = 3, ['5'] = 4, ['6'] = 5, ['7'] = 6,
+    ['8'] = 7, ['9'] = 8, ['T'] = 9, ['J'] = 10, ['Q'] = 11, ['K'] = 12,
+    ['A'] = 13
+};
+static const signed char suitIndex[256] = {
+    ['S'] = 1, ['C'] = 2, ['D'] = 3, ['H'] = 4
+};
+static const char ranks[] = "23456789TJQKA";
+static const char suits[] = "SCDH";
+
+/*
+*   Returns the index of the card with the given rank and suit, or NO_CARD
+*   if it is not a valid card.
+*/
+int card_index(char rank, char suit) {
+    int r = rankIndex[(unsigned char)rank];
+    int s = suitIndex[(unsigned char)suit];
+    if (!r || !s) {
+        return NO_CARD;
+    }
+    return (s - 1) * 13 + r - 1;
+}
+
+/*
+*   Converts a card index back to a card.
+*/
+Card card_from_index(int index) {
+    Card card;
+    card.rank = ranks[index % 13];
+    card.suit = suits[index / 13];
+    return card;
+}
+
+/*
+*   Converts a string of two character cards to a set of card bits. Invalid
+*   cards are ignored.
+*/
+uint64_t hand_from_string(const char* cards) {
+    uint64_t hand = 0;
+    for (int i = 0; cards[i] && cards[i + 1]; i += 2) {
+        int index = card_index(cards[i], cards[i + 1]);
+        if (index != NO_CARD) {
+            hand |= 1ULL << index;
+        }
+    }
+    return hand;
+}
+
+/*
+*   Returns the bits of every card in the given suit.
+*/
+uint64_t suit_mask(char suit) {
+    int s = suitIndex[(unsigned char)suit];
+    if (!s) {
+        return 0;
+    }
+    return 0x1FFFULL << ((s - 1) * 13);
+}
+
+/*
+*   Returns the cards in hand that may be played to a trick. A leadSuit of
+*   zero means the player is leading and may play anything, otherwise they
+*   must follow suit if they can.
+*/
+uint64_t legal_plays(uint64_t hand, char leadSuit) {
+    uint64_t following = hand & suit_mask(leadSuit);
+    return following ? following : hand;
+}
+
+/*
+*   Returns the number of cards in a hand.
+*/
+int hand_size(uint64_t hand) {
+    return __builtin_popcountll(hand);
+}
+
+/*
+*   Returns the index of the lowest card in a hand, or NO_CARD if it is
+*   empty.
+*/
+int lowest_card(uint64_t hand) {
+    return hand ? __builtin_ctzll(hand) : NO_CARD;
+}
+
+/*
+*   Returns the value of a bid, higher bids having higher values, or
+*   NO_CARD if it is not a valid bid.
+*/
+int bid_value(char rank, char suit) {
+    int s = suitIndex[(unsigned char)suit];
+    if (!s || rank < '4' || rank > '9') {
+        return NO_CARD;
+    }
+    return (rank - '4') * 4 + s - 1;
+}
@@ -0,0 +1,21 @@
+#ifndef CARDS_H
+#define CARDS_H
+
+#include <stdint.h>
+#include "game.h"
+
+// Cards are numbered suit * 13 + rank, with suits in bidding order
+// (S, C, D, H) and ranks from 2 up to A
+#define CARD_COUNT 52
+#define NO_CARD -1
+
+int card_index(char, char);
+Card card_from_index(int);
+uint64_t hand_from_string(const char*);
+uint64_t suit_mask(char);
+uint64_t legal_plays(uint64_t, char);
+int hand_size(uint64_t);
+int lowest_card(uint64_t);
+int bid_value(char, char);
+
+#endif
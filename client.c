@@ -2,15 +2,19 @@
 * Jamie Watts (43177039)
 *
 * client.c
-* Usage: client499 name game port [host]
-* A client to connect to the 499 game server.
+* Usage: client499 [-u path [-m]] name game port [host]
+* A client to connect to the 499 game server. With -u it connects to the
+* server's Unix socket at path instead, when the port and host may be left
+* out, and with -m its game is then carried over shared-memory rings.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <getopt.h>
 #include "game.h"
 #include "networking.h"
+#include "shmring.h"
 
 char* validate_arguments(int, char**);
 struct in_addr* convert_hostname(char*);
@@ -22,25 +26,44 @@ void play_tricks(Player*);
 
 // Global instance of the current player
 Player* player;
+// The server's Unix socket, if connecting to it, and whether to use rings
+char* localPath = NULL;
+int useRings = 0;
 
 int main(int argc, char *argv[]) {
     struct in_addr* ipAddress;
     int port;
     int fd;
+    ShmChannel* rings = NULL;
     // Validate port range and arguments
     char* hostname = validate_arguments(argc, argv);
+    argv += optind - 1;
     player = malloc(sizeof(Player));
-    ipAddress = convert_hostname(hostname);
-    port = atoi(argv[3]);
 
     player->name = argv[1];
 
-    fd = connect_to(ipAddress, port);
+    if (localPath != NULL) {
+        fd = connect_local(localPath);
+    } else {
+        ipAddress = convert_hostname(hostname);
+        port = atoi(argv[3]);
+        fd = connect_to(ipAddress, port);
+    }
 
     player->readFD = fdopen(fd, "r");
     player->writeFD = fdopen(fd, "w");
 
+    // The rings are passed before the handshake, which still goes over the
+    // socket. The socket is then only kept to see the server go.
+    if (useRings && (rings = shm_channel_open(fd)) == NULL) {
+        fprintf(stderr, "Bad Server.\n");
+        exit(2);
+    }
     send_server_information(player->writeFD, player->name, argv[2]);
+    if (rings != NULL) {
+        player->readFD = shm_channel_fopen(rings, "r");
+        player->writeFD = shm_channel_fopen(rings, "w");
+    }
 
     // Read in three informational messages
     for (int i = 0; i < 3; i++) {
@@ -108,11 +131,20 @@ void play_tricks(Player* player) {
     for (int i = 0; i < 13; i++) {
         char* msg = read_socket_message(player->readFD);
         char type = get_message_type(msg);
-        if (type != 'L' && type != 'P' && type != 'M') {
+        if (type != 'L' && type != 'P' && type != 'M' && type != 'A') {
             fprintf(stderr, "Protocol Error.\n");
             exit(6);
         } else if (type == 'M') {
             i--;
+        } else if (type == 'A') {
+            // The server played our only legal card for us
+            Card forced;
+            char info[32];
+            read_card_input_from_string(&forced, msg + 1);
+            remove_card_from_hand(player, &forced);
+            sprintf(info, "Played %c%c", forced.rank, forced.suit);
+            print_message(info);
+            free(msg);
         } else {
             memmove(msg, msg + 1, strlen(msg));
             ask_for_play(msg, player);
@@ -123,7 +155,15 @@ void play_tricks(Player* player) {
                 memmove(msg, msg + 1, strlen(msg));
                 if (type == 'M') {
 
+                } else if (type == 'L' || type == 'P') {
+                    // The server rejected the card and wants another
+                    ask_for_play(msg, player);
                 } else if (type == 'A') {
+                    // A card in the acknowledgement was played for us
+                    // instead of the one we sent
+                    if (strlen(msg) >= 2) {
+                        read_card_input_from_string(player->lastPlay, msg);
+                    }
                     remove_card_from_hand(player, player->lastPlay);
                     free(msg);
                     break;
@@ -137,17 +177,35 @@ void play_tricks(Player* player) {
 }
 
 /*
-*   Validate the input arguments given to the client.
-*   Returns the hostname of the server
+*   Validate the input arguments given to the client. Options come before
+*   the name, and the port may be left out when connecting to the Unix
+*   socket. Returns the hostname of the server
 */
 char* validate_arguments(int argc, char** argv) {
-    if (argc < 4 || argc > 5) {
+    int option;
+    while ((option = getopt(argc, argv, "+u:m")) != -1) {
+        if (option == 'u') {
+            localPath = optarg;
+        } else if (option == 'm') {
+            useRings = 1;
+        } else {
+            fprintf(stderr, "Usage: client499 [-u path [-m]] name game "
+                    "port [host]\n");
+            exit(1);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (argc < (localPath != NULL ? 3 : 4) || argc > 5 ||
+            (useRings && localPath == NULL)) {
         // Throw usage error (exit(1))
-        fprintf(stderr, "Usage: client499 name game port [host]\n");
+        fprintf(stderr, "Usage: client499 [-u path [-m]] name game port "
+                "[host]\n");
         exit(1);
     }
     char** remainder = malloc(sizeof(char**));
-    int port = strtol(argv[3], remainder, 10);
+    *remainder = "";
+    int port = argc > 3 ? strtol(argv[3], remainder, 10) : 1;
     if (strcmp(*remainder, "") || port < 1 || port > 65535 ||
             !strcmp(argv[1], "") || !strcmp(argv[2], "")) {
         // Throw invalid arguments error (exit(4))
@@ -156,7 +214,7 @@ char* validate_arguments(int argc, char** argv) {
     }
     free(remainder);
     char* hostname;
-    if (argc == 4) {
+    if (argc <= 4) {
         hostname = malloc(sizeof("localhost"));
         hostname = "localhost";
     } else {
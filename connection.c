@@ -0,0 +1,519 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include "connection.h"
+#include "metrics.h"
+#include "shmring.h"
+
+// The backend every thread creates, chosen once at startup
+static int selected = IO_EPOLL;
+
+/*
+*   Chooses the backend by name. io_uring falls back to epoll if the kernel
+*   cannot do everything it needs. Returns 0 if the name is unknown.
+*/
+int io_backend_select(const char* name) {
+    if (!strcmp(name, "epoll")) {
+        selected = IO_EPOLL;
+    } else if (!strcmp(name, "uring")) {
+        selected = IO_URING;
+        if (!uring_supported()) {
+            fprintf(stderr, "serv499: io_uring is not supported, "
+                    "using epoll\n");
+            selected = IO_EPOLL;
+        }
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+*   Returns the name of the backend in use.
+*/
+const char* io_backend_name(void) {
+    return selected == IO_URING ? "uring" : "epoll";
+}
+
+/*
+*   Returns whether connections may be carried over shared-memory rings,
+*   which only the epoll backend knows how to wait on.
+*/
+int io_backend_carries_rings(void) {
+    return selected == IO_EPOLL;
+}
+
+/*
+*   Creates a backend for the calling thread. A ring can still fail to set
+*   up, for instance when locked memory runs out, and then that thread
+*   uses epoll.
+*/
+IoBackend* io_backend_create(void) {
+    IoBackend* io = NULL;
+    if (selected == IO_URING) {
+        io = uring_backend_create();
+    }
+    if (io == NULL) {
+        io = epoll_backend_create();
+    }
+    return io;
+}
+
+/*
+*   Frees a backend once nothing uses it.
+*/
+void io_backend_destroy(IoBackend* io) {
+    io->ops->destroy(io);
+}
+
+/*
+*   Drops a player who has stopped reading. Whatever was queued for them is
+*   thrown away and shutting the socket down ends anything the backend
+*   still has in flight on it. The table sees them disconnect the next time
+*   it asks them for a move.
+*/
+static void evict(Connection* connection) {
+    METRIC_ADD(slowEvictions, 1);
+    connection->closed = 1;
+    connection->outLength = 0;
+    shutdown(connection->fd, SHUT_RDWR);
+}
+
+/*
+*   Marks a connection slow once its queue passes the high watermark, and
+*   not slow once it falls below the low one. A closing connection is slow
+*   for as long as anything is left to send. Returns the milliseconds until
+*   the connection is due to be dropped, or -1 if it is not slow.
+*/
+static int check_slow(Connection* connection, long now) {
+    int high = connection->closing ? 1 : CONNECTION_HIGH_WATER;
+    int low = connection->closing ? 1 : CONNECTION_LOW_WATER;
+    if (connection->closed) {
+        return -1;
+    } else if (connection->outLength >= high && !connection->slow) {
+        if (!connection->closing) {
+            METRIC_ADD(slowConsumers, 1);
+        }
+        connection->slow = 1;
+        connection->slowSince = now;
+    } else if (connection->outLength < low) {
+        connection->slow = 0;
+    }
+    if (!connection->slow) {
+        return -1;
+    }
+    long left = connection->slowSince + CONNECTION_SLOW_GRACE - now;
+    if (left <= 0) {
+        evict(connection);
+        return -1;
+    }
+    return left;
+}
+
+/*
+*   Starts sending on every connection with messages waiting, drops slow
+*   connections that are overdue and takes connections with nothing left
+*   off the list. Returns the milliseconds until the next slow connection
+*   is due to be dropped, or -1 if there are none.
+*/
+int io_backend_service(IoBackend* io,
+        void (*send)(IoBackend*, Connection*)) {
+    Connection** link = &io->dirty;
+    long now = io->dirty != NULL ? monotonic_ms() : 0;
+    int timeout = -1;
+    while (*link != NULL) {
+        Connection* connection = *link;
+        if (connection->outLength && !connection->closed) {
+            send(io, connection);
+        }
+        int left = check_slow(connection, now);
+        if (left >= 0 && (timeout < 0 || left < timeout)) {
+            timeout = left;
+        }
+        if (connection->outLength && !connection->closed) {
+            link = &connection->nextDirty;
+        } else {
+            connection->dirty = 0;
+            *link = connection->nextDirty;
+        }
+    }
+    return timeout;
+}
+
+/*
+*   The epoll backend, which waits on its connections with poll.
+*/
+typedef struct {
+    IoBackend base;
+    struct pollfd* polls;
+    int pollCapacity;
+} EpollBackend;
+
+/*
+*   Writes as much of a connection's queue as the socket or ring will take.
+*/
+static void epoll_send(IoBackend* io, Connection* connection) {
+    int sent = 0;
+    if (connection->shm != NULL) {
+        sent = shm_channel_write(connection->shm, connection->out,
+                connection->outLength);
+        if (sent < 0) {
+            connection->outLength = 0;
+            return;
+        }
+    }
+    while (sent < connection->outLength && connection->shm == NULL) {
+        ssize_t count = send(connection->fd, connection->out + sent,
+                connection->outLength - sent, MSG_NOSIGNAL);
+        METRIC_ADD(ioSyscalls, 1);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        } else if (count < 0 && errno == EAGAIN) {
+            break;
+        } else if (count <= 0) {
+            // The player has gone, which their next read will show
+            connection->outLength = 0;
+            return;
+        }
+        sent += count;
+    }
+    memmove(connection->out, connection->out + sent,
+            connection->outLength - sent);
+    connection->outLength -= sent;
+}
+
+/*
+*   Writes what every connection will take, one system call each.
+*/
+static int epoll_flush(IoBackend* io) {
+    return io_backend_service(io, epoll_send);
+}
+
+/*
+*   Sends what it can and then waits until the connection is ready for
+*   events, a connection with messages left can take more, or a slow
+*   connection is due to be dropped. Returns 1 if the connection is ready.
+*   A ring's doorbell is rung both when there is something to read and
+*   when there is room to write, so that is all that is waited for on a
+*   ring, along with its socket closing.
+*/
+static int epoll_wait_for(IoBackend* io, Connection* connection,
+        short events) {
+    EpollBackend* epoll = (EpollBackend*)io;
+    ShmChannel* shm = connection->shm;
+    int timeout = epoll_flush(io);
+    if (connection->closed) {
+        return 0;
+    }
+    int count = 2;
+    for (Connection* c = io->dirty; c != NULL; c = c->nextDirty) {
+        count++;
+    }
+    if (count > epoll->pollCapacity) {
+        epoll->pollCapacity = count * 2;
+        epoll->polls = realloc(epoll->polls,
+                sizeof(struct pollfd) * epoll->pollCapacity);
+    }
+    // The connection's own messages may be what its player is waiting for
+    if (shm == NULL) {
+        epoll->polls[0].fd = connection->fd;
+        epoll->polls[0].events = events | (connection->dirty ? POLLOUT : 0);
+        count = 1;
+    } else if (!shm_channel_prepare_wait(shm, events == POLLIN,
+            connection->dirty || events == POLLOUT)) {
+        return 1;
+    } else {
+        epoll->polls[0].fd = shm->bell;
+        epoll->polls[0].events = POLLIN;
+        epoll->polls[1].fd = connection->fd;
+        epoll->polls[1].events = POLLIN;
+        count = 2;
+    }
+    for (Connection* c = io->dirty; c != NULL; c = c->nextDirty) {
+        if (c == connection) {
+            continue;
+        } else if (c->shm == NULL) {
+            epoll->polls[count].fd = c->fd;
+            epoll->polls[count++].events = POLLOUT;
+        } else {
+            if (!shm_channel_prepare_wait(c->shm, 0, 1)) {
+                timeout = 0;
+            }
+            epoll->polls[count].fd = c->shm->bell;
+            epoll->polls[count++].events = POLLIN;
+        }
+    }
+    int ready = poll(epoll->polls, count, timeout);
+    METRIC_ADD(ioSyscalls, 1);
+    for (Connection* c = io->dirty; c != NULL; c = c->nextDirty) {
+        if (c != connection && c->shm != NULL) {
+            shm_channel_finish_wait(c->shm);
+        }
+    }
+    if (shm != NULL) {
+        if (ready > 0 && epoll->polls[1].revents) {
+            shm->gone = 1;
+        }
+        shm_channel_finish_wait(shm);
+        return ready > 0 &&
+                (epoll->polls[0].revents || epoll->polls[1].revents);
+    }
+    return ready > 0 &&
+            (epoll->polls[0].revents & (events | POLLHUP | POLLERR));
+}
+
+/*
+*   Waits for the connection to become readable and reads it. A ring's
+*   client is only gone once everything it wrote has been read.
+*/
+static int epoll_receive(IoBackend* io, Connection* connection) {
+    while (!connection->closed) {
+        if (!epoll_wait_for(io, connection, POLLIN)) {
+            continue;
+        } else if (connection->shm != NULL) {
+            int count = shm_channel_read(connection->shm,
+                    connection->in + connection->inEnd,
+                    CONNECTION_BUFFER - connection->inEnd);
+            if (count > 0) {
+                connection->inEnd += count;
+                return 1;
+            } else if (count < 0 || connection->shm->gone) {
+                return 0;
+            }
+            continue;
+        }
+        ssize_t count = read(connection->fd,
+                connection->in + connection->inEnd,
+                CONNECTION_BUFFER - connection->inEnd);
+        METRIC_ADD(ioSyscalls, 1);
+        if (count > 0) {
+            connection->inEnd += count;
+            return 1;
+        } else if (count == 0 || (errno != EAGAIN && errno != EINTR)) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/*
+*   Waits until a closing connection's messages have gone, or it is dropped
+*   for taking too long.
+*/
+static void epoll_release(IoBackend* io, Connection* connection) {
+    while (connection->outLength && !connection->closed) {
+        epoll_wait_for(io, connection, POLLOUT);
+    }
+}
+
+/*
+*   The reactor waits on the listening socket itself.
+*/
+static int epoll_listen(IoBackend* io, int listenFD) {
+    return listenFD;
+}
+
+/*
+*   Accepts the next waiting connection without blocking.
+*/
+static int epoll_accept(IoBackend* io, int listenFD, struct sockaddr_in* from,
+        socklen_t* fromSize) {
+    int fd = accept4(listenFD, (struct sockaddr*)from, fromSize,
+            SOCK_NONBLOCK);
+    METRIC_ADD(ioSyscalls, 1);
+    if (fd >= 0) {
+        return fd;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+            errno == ECONNABORTED) {
+        return -1;
+    }
+    return -2;
+}
+
+static void epoll_destroy(IoBackend* io) {
+    free(((EpollBackend*)io)->polls);
+    free(io);
+}
+
+static const IoBackendOps epollOps = {
+    "epoll",
+    epoll_receive,
+    epoll_flush,
+    epoll_release,
+    epoll_listen,
+    epoll_accept,
+    epoll_destroy
+};
+
+/*
+*   Creates the epoll backend. Reactors wait on epoll as they always have,
+*   and each connection is read and written with plain system calls.
+*/
+IoBackend* epoll_backend_create(void) {
+    EpollBackend* epoll = calloc(1, sizeof(EpollBackend));
+    epoll->base.ops = &epollOps;
+    return &epoll->base;
+}
+
+/*
+*   Creates a connection for a socket, not yet owned by any backend.
+*   Messages are already gathered into one write each time the table waits,
+*   so Nagle's algorithm would only hold them back.
+*/
+Connection* connection_create(int fd) {
+    int one = 1;
+    Connection* connection = calloc(1, sizeof(Connection));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    connection->fd = fd;
+    connection->out = malloc(CONNECTION_OUTPUT);
+    connection->outCapacity = CONNECTION_OUTPUT;
+    return connection;
+}
+
+/*
+*   Puts a connection on its backend's list of those with messages waiting.
+*/
+static void mark_dirty(Connection* connection) {
+    connection->dirty = 1;
+    connection->nextDirty = connection->io->dirty;
+    connection->io->dirty = connection;
+}
+
+/*
+*   Hands a connection to the backend of the thread that will use it.
+*/
+void connection_attach(Connection* connection, IoBackend* io) {
+    connection->io = io;
+    if (connection->outLength && !connection->dirty) {
+        mark_dirty(connection);
+    }
+}
+
+/*
+*   Makes room for needed bytes of messages. A send in flight may still be
+*   reading the old queue, so it is kept until the send completes.
+*/
+static void grow_output(Connection* connection, int needed) {
+    while (connection->outCapacity < needed) {
+        connection->outCapacity *= 2;
+    }
+    if (!connection->sending) {
+        connection->out = realloc(connection->out, connection->outCapacity);
+        return;
+    }
+    char* out = malloc(connection->outCapacity);
+    memcpy(out, connection->out, connection->outLength);
+    if (connection->retired == NULL) {
+        connection->retired = connection->out;
+    } else {
+        free(connection->out);
+    }
+    connection->out = out;
+}
+
+/*
+*   Queues a message and its newline to be sent the next time the thread
+*   waits for a player or closes a connection. A player with too much
+*   already queued is dropped instead.
+*/
+void connection_send(Connection* connection, const char* message) {
+    int length = strlen(message);
+    int needed = connection->outLength + length + 1;
+    if (connection->closed) {
+        return;
+    } else if (needed > CONNECTION_OUTPUT_LIMIT) {
+        evict(connection);
+        return;
+    } else if (needed > connection->outCapacity) {
+        grow_output(connection, needed);
+    }
+    memcpy(connection->out + connection->outLength, message, length);
+    connection->out[needed - 1] = '\n';
+    connection->outLength = needed;
+    long peak = __atomic_load_n(&metrics.outputPeak, __ATOMIC_RELAXED);
+    while (needed > peak && !__atomic_compare_exchange_n(&metrics.outputPeak,
+            &peak, needed, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    if (!connection->dirty && connection->io != NULL) {
+        mark_dirty(connection);
+    }
+}
+
+/*
+*   Writes a message and its newline straight away, as far as the socket
+*   or ring will take it without waiting, for a connection that no backend
+*   sends for yet.
+*/
+void connection_send_now(Connection* connection, const char* message) {
+    int length = strlen(message);
+    char* line = malloc(length + 1);
+    memcpy(line, message, length);
+    line[length] = '\n';
+    if (connection->shm != NULL) {
+        shm_channel_write(connection->shm, line, length + 1);
+    } else {
+        send(connection->fd, line, length + 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    free(line);
+}
+
+/*
+*   Returns the next line from the connection without its newline, or "EOF"
+*   once it has closed. The line stays valid until the connection is next
+*   read. A line too long for the buffer closes the connection.
+*/
+char* connection_read_line(Connection* connection) {
+    while (1) {
+        char* start = connection->in + connection->inStart;
+        char* newline = memchr(start, '\n',
+                connection->inEnd - connection->inStart);
+        if (newline != NULL) {
+            *newline = '\0';
+            connection->inStart = newline + 1 - connection->in;
+            return start;
+        }
+        if (connection->closed) {
+            return "EOF";
+        }
+        if (connection->inStart > 0) {
+            memmove(connection->in, start,
+                    connection->inEnd - connection->inStart);
+            connection->inEnd -= connection->inStart;
+            connection->inStart = 0;
+        }
+        if (connection->inEnd == CONNECTION_BUFFER ||
+                !connection->io->ops->receive(connection->io, connection)) {
+            connection->closed = 1;
+        }
+    }
+}
+
+/*
+*   Sends anything still waiting and closes the connection. A player who
+*   will not take the last messages is only waited for so long.
+*/
+void connection_close(Connection* connection) {
+    IoBackend* io = connection->io;
+    if (io != NULL) {
+        connection->closing = 1;
+        io->ops->release(io, connection);
+        Connection** link = &io->dirty;
+        while (*link != NULL && *link != connection) {
+            link = &(*link)->nextDirty;
+        }
+        if (*link != NULL) {
+            *link = connection->nextDirty;
+        }
+    }
+    if (connection->shm != NULL) {
+        shm_channel_close(connection->shm);
+    }
+    close(connection->fd);
+    free(connection->retired);
+    free(connection->out);
+    free(connection);
+}
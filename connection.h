@@ -0,0 +1,101 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Longest line a player may send, newline included
+#define CONNECTION_BUFFER 4096
+// Room first given to a connection's unsent messages
+#define CONNECTION_OUTPUT 1024
+// Unsent bytes above which a connection is marked slow, and below which it
+// is no longer slow
+#define CONNECTION_HIGH_WATER (64 * 1024)
+#define CONNECTION_LOW_WATER (16 * 1024)
+// Most unsent bytes a connection may have before it is dropped at once
+#define CONNECTION_OUTPUT_LIMIT (256 * 1024)
+// Milliseconds a connection may stay slow, or take to drain when it is
+// being closed, before it is dropped
+#define CONNECTION_SLOW_GRACE 2000
+
+// Backends that can carry the server's connections
+#define IO_EPOLL 0
+#define IO_URING 1
+
+/*
+*   A player's connection to the server. Messages are gathered in out until
+*   the table next waits for a player, when the backend sends every
+*   connection's messages together without blocking. Whatever the player
+*   is not ready for stays queued, and a player who stops reading is
+*   dropped rather than holding up the table. Lines read are kept in in.
+*   A client on the same host may carry its connection over shared-memory
+*   rings instead, when fd is only the socket they were set up over.
+*/
+typedef struct Connection {
+    int fd;
+    struct ShmChannel* shm;
+    unsigned int id;
+    struct IoBackend* io;
+    char in[CONNECTION_BUFFER];
+    int inStart;
+    int inEnd;
+    char* out;
+    int outLength;
+    int outCapacity;
+    char* retired;
+    int closed;
+    int closing;
+    int slow;
+    long slowSince;
+    int dirty;
+    int receiving;
+    int sending;
+    struct Connection* nextDirty;
+} Connection;
+
+/*
+*   What a backend does. Every operation is only called by the thread that
+*   owns the backend. receive sends what it can and then waits for more
+*   input on one connection, returning 0 if it has closed. flush only
+*   starts sending and returns the milliseconds until a slow connection is
+*   next due to be dropped, or -1 if none is. release waits for a closing
+*   connection's messages to go and then for the backend to let go of it.
+*   accept returns the next connection on a listening socket, -1 when there
+*   are no more for now or -2 if the socket has failed.
+*/
+typedef struct IoBackendOps {
+    const char* name;
+    int (*receive)(struct IoBackend*, Connection*);
+    int (*flush)(struct IoBackend*);
+    void (*release)(struct IoBackend*, Connection*);
+    int (*listen)(struct IoBackend*, int);
+    int (*accept)(struct IoBackend*, int, struct sockaddr_in*, socklen_t*);
+    void (*destroy)(struct IoBackend*);
+} IoBackendOps;
+
+/*
+*   One thread's backend. The connections with messages not yet sent are
+*   kept in a list.
+*/
+typedef struct IoBackend {
+    const IoBackendOps* ops;
+    Connection* dirty;
+} IoBackend;
+
+int io_backend_select(const char*);
+const char* io_backend_name(void);
+IoBackend* io_backend_create(void);
+void io_backend_destroy(IoBackend*);
+int io_backend_service(IoBackend*, void (*)(IoBackend*, Connection*));
+IoBackend* epoll_backend_create(void);
+int uring_supported(void);
+IoBackend* uring_backend_create(void);
+int io_backend_carries_rings(void);
+Connection* connection_create(int);
+void connection_attach(Connection*, IoBackend*);
+void connection_send(Connection*, const char*);
+void connection_send_now(Connection*, const char*);
+char* connection_read_line(Connection*);
+void connection_close(Connection*);
+
+#endif
@@ -0,0 +1,140 @@
+/*
+* deal.c
+* Usage: deal499 [-t threads] [-s seed] [-T table] count file
+* Writes a deck file of count deals shuffled from a seed, the same way
+* serv499 -s deals them. Deal i of the file, counting from 0, is the one
+* serv499 deals as hand i + 1 of the given table, which is table 1 unless
+* -T says otherwise, so any of them can be made again.
+*/
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "decks.h"
+
+// Deals each thread shuffles and writes at a time
+#define DEALS_PER_BLOCK 16384
+
+void usage(void);
+void* write_deals(void*);
+
+uint64_t seed;
+// Table, as numbered by serv499 from 1, whose hands are dealt
+uint32_t table = 1;
+long count;
+int fd;
+// Next block for a thread to take
+long nextBlock = 0;
+int failed = 0;
+
+int main(int argc, char** argv) {
+    int option;
+    int threadCount = 0;
+    char* end;
+    struct timespec start, stop;
+    seed = time(NULL);
+    while ((option = getopt(argc, argv, "t:s:T:")) != -1) {
+        switch (option) {
+            case 't':
+                threadCount = atoi(optarg);
+                break;
+            case 's':
+                seed = strtoull(optarg, &end, 0);
+                if (*end != '\0') {
+                    usage();
+                }
+                break;
+            case 'T':
+                table = strtoul(optarg, &end, 10);
+                if (*end != '\0' || table < 1) {
+                    usage();
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+    }
+    count = strtol(argv[optind], &end, 10);
+    if (*end != '\0' || count < 1) {
+        usage();
+    }
+    if (threadCount <= 0) {
+        threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    fd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, count * (DECK_LENGTH + 1)) < 0) {
+        fprintf(stderr, "Cannot write %s\n", argv[optind + 1]);
+        exit(2);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t* threads = malloc(sizeof(pthread_t) * threadCount);
+    for (int i = 0; i < threadCount; i++) {
+        pthread_create(&threads[i], NULL, write_deals, NULL);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    if (failed || close(fd) < 0) {
+        fprintf(stderr, "Cannot write %s\n", argv[optind + 1]);
+        exit(2);
+    }
+    double seconds = (stop.tv_sec - start.tv_sec) +
+            (stop.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "seed %llu, %ld deals in %.3f s, %.2f GB/s\n",
+            (unsigned long long)seed, count, seconds,
+            count * (DECK_LENGTH + 1) / seconds / 1e9);
+    return 0;
+}
+
+/*
+*   Prints the usage message and exits.
+*/
+void usage(void) {
+    fprintf(stderr, "Usage: deal499 [-t threads] [-s seed] [-T table] count "
+            "file\n");
+    exit(1);
+}
+
+/*
+*   A worker thread. Shuffles a block of deals at a time into its own
+*   buffer and writes it to its place in the file.
+*/
+void* write_deals(void* arg) {
+    char* buffer = malloc((size_t)DEALS_PER_BLOCK * (DECK_LENGTH + 1) + 1);
+    while (1) {
+        long first = __atomic_fetch_add(&nextBlock, 1, __ATOMIC_RELAXED) *
+                DEALS_PER_BLOCK;
+        if (first >= count) {
+            break;
+        }
+        long deals = count - first < DEALS_PER_BLOCK ? count - first :
+                DEALS_PER_BLOCK;
+        for (long i = 0; i < deals; i++) {
+            char* deck = buffer + i * (DECK_LENGTH + 1);
+            generate_deck(deal_seed(seed, table, first + i + 1), deck);
+            deck[DECK_LENGTH] = '\n';
+        }
+        size_t size = deals * (DECK_LENGTH + 1);
+        off_t offset = first * (DECK_LENGTH + 1);
+        size_t written = 0;
+        while (written < size) {
+            ssize_t n = pwrite(fd, buffer + written, size - written,
+                    offset + written);
+            if (n <= 0) {
+                __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            written += n;
+        }
+    }
+    free(buffer);
+    return arg;
+}
@@ -0,0 +1,181 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "deckcache.h"
+#include "metrics.h"
+
+/*
+*   The analyses of the server's decks, mapped from the file beside the
+*   deck file. A deal's analysis can be read from any thread once its
+*   solved flag is set.
+*/
+static struct {
+    AnalysisHeader* header;
+    DealAnalysis* deals;
+    size_t size;
+    char** decks;
+    int deckCount;
+    pthread_t analyser;
+} cache;
+
+// Transposition table entries the analyser uses. It solves one deal at a
+// time, and a deal's positions fit in far less than the solver's default.
+#define DEAL_TABLE_SIZE (1 << 19)
+
+static void* analyse_decks(void*);
+
+/*
+*   Returns whether a mapped cache file was made from the same decks.
+*/
+static int cache_matches(uint64_t hash, int deckCount) {
+    return !memcmp(cache.header->magic, ANALYSIS_MAGIC,
+            sizeof(ANALYSIS_MAGIC)) &&
+            cache.header->version == ANALYSIS_VERSION &&
+            cache.header->recordSize == sizeof(DealAnalysis) &&
+            cache.header->deckCount == (uint32_t)deckCount &&
+            cache.header->deckHash == hash;
+}
+
+/*
+*   Maps a cache file, starting it afresh if it was made from other decks.
+*   A file that cannot be written is still used if it holds these decks'
+*   analyses, but new ones are only kept in memory. Leaves cache.header
+*   MAP_FAILED if the file cannot be used.
+*/
+static void map_cache_file(const char* path, uint64_t hash, int deckCount) {
+    struct stat info;
+    int shared = MAP_SHARED;
+    cache.header = MAP_FAILED;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        shared = MAP_PRIVATE;
+    }
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size == cache.size) {
+        cache.header = mmap(NULL, cache.size, PROT_READ | PROT_WRITE,
+                shared, fd, 0);
+        if (cache.header != MAP_FAILED &&
+                !cache_matches(hash, deckCount)) {
+            munmap(cache.header, cache.size);
+            cache.header = MAP_FAILED;
+        }
+    }
+    // Stale or new, so every deal is analysed again. The blocks are
+    // allocated up front, since running out of disk while writing through
+    // the mapping would kill the server.
+    if (cache.header == MAP_FAILED && shared == MAP_SHARED &&
+            ftruncate(fd, 0) == 0 &&
+            posix_fallocate(fd, 0, cache.size) == 0) {
+        cache.header = mmap(NULL, cache.size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (cache.header != MAP_FAILED && shared == MAP_PRIVATE) {
+        fprintf(stderr, "serv499: cannot write %s, new analyses are kept "
+                "in memory\n", path);
+    }
+}
+
+/*
+*   Maps the analyses of the decks from cacheFile, or deckFile.cache if it
+*   is NULL, and starts a low priority thread analysing any deals it does
+*   not yet hold. If cacheFile is DECK_CACHE_MEMORY or the file cannot be
+*   used the analyses are only kept in memory. Returns 0 if there is no
+*   memory for them either.
+*/
+int deck_cache_open(const char* deckFile, const char* cacheFile,
+        char** decks, int deckCount) {
+    char path[4096];
+    uint64_t hash = deck_hash(decks, deckCount);
+    cache.decks = decks;
+    cache.deckCount = deckCount;
+    cache.size = sizeof(AnalysisHeader) + sizeof(DealAnalysis) * deckCount;
+
+    if (cacheFile == NULL) {
+        snprintf(path, sizeof(path), "%s.cache", deckFile);
+        cacheFile = path;
+    }
+    cache.header = MAP_FAILED;
+    if (strcmp(cacheFile, DECK_CACHE_MEMORY)) {
+        map_cache_file(cacheFile, hash, deckCount);
+        if (cache.header == MAP_FAILED) {
+            fprintf(stderr, "serv499: cannot use %s, analysing decks in "
+                    "memory\n", cacheFile);
+        }
+    }
+    if (cache.header == MAP_FAILED) {
+        cache.header = mmap(NULL, cache.size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (cache.header == MAP_FAILED) {
+            return 0;
+        }
+    }
+    if (!cache_matches(hash, deckCount)) {
+        memcpy(cache.header->magic, ANALYSIS_MAGIC, sizeof(ANALYSIS_MAGIC));
+        cache.header->version = ANALYSIS_VERSION;
+        cache.header->recordSize = sizeof(DealAnalysis);
+        cache.header->deckCount = deckCount;
+        cache.header->deckHash = hash;
+    }
+    cache.deals = (DealAnalysis*)(cache.header + 1);
+
+    for (int i = 0; i < deckCount; i++) {
+        if (!cache.deals[i].solved) {
+            pthread_create(&cache.analyser, NULL, analyse_decks, NULL);
+            pthread_detach(cache.analyser);
+            break;
+        }
+    }
+    return 1;
+}
+
+/*
+*   Returns the analysis of a deck, or NULL if it is not done yet.
+*/
+const DealAnalysis* deck_analysis(int deck) {
+    if (cache.deals == NULL ||
+            !__atomic_load_n(&cache.deals[deck].solved, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &cache.deals[deck];
+}
+
+/*
+*   The analyser thread. It runs only when nothing else wants the CPU,
+*   solving each deal the cache lacks and publishing it by setting its
+*   solved flag last.
+*/
+static void* analyse_decks(void* arg) {
+    struct sched_param param = {0};
+    SolverTable table;
+    Solver solver;
+    DealAnalysis analysis;
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    if (!solver_table_init(&table, DEAL_TABLE_SIZE)) {
+        fprintf(stderr, "serv499: no memory to analyse decks\n");
+        return arg;
+    }
+    solver_init(&solver, &table);
+    for (int i = 0; i < cache.deckCount; i++) {
+        if (cache.deals[i].solved ||
+                !analyse_deal(&solver, cache.decks[i], &analysis)) {
+            continue;
+        }
+        analysis.solved = 0;
+        memcpy(&cache.deals[i], &analysis, sizeof(DealAnalysis));
+        __atomic_store_n(&cache.deals[i].solved, 1, __ATOMIC_RELEASE);
+        METRIC_ADD(deckAnalyses, 1);
+    }
+    msync(cache.header, cache.size, MS_ASYNC);
+    solver_table_free(&table);
+    return arg;
+}
@@ -0,0 +1,14 @@
+#ifndef DECKCACHE_H
+#define DECKCACHE_H
+
+#include "analysis.h"
+
+// Cache file names that keep the analyses only in memory, or that turn
+// analysing the decks off altogether
+#define DECK_CACHE_MEMORY "memory"
+#define DECK_CACHE_OFF "off"
+
+int deck_cache_open(const char*, const char*, char**, int);
+const DealAnalysis* deck_analysis(int);
+
+#endif
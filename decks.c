@@ -0,0 +1,390 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define HAVE_SSSE3 1
+#endif
+#include "cards.h"
+#include "decks.h"
+
+// Every card exactly once
+#define FULL_DECK ((1ULL << CARD_COUNT) - 1)
+
+/*
+*   A share of a deck file for one thread to check or prepare. bad is the
+*   first deck in the share that fails, or last if none do.
+*/
+typedef struct {
+    char** decks;
+    Deal* deals;
+    long first;
+    long last;
+    long bad;
+} DeckRange;
+
+static int (*convert_deck)(const char*, uint8_t*);
+// Every card's two characters, in index order
+static uint16_t ordered[CARD_COUNT];
+
+/*
+*   Converts a deck one card at a time. Returns 0 if any card is invalid.
+*/
+static int convert_scalar(const char* deck, uint8_t* indices) {
+    for (int i = 0; i < CARD_COUNT; i++) {
+        int index = card_index(deck[i * 2], deck[i * 2 + 1]);
+        if (index == NO_CARD) {
+            return 0;
+        }
+        indices[i] = index;
+    }
+    return 1;
+}
+
+#ifdef HAVE_SSSE3
+/*
+*   Converts the cards in 16 characters at once, of which only the bytes
+*   set in mask are used. Each character is looked up by its low nibble in
+*   the table for its high nibble, ranks at even bytes and suits at odd,
+*   with 0xFF marking characters that are not part of a card. Pairs are
+*   then combined into rank + 13 * suit with one multiply-add. Returns 0
+*   if any card is invalid.
+*/
+__attribute__((target("ssse3")))
+static int convert_chunk(__m128i chars, uint8_t* indices, int mask) {
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i none = _mm_set1_epi8(-1);
+    // 2 to 9, then A J K, then Q T
+    const __m128i ranks3 = _mm_setr_epi8(-1, -1, 0, 1, 2, 3, 4, 5, 6, 7,
+            -1, -1, -1, -1, -1, -1);
+    const __m128i ranks4 = _mm_setr_epi8(-1, 12, -1, -1, -1, -1, -1, -1, -1,
+            -1, 9, 11, -1, -1, -1, -1);
+    const __m128i ranks5 = _mm_setr_epi8(-1, 10, -1, -1, 8, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1);
+    // C D H, then S
+    const __m128i suits4 = _mm_setr_epi8(-1, -1, -1, 1, 2, -1, -1, -1, 3,
+            -1, -1, -1, -1, -1, -1, -1);
+    const __m128i suits5 = _mm_setr_epi8(-1, -1, -1, 0, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1);
+    const __m128i even = _mm_set1_epi16(0x00FF);
+    const __m128i weights = _mm_set1_epi16(13 << 8 | 1);
+
+    __m128i low = _mm_and_si128(chars, nibble);
+    __m128i high = _mm_and_si128(_mm_srli_epi16(chars, 4), nibble);
+    __m128i in3 = _mm_cmpeq_epi8(high, _mm_set1_epi8(3));
+    __m128i in4 = _mm_cmpeq_epi8(high, _mm_set1_epi8(4));
+    __m128i in5 = _mm_cmpeq_epi8(high, _mm_set1_epi8(5));
+    __m128i elsewhere = _mm_andnot_si128(_mm_or_si128(in3,
+            _mm_or_si128(in4, in5)), none);
+
+    __m128i rank = _mm_or_si128(_mm_or_si128(
+            _mm_and_si128(in3, _mm_shuffle_epi8(ranks3, low)),
+            _mm_and_si128(in4, _mm_shuffle_epi8(ranks4, low))),
+            _mm_or_si128(_mm_and_si128(in5, _mm_shuffle_epi8(ranks5, low)),
+            elsewhere));
+    __m128i suit = _mm_or_si128(_mm_or_si128(in3,
+            _mm_and_si128(in4, _mm_shuffle_epi8(suits4, low))),
+            _mm_or_si128(_mm_and_si128(in5, _mm_shuffle_epi8(suits5, low)),
+            elsewhere));
+    __m128i values = _mm_or_si128(_mm_and_si128(even, rank),
+            _mm_andnot_si128(even, suit));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(values, none)) & mask) {
+        return 0;
+    }
+    __m128i cards = _mm_maddubs_epi16(values, weights);
+    _mm_storel_epi64((__m128i*)indices, _mm_packus_epi16(cards, cards));
+    return 1;
+}
+
+/*
+*   Converts a deck eight cards at a time. The last four cards are loaded
+*   on their own so that nothing past the deck is read.
+*/
+__attribute__((target("ssse3")))
+static int convert_ssse3(const char* deck, uint8_t* indices) {
+    uint8_t last[8];
+    for (int i = 0; i < 6; i++) {
+        if (!convert_chunk(_mm_loadu_si128((__m128i*)(deck + i * 16)),
+                indices + i * 8, 0xFFFF)) {
+            return 0;
+        }
+    }
+    if (!convert_chunk(_mm_loadl_epi64((__m128i*)(deck + 96)), last,
+            0x00FF)) {
+        return 0;
+    }
+    memcpy(indices + 48, last, 4);
+    return 1;
+}
+#endif
+
+/*
+*   Picks the fastest way of converting decks this CPU supports.
+*/
+static void choose_converter(void) {
+    convert_deck = convert_scalar;
+#ifdef HAVE_SSSE3
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        convert_deck = convert_ssse3;
+    }
+#endif
+}
+
+/*
+*   Converts the 104 characters of a deck to 52 card indices. Returns 0 if
+*   any pair of characters is not a card.
+*/
+int deck_cards(const char* deck, uint8_t* indices) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, choose_converter);
+    return convert_deck(deck, indices);
+}
+
+/*
+*   Returns whether a deck holds every card exactly once.
+*/
+int deck_is_valid(const char* deck) {
+    uint8_t indices[CARD_COUNT];
+    uint64_t seen = 0;
+    if (!deck_cards(deck, indices)) {
+        return 0;
+    }
+    for (int i = 0; i < CARD_COUNT; i++) {
+        seen |= 1ULL << indices[i];
+    }
+    return seen == FULL_DECK;
+}
+
+/*
+*   Checks a share of the decks, ending each one where its newline was.
+*/
+static void* check_decks(void* arg) {
+    DeckRange* range = arg;
+    for (long i = range->first; i < range->last; i++) {
+        char* end = range->decks[i] + DECK_LENGTH;
+        if ((*end != '\n' && *end != '\0') ||
+                !deck_is_valid(range->decks[i])) {
+            range->bad = i;
+            return arg;
+        }
+        *end = '\0';
+    }
+    range->bad = range->last;
+    return arg;
+}
+
+/*
+*   Runs work over the decks, splitting large files between threads.
+*   Returns whether every share was done without finding a bad deck.
+*/
+static int split_decks(char** decks, Deal* deals, long count,
+        void* (*work)(void*)) {
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount > count / DECKS_PER_THREAD) {
+        threadCount = count / DECKS_PER_THREAD;
+    }
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    DeckRange* ranges = malloc(sizeof(DeckRange) * threadCount);
+    pthread_t* threads = malloc(sizeof(pthread_t) * threadCount);
+    for (long i = 0; i < threadCount; i++) {
+        ranges[i].decks = decks;
+        ranges[i].deals = deals;
+        ranges[i].first = count * i / threadCount;
+        ranges[i].last = count * (i + 1) / threadCount;
+        if (i > 0) {
+            pthread_create(&threads[i], NULL, work, &ranges[i]);
+        }
+    }
+    work(&ranges[0]);
+    int done = ranges[0].bad == ranges[0].last;
+    for (long i = 1; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+        done &= ranges[i].bad == ranges[i].last;
+    }
+    free(ranges);
+    free(threads);
+    return done;
+}
+
+/*
+*   Reads a whole deck file, one deck of 104 characters per line, into
+*   memory and checks every deck, splitting large files between threads.
+*   Sets decks to point at each deck in turn. Returns the number of decks,
+*   DECKS_UNREADABLE if the file cannot be read or DECKS_INVALID if any
+*   deck is bad or there are none.
+*/
+long load_decks(const char* path, char*** decks) {
+    struct stat info;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return DECKS_UNREADABLE;
+    }
+    char* data = malloc(info.st_size + 1);
+    size_t size = 0;
+    while (data != NULL && size < (size_t)info.st_size) {
+        ssize_t got = read(fd, data + size, info.st_size - size);
+        if (got <= 0) {
+            break;
+        }
+        size += got;
+    }
+    close(fd);
+    if (data == NULL || size < (size_t)info.st_size) {
+        free(data);
+        return DECKS_UNREADABLE;
+    }
+    data[size] = '\0';
+
+    // Every line is a deck and a newline, except perhaps the last
+    long count = (size + 1) / (DECK_LENGTH + 1);
+    if (!count || size % (DECK_LENGTH + 1) % DECK_LENGTH) {
+        free(data);
+        return DECKS_INVALID;
+    }
+    *decks = malloc(sizeof(char*) * count);
+    for (long i = 0; i < count; i++) {
+        (*decks)[i] = data + i * (DECK_LENGTH + 1);
+    }
+
+    if (!split_decks(*decks, NULL, count, check_decks)) {
+        free(*decks);
+        free(data);
+        return DECKS_INVALID;
+    }
+    return count;
+}
+
+/*
+*   Splits a valid deck into the hands dealt from it, card i going to
+*   seat i % 4, both as messages and as sets of card indices.
+*/
+void prepare_deal(const char* deck, Deal* deal) {
+    uint8_t indices[CARD_COUNT];
+    deck_cards(deck, indices);
+    for (int seat = 0; seat < 4; seat++) {
+        char* message = deal->messages[seat];
+        message[0] = 'H';
+        deal->hands[seat] = 0;
+        for (int i = seat; i < CARD_COUNT; i += 4) {
+            memcpy(message + 1 + i / 4 * 2, deck + i * 2, 2);
+            deal->hands[seat] |= 1ULL << indices[i];
+        }
+        message[HAND_MESSAGE_LENGTH] = '\0';
+    }
+}
+
+/*
+*   Prepares a share of the decks.
+*/
+static void* prepare_range(void* arg) {
+    DeckRange* range = arg;
+    for (long i = range->first; i < range->last; i++) {
+        prepare_deal(range->decks[i], &range->deals[i]);
+    }
+    range->bad = range->last;
+    return arg;
+}
+
+/*
+*   Prepares every deck loaded by load_decks, so dealing one costs no
+*   more than sending its messages. Returns NULL if there is no memory.
+*/
+Deal* prepare_deals(char** decks, long count) {
+    Deal* deals = malloc(sizeof(Deal) * count);
+    if (deals != NULL) {
+        split_decks(decks, deals, count, prepare_range);
+    }
+    return deals;
+}
+
+/*
+*   Steps a splitmix64 generator and returns its next output.
+*/
+static uint64_t next_random(uint64_t* state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/*
+*   Returns the seed for one hand at one table, so that any hand the
+*   server deals can be dealt again from the server's seed.
+*/
+uint64_t deal_seed(uint64_t serverSeed, uint32_t table, uint32_t hand) {
+    uint64_t state = serverSeed ^ ((uint64_t)table << 32 | hand);
+    return next_random(&state);
+}
+
+/*
+*   Fills in the two characters of every card, in index order, for
+*   shuffling.
+*/
+static void order_cards(void) {
+    static const char ranks[] = "23456789TJQKA";
+    static const char suits[] = "SCDH";
+    for (int i = 0; i < CARD_COUNT; i++) {
+        char name[2] = {ranks[i % 13], suits[i / 13]};
+        memcpy(&ordered[i], name, 2);
+    }
+}
+
+/*
+*   Takes the last four swaps of a Fisher-Yates shuffle with n cards left
+*   from 32 random bits. Each multiply by how many cards are left gives
+*   one position in the high half and leaves the low half for the next,
+*   and fresh bits are taken for the rare draws that would bias them.
+*/
+static inline void shuffle_four(uint16_t* cards, uint32_t n, uint32_t bits,
+        uint64_t* state) {
+    uint32_t positions[4];
+    uint32_t bound = n * (n - 1) * (n - 2) * (n - 3);
+    while (1) {
+        uint32_t leftover = bits;
+        for (int i = 0; i < 4; i++) {
+            uint64_t product = (uint64_t)leftover * (n - i);
+            positions[i] = product >> 32;
+            leftover = product;
+        }
+        if (leftover >= bound || leftover >= -bound % bound) {
+            break;
+        }
+        bits = next_random(state) >> 32;
+    }
+    for (int i = 0; i < 4; i++) {
+        uint16_t card = cards[n - 1 - i];
+        cards[n - 1 - i] = cards[positions[i]];
+        cards[positions[i]] = card;
+    }
+}
+
+/*
+*   Shuffles a deck from a seed with a Fisher-Yates shuffle and writes it
+*   as 104 characters and a terminator. The two character cards are
+*   shuffled directly, four swaps to each 32 random bits.
+*/
+void generate_deck(uint64_t seed, char* deck) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    uint16_t cards[CARD_COUNT];
+    uint64_t state = seed;
+    pthread_once(&once, order_cards);
+    memcpy(cards, ordered, sizeof(cards));
+    for (uint32_t n = CARD_COUNT; n >= 8; n -= 8) {
+        uint64_t bits = next_random(&state);
+        shuffle_four(cards, n, bits, &state);
+        shuffle_four(cards, n - 4, bits >> 32, &state);
+    }
+    shuffle_four(cards, 4, next_random(&state), &state);
+    memcpy(deck, cards, DECK_LENGTH);
+    deck[DECK_LENGTH] = '\0';
+}
@@ -0,0 +1,35 @@
+#ifndef DECKS_H
+#define DECKS_H
+
+#include <stdint.h>
+
+// Characters in one deck, being 52 two character cards
+#define DECK_LENGTH 104
+// Fewest decks worth giving a thread of their own when validating
+#define DECKS_PER_THREAD 65536
+
+// Characters in an 'H' message, being its type and one hand of 13 cards
+#define HAND_MESSAGE_LENGTH 27
+
+// Returned by load_decks when there are no decks to use
+#define DECKS_UNREADABLE -1
+#define DECKS_INVALID -2
+
+/*
+*   A deck made ready to deal: the 'H' message for each seat and the cards
+*   each of them is dealt.
+*/
+typedef struct Deal {
+    char messages[4][HAND_MESSAGE_LENGTH + 1];
+    uint64_t hands[4];
+} Deal;
+
+int deck_cards(const char*, uint8_t*);
+int deck_is_valid(const char*);
+long load_decks(const char*, char***);
+void prepare_deal(const char*, Deal*);
+Deal* prepare_deals(char**, long);
+uint64_t deal_seed(uint64_t, uint32_t, uint32_t);
+void generate_deck(uint64_t, char*);
+
+#endif
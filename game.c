@@ -443,23 +443,6 @@ void read_card_input_from_string(Card* card, char* msg) {
     }
 }
 
-/*
-*   Checks whether a given deck representation contains 52 valid cards.
-*/
-int validate_deck(char* deck) {
-    for (int i = 0; i < 104; i++) {
-        Card* card = malloc(sizeof(Card));
-        card->rank = deck[i];
-        card->suit = deck[++i];
-        if (!is_valid_card(card)) {
-            free(card);
-            return 0;
-        }
-        free(card);
-    }
-    return 1;
-}
-
 /*
 *   Checks whether a string ends with a suffix.
 */
@@ -1,6 +1,10 @@
+#ifndef GAME_H
+#define GAME_H
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 
 typedef struct {
     char rank;
@@ -9,11 +13,12 @@ typedef struct {
 
 typedef struct {
     int id;
+    int cardCount;
     char* name;
     Card* hand;
-    int cardCount;
     FILE* readFD;
     FILE* writeFD;
+    struct Connection* conn;
     Card* lastPlay;
     int eligible;
 } Player;
@@ -25,21 +30,42 @@ typedef struct {
     char* greeting;
     int deckCount;
     char** decks;
+    struct Deal* deals;
+    int reactorCount;
+    struct Reactor* reactors;
+    int matchWindow;
+    int lobbyTTL;
+    int lobbyLimit;
+    long connectionLimit;
+    long handshakeLimit;
+    long resolveTTL;
+    char* localPath;
+    char* journalDirectory;
+    char* captureFile;
+    char* deckCache;
+    int fsyncPolicy;
+    int seeded;
+    uint64_t seed;
 } Server;
 
+/*
+*   A table, kept in the server's table store. The hands, scores and
+*   contract are in its slab's PlayState and are reached with TABLE. Like
+*   the state, each table starts on a cache line of its own, since its
+*   players are written on every move.
+*/
 typedef struct {
+    uint32_t id __attribute__((aligned(64)));
+    uint16_t hand;
+    uint16_t slot;
+    struct TableSlab* slab;
     char* name;
-    Player* players;
     int playerCount;
     int currentDeck;
-    char trumps;
-    int contractGoal;
-    int contractPoints;
-    int contractTeam;
-    int team1Wins;
-    int team2Wins;
-    int team1Points;
-    int team2Points;
+    int options;
+    int traced;
+    struct Broadcast* broadcast;
+    Player players[4];
 } Game;
 
 void print_message(char*);
@@ -59,8 +85,9 @@ int is_in_suit(Card*, char);
 void remove_card_from_hand(Player*, Card*);
 int is_valid_bid(Card*);
 int is_valid_card(Card*);
-int validate_deck(char*);
 int can_play_suit(Player*, char);
 char* create_message(char, char*);
 int compare_players(const void*, const void*);
 int ends_with(const char*, const char*);
+
+#endif
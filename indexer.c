@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "indexer.h"
+
+/*
+*   Initialises an empty index.
+*/
+void indexer_init(Indexer* indexer) {
+    indexer->capacity = 256;
+    indexer->count = 0;
+    indexer->entries = calloc(indexer->capacity, sizeof(IndexEntry));
+    indexer->names = NULL;
+    indexer->nameCount = 0;
+    indexer->nameCapacity = 0;
+}
+
+/*
+*   Adds bytes of a name to its hash (FNV-1a), its length and as much of
+*   its prefix as is kept.
+*/
+static void add_to_name(IndexName* name, const char* text, int length) {
+    for (int i = 0; i < length; i++) {
+        if (name->length < INDEX_NAME_PREFIX) {
+            name->prefix[name->length] = text[i];
+        }
+        name->hash ^= (unsigned char)text[i];
+        name->hash *= 16777619u;
+        name->length++;
+    }
+}
+
+/*
+*   Writes the key for a name from its prefix, length and hash. A newline
+*   never appears in a name, so it marks the keys of long names.
+*/
+static void name_key(char* key, IndexName* name) {
+    memset(key, 0, INDEX_KEY_LENGTH);
+    if (name->length <= INDEX_NAME_PREFIX) {
+        snprintf(key, INDEX_KEY_LENGTH, "p:%.*s", (int)name->length,
+                name->prefix);
+    } else {
+        snprintf(key, INDEX_KEY_LENGTH, "p:%.*s\n%08x", INDEX_HASHED_PREFIX,
+                name->prefix, name->hash);
+    }
+}
+
+/*
+*   Writes the key for a player's name.
+*/
+void player_key(char* key, const char* player) {
+    IndexName name;
+    memset(&name, 0, sizeof(name));
+    name.hash = 2166136261u;
+    add_to_name(&name, player, strlen(player));
+    name_key(key, &name);
+}
+
+/*
+*   Writes the key for a deck number.
+*/
+void deck_key(char* key, int deck) {
+    memset(key, 0, INDEX_KEY_LENGTH);
+    snprintf(key, INDEX_KEY_LENGTH, "d:%d", deck);
+}
+
+/*
+*   Hashes a key (FNV-1a).
+*/
+static uint32_t hash_key(const char* key) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < INDEX_KEY_LENGTH && key[i]; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+*   Returns the entry for a key, adding it if it is new.
+*/
+static IndexEntry* find_entry(Indexer* indexer, const char* key) {
+    if (indexer->count * 2 >= indexer->capacity) {
+        IndexEntry* old = indexer->entries;
+        uint32_t oldCapacity = indexer->capacity;
+        indexer->capacity *= 2;
+        indexer->entries = calloc(indexer->capacity, sizeof(IndexEntry));
+        for (uint32_t i = 0; i < oldCapacity; i++) {
+            if (old[i].key[0]) {
+                uint32_t slot = hash_key(old[i].key) &
+                        (indexer->capacity - 1);
+                while (indexer->entries[slot].key[0]) {
+                    slot = (slot + 1) & (indexer->capacity - 1);
+                }
+                indexer->entries[slot] = old[i];
+            }
+        }
+        free(old);
+    }
+    uint32_t slot = hash_key(key) & (indexer->capacity - 1);
+    while (indexer->entries[slot].key[0] &&
+            strncmp(indexer->entries[slot].key, key, INDEX_KEY_LENGTH)) {
+        slot = (slot + 1) & (indexer->capacity - 1);
+    }
+    if (!indexer->entries[slot].key[0]) {
+        memcpy(indexer->entries[slot].key, key, INDEX_KEY_LENGTH);
+        indexer->count++;
+    }
+    return &indexer->entries[slot];
+}
+
+/*
+*   Adds a table to a key's postings. Consecutive repeats, such as the
+*   same deck being dealt again at a table, are skipped here and the rest
+*   are removed when the index is written.
+*/
+static void add_posting(Indexer* indexer, const char* key, uint32_t table) {
+    IndexEntry* entry = find_entry(indexer, key);
+    if (entry->count && entry->tables[entry->count - 1] == table) {
+        return;
+    }
+    if (entry->count == entry->capacity) {
+        entry->capacity = entry->capacity ? entry->capacity * 2 : 8;
+        entry->tables = realloc(entry->tables,
+                sizeof(uint32_t) * entry->capacity);
+    }
+    entry->tables[entry->count++] = table;
+}
+
+/*
+*   Returns the entry for a key, or NULL if nothing has been posted to it.
+*/
+IndexEntry* indexer_lookup(Indexer* indexer, const char* key) {
+    uint32_t slot = hash_key(key) & (indexer->capacity - 1);
+    while (indexer->entries[slot].key[0]) {
+        if (!strncmp(indexer->entries[slot].key, key, INDEX_KEY_LENGTH)) {
+            return &indexer->entries[slot];
+        }
+        slot = (slot + 1) & (indexer->capacity - 1);
+    }
+    return NULL;
+}
+
+/*
+*   Adds one record of a player's name, which is split over as many
+*   records as it needs, and posts the name once its last record is seen.
+*   A part that does not follow on from the one before is ignored, along
+*   with the rest of that name.
+*/
+static void add_name_part(Indexer* indexer, JournalRecord* record) {
+    char key[INDEX_KEY_LENGTH];
+    IndexName* name = NULL;
+    for (uint32_t i = 0; i < indexer->nameCount; i++) {
+        if (indexer->names[i].table == record->table &&
+                indexer->names[i].seat == record->seat) {
+            name = &indexer->names[i];
+        }
+    }
+    if (name == NULL && record->hand == 0) {
+        if (indexer->nameCount == indexer->nameCapacity) {
+            indexer->nameCapacity = indexer->nameCapacity ?
+                    indexer->nameCapacity * 2 : 8;
+            indexer->names = realloc(indexer->names,
+                    sizeof(IndexName) * indexer->nameCapacity);
+        }
+        name = &indexer->names[indexer->nameCount++];
+    } else if (name == NULL) {
+        return;
+    }
+    if (record->hand == 0) {
+        memset(name, 0, sizeof(IndexName));
+        name->table = record->table;
+        name->seat = record->seat;
+        name->hash = 2166136261u;
+    }
+    int length = strnlen(record->data.name, JOURNAL_NAME_LENGTH);
+    if (record->hand == name->parts) {
+        add_to_name(name, record->data.name, length);
+        name->parts++;
+    }
+    if (record->hand != name->parts - 1 || length < JOURNAL_NAME_LENGTH) {
+        if (record->hand == name->parts - 1) {
+            name_key(key, name);
+            add_posting(indexer, key, record->table);
+        }
+        *name = indexer->names[--indexer->nameCount];
+    }
+}
+
+/*
+*   Indexes a journal record if it names a player or a deck.
+*/
+void indexer_add_record(Indexer* indexer, JournalRecord* record) {
+    char key[INDEX_KEY_LENGTH];
+    if (record->type == JOURNAL_PLAYER) {
+        add_name_part(indexer, record);
+    } else if ((record->type == JOURNAL_DEAL ||
+            record->type == JOURNAL_CONTINUED) &&
+            record->data.values.a >= 0) {
+        deck_key(key, record->data.values.a);
+        add_posting(indexer, key, record->table);
+    }
+}
+
+/*
+*   Orders postings or keys for writing.
+*/
+static int compare_tables(const void* x, const void* y) {
+    uint32_t a = *(const uint32_t*)x;
+    uint32_t b = *(const uint32_t*)y;
+    return (a > b) - (a < b);
+}
+
+static int compare_keys(const void* x, const void* y) {
+    return strncmp(((const IndexKey*)x)->key, ((const IndexKey*)y)->key,
+            INDEX_KEY_LENGTH);
+}
+
+/*
+*   Appends a varint to buffer and returns the number of bytes used.
+*/
+static int put_varint(uint8_t* buffer, uint32_t value) {
+    int length = 0;
+    while (value >= 0x80) {
+        buffer[length++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buffer[length++] = value;
+    return length;
+}
+
+/*
+*   Compresses sorted postings into blocks. Returns the number of bytes
+*   written to buffer, which must hold at least 5 bytes per posting plus a
+*   block header per INDEX_BLOCK_SIZE postings.
+*/
+static uint32_t encode_postings(uint8_t* buffer, uint32_t* tables,
+        uint32_t count) {
+    uint32_t length = 0;
+    for (uint32_t start = 0; start < count; start += INDEX_BLOCK_SIZE) {
+        IndexBlock block;
+        uint32_t end = start + INDEX_BLOCK_SIZE < count ?
+                start + INDEX_BLOCK_SIZE : count;
+        uint32_t body = length + sizeof(IndexBlock);
+        uint32_t used = 0;
+        for (uint32_t i = start + 1; i < end; i++) {
+            used += put_varint(buffer + body + used,
+                    tables[i] - tables[i - 1]);
+        }
+        block.first = tables[start];
+        block.count = end - start;
+        block.length = used;
+        memcpy(buffer + length, &block, sizeof(block));
+        length = body + used;
+    }
+    return length;
+}
+
+/*
+*   Decompresses length bytes of posting blocks into tables. Returns the
+*   number of postings.
+*/
+uint32_t decode_postings(const uint8_t* data, uint32_t length,
+        uint32_t* tables) {
+    uint32_t count = 0;
+    uint32_t pos = 0;
+    while (pos < length) {
+        IndexBlock block;
+        memcpy(&block, data + pos, sizeof(block));
+        pos += sizeof(block);
+        uint32_t value = block.first;
+        tables[count++] = value;
+        for (int i = 1; i < block.count; i++) {
+            uint32_t gap = 0;
+            int shift = 0;
+            while (data[pos] & 0x80) {
+                gap |= (uint32_t)(data[pos++] & 0x7F) << shift;
+                shift += 7;
+            }
+            gap |= (uint32_t)data[pos++] << shift;
+            value += gap;
+            tables[count++] = value;
+        }
+    }
+    return count;
+}
+
+/*
+*   Writes the index to path as a sorted key directory followed by the
+*   compressed postings. The file is written beside path and renamed over
+*   it, so readers never see half an index. Returns 0 on failure.
+*/
+int indexer_write(Indexer* indexer, const char* path, uint64_t segmentSize) {
+    IndexHeader header;
+    IndexKey* keys = calloc(indexer->count + 1, sizeof(IndexKey));
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < indexer->capacity; i++) {
+        IndexEntry* entry = &indexer->entries[i];
+        if (!entry->key[0]) {
+            continue;
+        }
+        qsort(entry->tables, entry->count, sizeof(uint32_t), compare_tables);
+        uint32_t unique = 0;
+        for (uint32_t j = 0; j < entry->count; j++) {
+            if (!unique || entry->tables[unique - 1] != entry->tables[j]) {
+                entry->tables[unique++] = entry->tables[j];
+            }
+        }
+        entry->count = unique;
+        memcpy(keys[k].key, entry->key, INDEX_KEY_LENGTH);
+        // Until sorted, offset remembers which entry the key came from
+        keys[k].offset = i;
+        keys[k++].postingCount = unique;
+    }
+    qsort(keys, k, sizeof(IndexKey), compare_keys);
+
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE* file = fopen(temporary, "w");
+    if (file == NULL) {
+        free(keys);
+        return 0;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.keyCount = k;
+    header.segmentSize = segmentSize;
+
+    // Compress every key's postings, then lay them out after the directory
+    uint64_t offset = sizeof(header) + sizeof(IndexKey) * k;
+    uint8_t** blocks = malloc(sizeof(uint8_t*) * (k + 1));
+    for (uint32_t i = 0; i < k; i++) {
+        IndexEntry* entry = &indexer->entries[keys[i].offset];
+        blocks[i] = malloc(entry->count * 5 + (entry->count /
+                INDEX_BLOCK_SIZE + 1) * sizeof(IndexBlock));
+        keys[i].length = encode_postings(blocks[i], entry->tables,
+                entry->count);
+        keys[i].offset = offset;
+        offset += keys[i].length;
+    }
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(keys, sizeof(IndexKey), k, file) == k;
+    for (uint32_t i = 0; i < k; i++) {
+        ok = ok && fwrite(blocks[i], 1, keys[i].length, file) ==
+                keys[i].length;
+        free(blocks[i]);
+    }
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(temporary, path) == 0;
+    free(blocks);
+    free(keys);
+    return ok;
+}
+
+/*
+*   Empties the index, ready for the next segment.
+*/
+void indexer_clear(Indexer* indexer) {
+    for (uint32_t i = 0; i < indexer->capacity; i++) {
+        free(indexer->entries[i].tables);
+    }
+    free(indexer->entries);
+    free(indexer->names);
+    indexer_init(indexer);
+}
@@ -0,0 +1,97 @@
+#ifndef INDEXER_H
+#define INDEXER_H
+
+#include <stdint.h>
+#include "journal.h"
+
+#define INDEX_MAGIC "J499IDX"
+#define INDEX_VERSION 1
+// Longest key, being a one letter kind, a colon and a player name
+#define INDEX_KEY_LENGTH 24
+// Longest name a player key holds whole. Longer names are keyed by their
+// first INDEX_HASHED_PREFIX characters and a hash of the whole name.
+#define INDEX_NAME_PREFIX (INDEX_KEY_LENGTH - 3)
+#define INDEX_HASHED_PREFIX 12
+// Most postings in one compressed block
+#define INDEX_BLOCK_SIZE 128
+
+/*
+*   The start of an index file. segmentSize is the size of the segment
+*   when it was indexed, so that a stale index can be spotted.
+*/
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t keyCount;
+    uint64_t segmentSize;
+    uint64_t reserved;
+} IndexHeader;
+
+/*
+*   One entry of the sorted key directory that follows the header. The
+*   postings for the key are length bytes at offset from the start of the
+*   file.
+*/
+typedef struct {
+    char key[INDEX_KEY_LENGTH];
+    uint32_t postingCount;
+    uint32_t length;
+    uint64_t offset;
+} IndexKey;
+
+/*
+*   The head of a compressed block of postings. It is followed by count - 1
+*   varint encoded gaps from the posting before.
+*/
+typedef struct {
+    uint32_t first;
+    uint16_t count;
+    uint16_t length;
+} IndexBlock;
+
+/*
+*   The table ids seen for one key while a segment is being written.
+*/
+typedef struct {
+    char key[INDEX_KEY_LENGTH];
+    uint32_t* tables;
+    uint32_t count;
+    uint32_t capacity;
+} IndexEntry;
+
+/*
+*   A player's name whose records have not all been seen yet. Only as much
+*   of it as a key can hold is kept, with its length and hash.
+*/
+typedef struct {
+    uint32_t table;
+    uint8_t seat;
+    uint16_t parts;
+    uint32_t length;
+    uint32_t hash;
+    char prefix[INDEX_NAME_PREFIX + 1];
+} IndexName;
+
+/*
+*   An index being built in memory, as an open addressed hash table of
+*   keys, with the names still being put together from their records.
+*/
+typedef struct {
+    IndexEntry* entries;
+    uint32_t capacity;
+    uint32_t count;
+    IndexName* names;
+    uint32_t nameCount;
+    uint32_t nameCapacity;
+} Indexer;
+
+void indexer_init(Indexer*);
+void indexer_add_record(Indexer*, JournalRecord*);
+IndexEntry* indexer_lookup(Indexer*, const char*);
+int indexer_write(Indexer*, const char*, uint64_t);
+void indexer_clear(Indexer*);
+void player_key(char*, const char*);
+void deck_key(char*, int);
+uint32_t decode_postings(const uint8_t*, uint32_t, uint32_t*);
+
+#endif
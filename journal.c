@@ -0,0 +1,447 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include "indexer.h"
+#include "journal.h"
+#include "metrics.h"
+
+// Most records written to disk with one write call
+#define JOURNAL_BATCH 1024
+// How long the writer gathers records before committing them
+#define JOURNAL_COMMIT_WINDOW 10
+// Most milliseconds the open segment's index lags behind the segment
+#define INDEX_REFRESH 1000
+// Buckets of the tables still playing, a power of two
+#define LIVE_BUCKETS 4096
+
+/*
+*   A slot in the journal ring. Like the handoff queues, the sequence
+*   number says whether the slot is free for a producer or full for the
+*   writer.
+*/
+typedef struct {
+    uint64_t sequence;
+    JournalRecord record;
+} JournalSlot;
+
+/*
+*   A table that has started and not yet finished, with the records that
+*   are copied into each new segment while it plays: its players and the
+*   hand it is on.
+*/
+typedef struct LiveTable {
+    uint32_t table;
+    int segment;
+    JournalRecord* players;
+    int playerCount;
+    int playerCapacity;
+    JournalRecord continued;
+    struct LiveTable* next;
+} LiveTable;
+
+/*
+*   The journal ring shared by every game thread and its writer thread.
+*   Only the writer touches the segments, the index and the live tables.
+*/
+static struct {
+    JournalSlot* slots;
+    uint64_t mask;
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    int sleeping __attribute__((aligned(64)));
+    int eventFD;
+    int enabled;
+    char* directory;
+    int fsyncPolicy;
+    int segmentFD;
+    int segmentNumber;
+    long segmentSize;
+    int dirty;
+    long lastSync;
+    Indexer indexer;
+    int indexDirty;
+    long lastIndex;
+    LiveTable* live[LIVE_BUCKETS];
+    pthread_t writer;
+} journal;
+
+static void* write_journal(void*);
+
+/*
+*   Returns the wall clock time in nanoseconds.
+*/
+uint64_t realtime_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+*   Returns the number of the newest segment in the journal directory, or
+*   zero if there are none.
+*/
+static int find_last_segment(const char* directory) {
+    int last = 0;
+    int number;
+    struct dirent* entry;
+    DIR* dir = opendir(directory);
+    if (dir == NULL) {
+        return 0;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "journal-%d.seg", &number) == 1 &&
+                number > last) {
+            last = number;
+        }
+    }
+    closedir(dir);
+    return last;
+}
+
+/*
+*   Writes the index for the current segment, covering every record
+*   written to it so far.
+*/
+static void write_index(void) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/journal-%06d.idx", journal.directory,
+            journal.segmentNumber);
+    if (!indexer_write(&journal.indexer, path, journal.segmentSize)) {
+        fprintf(stderr, "server: cannot write journal index\n");
+    }
+    journal.indexDirty = 0;
+    journal.lastIndex = monotonic_ms();
+    METRIC_ADD(journalIndexWrites, 1);
+}
+
+/*
+*   Starts a new segment file after the current one. Returns 0 on failure.
+*/
+static int open_segment(void) {
+    char path[4096];
+    JournalHeader header;
+    journal.segmentNumber++;
+    snprintf(path, sizeof(path), "%s/journal-%06d.seg", journal.directory,
+            journal.segmentNumber);
+    journal.segmentFD = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND |
+            O_CLOEXEC, 0644);
+    if (journal.segmentFD < 0) {
+        return 0;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    header.version = JOURNAL_VERSION;
+    header.recordSize = sizeof(JournalRecord);
+    header.created = realtime_ns();
+    if (write(journal.segmentFD, &header, sizeof(header)) != sizeof(header)) {
+        return 0;
+    }
+    journal.segmentSize = sizeof(header);
+    return 1;
+}
+
+/*
+*   Opens the journal in the given directory, creating it if needed, and
+*   starts the writer thread. New segments always follow the newest one
+*   already there. Returns 0 on failure.
+*/
+int journal_open(const char* directory, int fsyncPolicy) {
+    journal.slots = malloc(sizeof(JournalSlot) * JOURNAL_RING_SIZE);
+    journal.mask = JOURNAL_RING_SIZE - 1;
+    for (uint64_t i = 0; i < JOURNAL_RING_SIZE; i++) {
+        journal.slots[i].sequence = i;
+    }
+    journal.eventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    journal.directory = strdup(directory);
+    journal.fsyncPolicy = fsyncPolicy;
+    indexer_init(&journal.indexer);
+    mkdir(directory, 0755);
+    journal.segmentNumber = find_last_segment(directory);
+    if (journal.eventFD < 0 || !open_segment()) {
+        return 0;
+    }
+    journal.lastSync = monotonic_ms();
+    journal.enabled = 1;
+    pthread_create(&journal.writer, NULL, write_journal, NULL);
+    return 1;
+}
+
+/*
+*   Returns whether hand histories are being recorded.
+*/
+int journal_enabled(void) {
+    return journal.enabled;
+}
+
+/*
+*   Adds a record to the journal ring from any thread. This never blocks:
+*   if the writer has fallen so far behind that the ring is full the record
+*   is dropped and counted.
+*/
+void journal_append(JournalRecord* record) {
+    uint64_t pos = __atomic_load_n(&journal.head, __ATOMIC_RELAXED);
+    JournalSlot* slot;
+    while (1) {
+        slot = &journal.slots[pos & journal.mask];
+        uint64_t sequence = __atomic_load_n(&slot->sequence,
+                __ATOMIC_ACQUIRE);
+        long diff = (long)(sequence - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&journal.head, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            METRIC_ADD(journalDropped, 1);
+            return;
+        } else {
+            pos = __atomic_load_n(&journal.head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->record = *record;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    // The writer wakes by itself every commit window, so it is only rung
+    // early when the ring is filling up
+    if (pos - __atomic_load_n(&journal.tail, __ATOMIC_RELAXED) >
+            JOURNAL_RING_SIZE / 2 &&
+            __atomic_exchange_n(&journal.sleeping, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        while (write(journal.eventFD, &one, sizeof(one)) < 0 &&
+                errno == EINTR) {
+        }
+    }
+}
+
+/*
+*   Returns the number of records waiting for the writer.
+*/
+unsigned long journal_depth(void) {
+    uint64_t tail = __atomic_load_n(&journal.tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&journal.head, __ATOMIC_RELAXED);
+    return head > tail ? head - tail : 0;
+}
+
+/*
+*   Takes up to max records off the ring. Only the writer may call this.
+*/
+static int take_records(JournalRecord* batch, int max) {
+    int count = 0;
+    uint64_t pos = journal.tail;
+    while (count < max) {
+        JournalSlot* slot = &journal.slots[pos & journal.mask];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1) {
+            break;
+        }
+        batch[count++] = slot->record;
+        __atomic_store_n(&slot->sequence, pos + journal.mask + 1,
+                __ATOMIC_RELEASE);
+        pos++;
+    }
+    __atomic_store_n(&journal.tail, pos, __ATOMIC_RELAXED);
+    return count;
+}
+
+/*
+*   Flushes the current segment to disk.
+*/
+static void sync_segment(void) {
+    fdatasync(journal.segmentFD);
+    journal.dirty = 0;
+    journal.lastSync = monotonic_ms();
+    METRIC_ADD(journalSyncs, 1);
+}
+
+/*
+*   Follows the tables that are playing from the records written for them.
+*   A table is live from its start until its game is over.
+*/
+static void track_record(JournalRecord* record) {
+    LiveTable** link = &journal.live[record->table & (LIVE_BUCKETS - 1)];
+    while (*link != NULL && (*link)->table != record->table) {
+        link = &(*link)->next;
+    }
+    LiveTable* live = *link;
+    if (live == NULL && record->type == JOURNAL_TABLE_START) {
+        live = *link = calloc(1, sizeof(LiveTable));
+        live->table = record->table;
+        live->continued.table = record->table;
+        live->continued.type = JOURNAL_CONTINUED;
+        live->continued.data.values.a = -1;
+    } else if (live == NULL) {
+        return;
+    }
+    live->segment = journal.segmentNumber;
+    if (record->type == JOURNAL_PLAYER) {
+        if (live->playerCount == live->playerCapacity) {
+            live->playerCapacity = live->playerCapacity ?
+                    live->playerCapacity * 2 : 4;
+            live->players = realloc(live->players,
+                    sizeof(JournalRecord) * live->playerCapacity);
+        }
+        live->players[live->playerCount++] = *record;
+    } else if (record->type == JOURNAL_DEAL) {
+        live->continued.hand = record->hand;
+        live->continued.data.values.a = record->data.values.a;
+    } else if (record->type == JOURNAL_GAME_OVER) {
+        *link = live->next;
+        free(live->players);
+        free(live);
+    }
+}
+
+/*
+*   Writes records to the current segment and indexes them. Returns the
+*   number written.
+*/
+static int write_records(JournalRecord* batch, int count) {
+    size_t length = sizeof(JournalRecord) * count;
+    char* data = (char*)batch;
+    size_t written = 0;
+    while (written < length) {
+        ssize_t result = write(journal.segmentFD, data + written,
+                length - written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result < 0) {
+            METRIC_ADD(journalDropped, (length - written) /
+                    sizeof(JournalRecord));
+            break;
+        }
+        written += result;
+    }
+    for (size_t i = 0; i < written / sizeof(JournalRecord); i++) {
+        indexer_add_record(&journal.indexer, &batch[i]);
+    }
+    journal.segmentSize += written;
+    journal.dirty = 1;
+    journal.indexDirty = 1;
+    METRIC_ADD(journalRecords, written / sizeof(JournalRecord));
+    METRIC_ADD(journalBytes, written);
+    METRIC_ADD(journalBatches, 1);
+    return written / sizeof(JournalRecord);
+}
+
+/*
+*   Starts a new segment with copies of the players and current hand of
+*   every table still playing, so that a table's later hands are found in
+*   the segments they are in. A table that has written nothing of its own
+*   to the last two segments is taken to have ended without its game over
+*   being recorded, and is forgotten. The copies are stamped with the time
+*   of the first record that did not fit, so that they come before it.
+*/
+static void carry_live_tables(int lastSegment, uint64_t timestamp) {
+    JournalRecord* carried = NULL;
+    int count = 0;
+    int capacity = 0;
+    for (int i = 0; i < LIVE_BUCKETS; i++) {
+        LiveTable** link = &journal.live[i];
+        while (*link != NULL) {
+            LiveTable* live = *link;
+            if (live->segment < lastSegment - 1) {
+                *link = live->next;
+                free(live->players);
+                free(live);
+                continue;
+            }
+            if (count + live->playerCount + 1 > capacity) {
+                capacity = (count + live->playerCount + 1) * 2;
+                carried = realloc(carried, sizeof(JournalRecord) * capacity);
+            }
+            memcpy(carried + count, live->players,
+                    sizeof(JournalRecord) * live->playerCount);
+            count += live->playerCount;
+            carried[count++] = live->continued;
+            for (int j = count - live->playerCount - 1; j < count; j++) {
+                carried[j].timestamp = timestamp;
+            }
+            link = &live->next;
+        }
+    }
+    if (count) {
+        write_records(carried, count);
+    }
+    free(carried);
+}
+
+/*
+*   Closes the full segment with its index and opens the next one, whose
+*   first record is stamped with timestamp. Returns 0 on failure.
+*/
+static int next_segment(uint64_t timestamp) {
+    int lastSegment = journal.segmentNumber;
+    if (journal.fsyncPolicy != FSYNC_NEVER) {
+        sync_segment();
+    }
+    close(journal.segmentFD);
+    write_index();
+    indexer_clear(&journal.indexer);
+    if (!open_segment()) {
+        return 0;
+    }
+    carry_live_tables(lastSegment, timestamp);
+    return 1;
+}
+
+/*
+*   Appends a batch of records to the current segment, moving on to a new
+*   segment when it is full.
+*/
+static void append_records(JournalRecord* batch, int count) {
+    if (journal.segmentSize + sizeof(JournalRecord) * count >
+            JOURNAL_SEGMENT_SIZE && !next_segment(batch[0].timestamp)) {
+        fprintf(stderr, "server: cannot open journal segment\n");
+        METRIC_ADD(journalDropped, count);
+        return;
+    }
+    int written = write_records(batch, count);
+    for (int i = 0; i < written; i++) {
+        track_record(&batch[i]);
+    }
+}
+
+/*
+*   The writer thread. Each commit window it drains the ring with as few
+*   writes as possible, then syncs according to the fsync policy. The open
+*   segment's index is rewritten at most every INDEX_REFRESH milliseconds;
+*   readers scan whatever the index does not yet cover.
+*/
+static void* write_journal(void* arg) {
+    JournalRecord batch[JOURNAL_BATCH];
+    struct pollfd doorbell = {journal.eventFD, POLLIN, 0};
+    uint64_t count;
+
+    while (1) {
+        int taken;
+        while ((taken = take_records(batch, JOURNAL_BATCH)) > 0) {
+            append_records(batch, taken);
+        }
+        if (journal.dirty && (journal.fsyncPolicy == FSYNC_EVERY_BATCH ||
+                (journal.fsyncPolicy > 0 && monotonic_ms() -
+                journal.lastSync >= journal.fsyncPolicy))) {
+            sync_segment();
+        }
+        if (journal.indexDirty &&
+                monotonic_ms() - journal.lastIndex >= INDEX_REFRESH) {
+            write_index();
+        }
+
+        __atomic_store_n(&journal.sleeping, 1, __ATOMIC_SEQ_CST);
+        if (poll(&doorbell, 1, JOURNAL_COMMIT_WINDOW) > 0) {
+            while (read(journal.eventFD, &count, sizeof(count)) < 0 &&
+                    errno == EINTR) {
+            }
+        }
+        __atomic_store_n(&journal.sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+    return arg;
+}
@@ -0,0 +1,98 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+// Types of hand history events
+#define JOURNAL_TABLE_START 1
+#define JOURNAL_PLAYER 2
+#define JOURNAL_DEAL 3
+#define JOURNAL_BID 4
+#define JOURNAL_PLAY 5
+#define JOURNAL_TRICK 6
+#define JOURNAL_SCORE 7
+#define JOURNAL_GAME_OVER 8
+#define JOURNAL_CONTINUED 9
+
+// How a card came to be played, stored with JOURNAL_PLAY events
+#define PLAY_CHOSEN 0
+#define PLAY_FORCED 1
+#define PLAY_PENALTY 2
+
+// fsync policies. A positive policy is the most milliseconds between syncs.
+#define FSYNC_NEVER 0
+#define FSYNC_EVERY_BATCH -1
+#define DEFAULT_FSYNC_INTERVAL 100
+
+#define JOURNAL_MAGIC "J499SEG"
+#define JOURNAL_VERSION 1
+#define JOURNAL_RING_SIZE 65536
+#define JOURNAL_SEGMENT_SIZE (64 * 1024 * 1024)
+#define JOURNAL_NAME_LENGTH 16
+
+/*
+*   A single hand history event. Every record is 32 bytes so that segments
+*   can be read back as a flat array. What the values hold depends on the
+*   type:
+*       TABLE_START  a = deck count
+*       PLAYER       name = the next JOURNAL_NAME_LENGTH bytes of a player's
+*                    name, hand = which part of the name this is. A name
+*                    takes as many records as it needs, and only its last
+*                    record is not full.
+*       DEAL         a = deck index, or -1 when deals are generated from
+*                    the server's seed, b = par bid value (255 when all
+*                    pass) or -1 if the deck is not analysed yet,
+*                    c = par score for team 1
+*       BID          a = bid value, or -1 for a pass
+*       PLAY         a = card index, b = PLAY_CHOSEN, PLAY_FORCED or
+*                    PLAY_PENALTY
+*       TRICK        seat = winner
+*       SCORE        a = contract bid value, b = SCORE_PACK(team, tricks,
+*                    made), c = team 1 points, d = team 2 points
+*       GAME_OVER    a = winning team, c = team 1 points, d = team 2 points
+*       CONTINUED    a = deck index of the hand being played, or -1, at a
+*                    table still playing when a new segment was started.
+*                    It follows copies of the table's PLAYER records, so
+*                    that each segment says who is at the tables in it.
+*/
+typedef struct {
+    uint64_t timestamp;
+    uint32_t table;
+    uint16_t hand;
+    uint8_t type;
+    uint8_t seat;
+    union {
+        struct {
+            int32_t a;
+            int32_t b;
+            int32_t c;
+            int32_t d;
+        } values;
+        char name[JOURNAL_NAME_LENGTH];
+    } data;
+} JournalRecord;
+
+#define SCORE_PACK(team, tricks, made) \
+    ((team) | ((tricks) << 8) | ((made) << 16))
+#define SCORE_TEAM(b) ((b) & 0xFF)
+#define SCORE_TRICKS(b) (((b) >> 8) & 0xFF)
+#define SCORE_MADE(b) (((b) >> 16) & 0xFF)
+
+/*
+*   The first 32 bytes of every journal segment.
+*/
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t created;
+    uint64_t reserved;
+} JournalHeader;
+
+int journal_open(const char*, int);
+int journal_enabled(void);
+void journal_append(JournalRecord*);
+unsigned long journal_depth(void);
+uint64_t realtime_ns(void);
+
+#endif
@@ -0,0 +1,110 @@
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "matcher.h"
+#include "metrics.h"
+#include "tables.h"
+
+/*
+*   Initialises an empty quick-match queue. The timer is only created once
+*   the first player joins, since only one shard ever owns the queue.
+*/
+void matcher_init(Matcher* matcher) {
+    matcher->head = NULL;
+    matcher->tail = NULL;
+    matcher->waiting = 0;
+    matcher->timerFD = -1;
+    matcher->armed = 0;
+    matcher->tables = 0;
+}
+
+/*
+*   Starts a batching window of the given length in milliseconds.
+*/
+static void arm_window(Matcher* matcher, int window) {
+    struct itimerspec timer = {{0, 0}, {0, 0}};
+    timer.it_value.tv_sec = window / 1000;
+    timer.it_value.tv_nsec = (window % 1000) * 1000000L + 1;
+    timerfd_settime(matcher->timerFD, 0, &timer, NULL);
+    matcher->armed = 1;
+}
+
+/*
+*   Adds a player to the back of the queue, opening a batching window if
+*   one is not already open. Returns 1 if the matcher's timer was just
+*   created and needs watching.
+*/
+int matcher_add(Matcher* matcher, Player* player, int window) {
+    int created = 0;
+    MatchEntry* entry = malloc(sizeof(MatchEntry));
+    entry->player = player;
+    entry->joined = monotonic_ms();
+    entry->next = NULL;
+    if (matcher->tail == NULL) {
+        matcher->head = entry;
+    } else {
+        matcher->tail->next = entry;
+    }
+    matcher->tail = entry;
+    matcher->waiting++;
+    METRIC_ADD(quickMatchPlayers, 1);
+
+    if (matcher->timerFD < 0) {
+        matcher->timerFD = timerfd_create(CLOCK_MONOTONIC,
+                TFD_NONBLOCK | TFD_CLOEXEC);
+        created = 1;
+    }
+    if (!matcher->armed) {
+        arm_window(matcher, window);
+    }
+    return created;
+}
+
+/*
+*   Called when the batching window closes. Returns 1 if there are enough
+*   players for at least one table. If players are left over another
+*   window is opened for them.
+*/
+int matcher_window_closed(Matcher* matcher, int window) {
+    uint64_t expirations;
+    if (read(matcher->timerFD, &expirations, sizeof(expirations)) < 0) {
+        return 0;
+    }
+    matcher->armed = 0;
+    if (matcher->waiting % 4) {
+        arm_window(matcher, window);
+    }
+    return matcher->waiting >= 4;
+}
+
+/*
+*   Takes the four longest waiting players off the queue and seats them at
+*   a new table. Returns NULL if fewer than four are waiting.
+*/
+Game* matcher_next_table(Matcher* matcher) {
+    if (matcher->waiting < 4) {
+        return NULL;
+    }
+    long now = monotonic_ms();
+    char name[16];
+    sprintf(name, "%s%d", QUICK_MATCH_NAME, ++matcher->tables);
+    Game* game = table_create();
+    game->name = intern_name(name);
+    game->playerCount = 4;
+    game->options = 0;
+    for (int i = 0; i < 4; i++) {
+        MatchEntry* entry = matcher->head;
+        matcher->head = entry->next;
+        histogram_observe(&metrics.quickMatchWait, now - entry->joined);
+        entry->player->id = i + 1;
+        game->players[i] = *entry->player;
+        free(entry->player);
+        free(entry);
+    }
+    if (matcher->head == NULL) {
+        matcher->tail = NULL;
+    }
+    matcher->waiting -= 4;
+    METRIC_ADD(quickMatchTables, 1);
+    return game;
+}
@@ -0,0 +1,38 @@
+#ifndef MATCHER_H
+#define MATCHER_H
+
+#include "game.h"
+
+// Game name that puts a player into the quick-match queue
+#define QUICK_MATCH_NAME "*"
+// Default time the matcher waits to gather players before seating them
+#define DEFAULT_MATCH_WINDOW 200
+
+/*
+*   A player waiting in the quick-match queue.
+*/
+typedef struct MatchEntry {
+    Player* player;
+    long joined;
+    struct MatchEntry* next;
+} MatchEntry;
+
+/*
+*   The quick-match queue. Players are seated in tables of four each time
+*   the batching window closes, in the order they joined.
+*/
+typedef struct {
+    MatchEntry* head;
+    MatchEntry* tail;
+    int waiting;
+    int timerFD;
+    int armed;
+    int tables;
+} Matcher;
+
+void matcher_init(Matcher*);
+int matcher_add(Matcher*, Player*, int);
+Game* matcher_next_table(Matcher*);
+int matcher_window_closed(Matcher*, int);
+
+#endif
@@ -0,0 +1,154 @@
+#include <time.h>
+#include "metrics.h"
+
+// Global instance of the server metrics
+Metrics metrics;
+// Upper bound of each histogram bucket in milliseconds
+static const long histogramBounds[HISTOGRAM_BUCKETS - 1] = {
+    1, 5, 10, 50, 100, 250, 500, 1000, 5000
+};
+
+/*
+*   Returns a monotonic timestamp in milliseconds.
+*/
+long monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+*   Records a single observation in a histogram.
+*/
+void histogram_observe(Histogram* histogram, long value) {
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 &&
+            value > histogramBounds[bucket]) {
+        bucket++;
+    }
+    __atomic_fetch_add(&histogram->counts[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+*   Prints a single metric in the Prometheus text format. The labels may be
+*   NULL.
+*/
+void print_metric(FILE* out, const char* name, const char* labels,
+        long value) {
+    if (labels) {
+        fprintf(out, "serv499_%s{%s} %ld\n", name, labels, value);
+    } else {
+        fprintf(out, "serv499_%s %ld\n", name, value);
+    }
+}
+
+/*
+*   Prints a histogram in the Prometheus text format, with cumulative
+*   buckets.
+*/
+void print_histogram(FILE* out, const char* name, Histogram* histogram) {
+    long total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        total += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+        if (i < HISTOGRAM_BUCKETS - 1) {
+            fprintf(out, "serv499_%s_bucket{le=\"%ld\"} %ld\n", name,
+                    histogramBounds[i], total);
+        } else {
+            fprintf(out, "serv499_%s_bucket{le=\"+Inf\"} %ld\n", name,
+                    total);
+        }
+    }
+    fprintf(out, "serv499_%s_sum %ld\n", name,
+            __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED));
+    fprintf(out, "serv499_%s_count %ld\n", name,
+            __atomic_load_n(&histogram->count, __ATOMIC_RELAXED));
+}
+
+/*
+*   Prints every server wide counter.
+*/
+void print_metrics(FILE* out) {
+    print_metric(out, "handoff_pushes_total", NULL, METRIC_GET(queuePushes));
+    print_metric(out, "handoff_pops_total", NULL, METRIC_GET(queuePops));
+    print_metric(out, "handoff_batches_total", NULL,
+            METRIC_GET(queueBatches));
+    print_metric(out, "handoff_full_total", NULL, METRIC_GET(queueFull));
+    print_metric(out, "quickmatch_players_total", NULL,
+            METRIC_GET(quickMatchPlayers));
+    print_metric(out, "quickmatch_tables_total", NULL,
+            METRIC_GET(quickMatchTables));
+    print_histogram(out, "quickmatch_wait_ms", &metrics.quickMatchWait);
+    print_metric(out, "invalid_moves_total", "reason=\"bad_card\"",
+            METRIC_GET(badCards));
+    print_metric(out, "invalid_moves_total", "reason=\"not_in_hand\"",
+            METRIC_GET(cardsNotHeld));
+    print_metric(out, "invalid_moves_total", "reason=\"revoke\"",
+            METRIC_GET(revokes));
+    print_metric(out, "invalid_moves_total", "reason=\"bad_bid\"",
+            METRIC_GET(badBids));
+    print_metric(out, "move_penalties_total", NULL,
+            METRIC_GET(movePenalties));
+    print_metric(out, "journal_records_total", NULL,
+            METRIC_GET(journalRecords));
+    print_metric(out, "journal_bytes_total", NULL, METRIC_GET(journalBytes));
+    print_metric(out, "journal_batches_total", NULL,
+            METRIC_GET(journalBatches));
+    print_metric(out, "journal_syncs_total", NULL, METRIC_GET(journalSyncs));
+    print_metric(out, "journal_dropped_total", NULL,
+            METRIC_GET(journalDropped));
+    print_metric(out, "journal_index_writes_total", NULL,
+            METRIC_GET(journalIndexWrites));
+    print_metric(out, "deck_analyses_total", NULL, METRIC_GET(deckAnalyses));
+    print_metric(out, "spectator_joins_total", NULL,
+            METRIC_GET(spectatorJoins));
+    print_metric(out, "spectators_dropped_total", NULL,
+            METRIC_GET(spectatorsDropped));
+    print_metric(out, "tables_finished_total", NULL,
+            METRIC_GET(tablesFinished));
+    print_metric(out, "output_queue_peak_bytes", NULL,
+            METRIC_GET(outputPeak));
+    print_metric(out, "slow_consumers_total", NULL,
+            METRIC_GET(slowConsumers));
+    print_metric(out, "slow_consumer_evictions_total", NULL,
+            METRIC_GET(slowEvictions));
+    print_metric(out, "capture_records_total", NULL,
+            METRIC_GET(captureRecords));
+    print_metric(out, "traced_tables_total", NULL, METRIC_GET(tracedTables));
+    print_metric(out, "trace_spans_total", NULL, METRIC_GET(traceSpans));
+    print_metric(out, "tables_live", NULL, METRIC_GET(tablesLive));
+    print_metric(out, "table_slots", NULL, METRIC_GET(tableSlots));
+    print_metric(out, "table_store_bytes", NULL,
+            METRIC_GET(tableStoreBytes));
+    print_metric(out, "interned_names", NULL, METRIC_GET(internedNames));
+    print_metric(out, "interned_name_bytes", NULL,
+            METRIC_GET(internedBytes));
+    print_metric(out, "lobbies_open", NULL, METRIC_GET(lobbiesOpen));
+    print_metric(out, "lobby_players", NULL, METRIC_GET(lobbyPlayers));
+    print_metric(out, "lobby_bytes", NULL, METRIC_GET(lobbyBytes));
+    print_metric(out, "lobbies_expired_total", NULL,
+            METRIC_GET(lobbiesExpired));
+    print_metric(out, "lobbies_rejected_total", NULL,
+            METRIC_GET(lobbiesRejected));
+    print_metric(out, "connections_open", NULL, METRIC_GET(connectionsOpen));
+    print_metric(out, "handshakes_open", NULL, METRIC_GET(handshakesOpen));
+    print_metric(out, "connections_rejected_total", "reason=\"rate\"",
+            METRIC_GET(rejectedRate));
+    print_metric(out, "connections_rejected_total",
+            "reason=\"connections\"", METRIC_GET(rejectedConnections));
+    print_metric(out, "connections_rejected_total", "reason=\"handshakes\"",
+            METRIC_GET(rejectedHandshakes));
+    print_metric(out, "resolver_lookups_total", NULL,
+            METRIC_GET(resolverLookups));
+    print_metric(out, "resolver_cache_hits_total", NULL,
+            METRIC_GET(resolverHits));
+    print_metric(out, "resolver_failures_total", NULL,
+            METRIC_GET(resolverFailures));
+    print_metric(out, "resolver_dropped_total", NULL,
+            METRIC_GET(resolverDropped));
+    print_metric(out, "local_connections_total", NULL,
+            METRIC_GET(localConnections));
+    print_metric(out, "ring_connections_total", NULL,
+            METRIC_GET(ringConnections));
+}
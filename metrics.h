@@ -0,0 +1,88 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+// Number of buckets in a latency histogram, the last one being unbounded
+#define HISTOGRAM_BUCKETS 10
+
+/*
+*   A latency histogram in milliseconds.
+*/
+typedef struct {
+    long counts[HISTOGRAM_BUCKETS];
+    long sum;
+    long count;
+} Histogram;
+
+/*
+*   Server wide counters. Every field is only ever updated through
+*   METRIC_ADD so that any thread may bump them without a lock.
+*/
+typedef struct {
+    long queuePushes;
+    long queuePops;
+    long queueBatches;
+    long queueFull;
+    long quickMatchPlayers;
+    long quickMatchTables;
+    Histogram quickMatchWait;
+    long badCards;
+    long cardsNotHeld;
+    long revokes;
+    long badBids;
+    long movePenalties;
+    long journalRecords;
+    long journalBytes;
+    long journalBatches;
+    long journalSyncs;
+    long journalDropped;
+    long journalIndexWrites;
+    long deckAnalyses;
+    long spectatorJoins;
+    long spectatorsDropped;
+    long tablesFinished;
+    long ioSyscalls;
+    long outputPeak;
+    long slowConsumers;
+    long slowEvictions;
+    long captureRecords;
+    long tracedTables;
+    long traceSpans;
+    long tablesLive;
+    long tableSlots;
+    long tableStoreBytes;
+    long internedNames;
+    long internedBytes;
+    long lobbiesOpen;
+    long lobbyPlayers;
+    long lobbyBytes;
+    long lobbiesExpired;
+    long lobbiesRejected;
+    long connectionsOpen;
+    long handshakesOpen;
+    long rejectedRate;
+    long rejectedConnections;
+    long rejectedHandshakes;
+    long resolverLookups;
+    long resolverHits;
+    long resolverFailures;
+    long resolverDropped;
+    long localConnections;
+    long ringConnections;
+} Metrics;
+
+extern Metrics metrics;
+
+#define METRIC_ADD(field, amount) \
+    __atomic_fetch_add(&metrics.field, (amount), __ATOMIC_RELAXED)
+#define METRIC_GET(field) \
+    __atomic_load_n(&metrics.field, __ATOMIC_RELAXED)
+
+long monotonic_ms(void);
+void histogram_observe(Histogram*, long);
+void print_metric(FILE*, const char*, const char*, long);
+void print_histogram(FILE*, const char*, Histogram*);
+void print_metrics(FILE*);
+
+#endif
@@ -1,3 +1,4 @@
+#include <sys/stat.h>
 #include "networking.h"
 #include "game.h"
 
@@ -48,6 +49,38 @@ int connect_to(struct in_addr* ipAddress, int port)
     return fd;
 }
 
+/*
+*   Fills in the address of a Unix socket. Returns 0 if the path is too
+*   long for one.
+*/
+static int local_address(struct sockaddr_un* socketAddr, char* path)
+{
+    memset(socketAddr, 0, sizeof(struct sockaddr_un));
+    socketAddr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(socketAddr->sun_path)) {
+        return 0;
+    }
+    strcpy(socketAddr->sun_path, path);
+    return 1;
+}
+
+/*
+*   Returns a file descriptor to a socket connected to the server's Unix
+*   socket at path.
+*/
+int connect_local(char* path)
+{
+    struct sockaddr_un socketAddr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || !local_address(&socketAddr, path) ||
+            connect(fd, (struct sockaddr*)&socketAddr,
+            sizeof(socketAddr)) < 0) {
+        fprintf(stderr, "Bad Server.\n");
+        exit(2);
+    }
+    return fd;
+}
+
 /*
 *   Reads all of the data contained in the reading end of the socket and
 *   returns it as a string.
@@ -77,9 +110,11 @@ char* read_socket_message(FILE* socket) {
 }
 
 /*
-*   Opens a listening socket on a specified port.
+*   Opens a listening socket on a specified port. If shared is set the port
+*   may be bound by several sockets at once and the kernel balances incoming
+*   connections between them.
 */
-int open_listen(int port) {
+int open_listen(int port, int shared) {
     int fd;
     struct sockaddr_in serverAddr;
     int optVal;
@@ -93,6 +128,10 @@ int open_listen(int port) {
     if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int)) < 0) {
         exit(5);
     }
+    if (shared && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optVal,
+            sizeof(int)) < 0) {
+        exit(5);
+    }
 
     serverAddr.sin_family = AF_INET;
     serverAddr.sin_port = htons(port);
@@ -110,6 +149,36 @@ int open_listen(int port) {
     return fd;
 }
 
+/*
+*   Opens a non-blocking listening Unix socket at path, for clients on the
+*   same host. A socket left behind by an earlier server is replaced, but
+*   nothing else at path is.
+*/
+int open_local_listen(char* path) {
+    struct sockaddr_un serverAddr;
+    struct stat status;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        exit(5);
+    }
+    if (!local_address(&serverAddr, path)) {
+        fprintf(stderr, "Port Error\n");
+        exit(5);
+    }
+    if (!lstat(path, &status) && S_ISSOCK(status.st_mode)) {
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr*)&serverAddr,
+            sizeof(struct sockaddr_un)) < 0) {
+        fprintf(stderr, "Port Error\n");
+        exit(5);
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        exit(5);
+    }
+    return fd;
+}
+
 /*
 *   Send a message through a specicfied file descriptor.
 */
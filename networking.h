@@ -1,3 +1,6 @@
+#ifndef NETWORKING_H
+#define NETWORKING_H
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -5,10 +8,15 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <sys/un.h>
 #include <string.h>
 
 struct in_addr* hostname_to_ip(char*);
 int connect_to(struct in_addr*, int);
+int connect_local(char*);
 char* read_socket_message(FILE*);
 void send_socket_message(FILE*, char*);
-int open_listen(int);
+int open_listen(int, int);
+int open_local_listen(char*);
+
+#endif
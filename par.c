@@ -0,0 +1,172 @@
+/*
+* par.c
+* Usage: par499 [-t threads] [-o results] deck
+* Solves every deal of a deck file for each trump suit and declarer, on
+* all cores, and writes the tricks and par contract of each deal to a
+* results file, deck.par by default. Prints a summary of how the par
+* contracts fall between the teams.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "analysis.h"
+#include "decks.h"
+
+void usage(void);
+void read_decks(const char*);
+void* analyse_decks(void*);
+void write_results(const char*);
+void print_summary(double);
+
+char** decks = NULL;
+int deckCount = 0;
+DealAnalysis* analyses;
+// Next deal for a thread to take
+int nextDeck = 0;
+long totalNodes = 0;
+// Shared by every thread
+SolverTable table;
+
+int main(int argc, char** argv) {
+    int option;
+    int threadCount = 0;
+    char* output = NULL;
+    struct timespec start, end;
+    while ((option = getopt(argc, argv, "t:o:")) != -1) {
+        switch (option) {
+            case 't':
+                threadCount = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (argc - optind != 1) {
+        usage();
+    }
+    read_decks(argv[optind]);
+    if (threadCount <= 0) {
+        threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    analyses = calloc(deckCount, sizeof(DealAnalysis));
+    if (!solver_table_init(&table, SOLVER_TABLE_SIZE) ||
+            analyses == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(4);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t* threads = malloc(sizeof(pthread_t) * threadCount);
+    for (int i = 0; i < threadCount; i++) {
+        pthread_create(&threads[i], NULL, analyse_decks, NULL);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (output == NULL) {
+        output = malloc(strlen(argv[optind]) + 5);
+        sprintf(output, "%s.par", argv[optind]);
+    }
+    write_results(output);
+    print_summary((end.tv_sec - start.tv_sec) +
+            (end.tv_nsec - start.tv_nsec) / 1e9);
+    return 0;
+}
+
+/*
+*   Prints the usage message and exits.
+*/
+void usage(void) {
+    fprintf(stderr, "Usage: par499 [-t threads] [-o results] deck\n");
+    exit(1);
+}
+
+/*
+*   Reads a deck file in the format serv499 accepts, one deal of 52 two
+*   character cards per line.
+*/
+void read_decks(const char* path) {
+    long count = load_decks(path, &decks);
+    if (count == DECKS_UNREADABLE) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        exit(2);
+    }
+    if (count == DECKS_INVALID) {
+        fprintf(stderr, "Bad deals in %s\n", path);
+        exit(3);
+    }
+    deckCount = count;
+}
+
+/*
+*   A worker thread. Takes deals one at a time until there are none left.
+*/
+void* analyse_decks(void* arg) {
+    Solver solver;
+    solver_init(&solver, &table);
+    while (1) {
+        int deck = __atomic_fetch_add(&nextDeck, 1, __ATOMIC_RELAXED);
+        if (deck >= deckCount) {
+            break;
+        }
+        if (!analyse_deal(&solver, decks[deck], &analyses[deck])) {
+            fprintf(stderr, "Bad deal %d\n", deck);
+            exit(3);
+        }
+    }
+    __atomic_fetch_add(&totalNodes, solver.nodes, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*
+*   Writes the analyses after a header naming the deck file's hash.
+*/
+void write_results(const char* path) {
+    AnalysisHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ANALYSIS_MAGIC, sizeof(ANALYSIS_MAGIC));
+    header.version = ANALYSIS_VERSION;
+    header.recordSize = sizeof(DealAnalysis);
+    header.deckCount = deckCount;
+    header.deckHash = deck_hash(decks, deckCount);
+    FILE* file = fopen(path, "w");
+    if (file == NULL || fwrite(&header, sizeof(header), 1, file) != 1 ||
+            fwrite(analyses, sizeof(DealAnalysis), deckCount, file) !=
+            (size_t)deckCount || fclose(file)) {
+        fprintf(stderr, "Cannot write %s\n", path);
+        exit(5);
+    }
+}
+
+/*
+*   Prints how often each team holds par, the average par score for team
+*   1 and how fast the deals were solved. A balanced deck file has par
+*   scores averaging near zero.
+*/
+void print_summary(double seconds) {
+    int held[3] = {0, 0, 0};
+    long swing = 0;
+    long absolute = 0;
+    for (int i = 0; i < deckCount; i++) {
+        held[analyses[i].parTeam]++;
+        swing += analyses[i].parScore;
+        absolute += abs(analyses[i].parScore);
+    }
+    printf("deals %d\n", deckCount);
+    printf("team 1 par %d\n", held[1]);
+    printf("team 2 par %d\n", held[2]);
+    printf("passed out %d\n", held[0]);
+    printf("mean team 1 par score %.1f\n", (double)swing / deckCount);
+    printf("mean par swing %.1f\n", (double)absolute / deckCount);
+    fprintf(stderr, "%ld nodes in %.1f s, %.2f deals/s\n", totalNodes,
+            seconds, deckCount / seconds);
+}
@@ -1,110 +1,179 @@
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
 #include "pending.h"
+#include "reactor.h"
+#include "metrics.h"
 
 /*
-*   Creates a new linked list of pending games.
+*   Returns the bucket of the index a name hash belongs in. The top bits of
+*   the hash are used, since the low ones also pick the reactor and so are
+*   much the same for every lobby on it.
 */
-PendingGame* create_list(Game* game) {
-    PendingGame* gameList = (PendingGame*)malloc(sizeof(PendingGame));
-    if (gameList == NULL) {
+static PendingGame** lobby_bucket(LobbyIndex* index, unsigned int hash) {
+    return &index->buckets[(hash * 2654435769u) >> (32 - LOBBY_BUCKET_BITS)];
+}
+
+/*
+*   Returns the open lobby with the given game name, or NULL if there is
+*   none.
+*/
+PendingGame* lobby_index_find(LobbyIndex* index, const char* name) {
+    unsigned int hash = hash_game_name(name);
+    PendingGame* lobby = *lobby_bucket(index, hash);
+    while (lobby != NULL &&
+            (lobby->hash != hash || strcmp(lobby->game->name, name))) {
+        lobby = lobby->next;
+    }
+    return lobby;
+}
+
+/*
+*   Opens a lobby for a new game, which must already have its name.
+*/
+PendingGame* lobby_index_add(LobbyIndex* index, Game* game) {
+    PendingGame* lobby = (PendingGame*)malloc(sizeof(PendingGame));
+    if (lobby == NULL) {
         fprintf(stderr, "Node creation failed\n");
-        return NULL;
+        exit(5);
     }
-    gameList->game = game;
-    gameList->next = NULL;
+    lobby->game = game;
+    lobby->hash = hash_game_name(game->name);
+    lobby->wheelLink = NULL;
+    PendingGame** bucket = lobby_bucket(index, lobby->hash);
+    lobby->next = *bucket;
+    if (*bucket != NULL) {
+        (*bucket)->link = &lobby->next;
+    }
+    lobby->link = bucket;
+    *bucket = lobby;
+    return lobby;
+}
 
-    return gameList;
+/*
+*   Takes a lobby out of its index and frees it. The lobby must already be
+*   off the expiry wheel.
+*/
+void lobby_index_remove(PendingGame* lobby) {
+    *lobby->link = lobby->next;
+    if (lobby->next != NULL) {
+        lobby->next->link = lobby->link;
+    }
+    free(lobby);
 }
 
 /*
-*   Adds a new game to the pending list.
+*   Removes the table options from the end of a game name and returns them.
+*   Unknown options are ignored.
 */
-PendingGame* add_to_list(Game* game, PendingGame* head) {
-    if (head == NULL) {
-        return create_list(game);
+int split_game_options(char* gameName) {
+    int options = 0;
+    char* list = strchr(gameName, '?');
+    if (list == NULL) {
+        return 0;
     }
-    PendingGame* lastGame = get_last_game(head);
-    PendingGame* gameList = (PendingGame*)malloc(sizeof(PendingGame));
-    gameList->game = game;
-    gameList->next = NULL;
-    lastGame->next = gameList;
-    return gameList;
+    *list++ = '\0';
+    char* option;
+    while ((option = strsep(&list, ",")) != NULL) {
+        if (!strcmp(option, "manual")) {
+            options |= TABLE_MANUAL;
+        } else if (!strcmp(option, "open")) {
+            options |= TABLE_OPEN_HANDS;
+        }
+    }
+    return options;
 }
 
 /*
-*   Returns the last game in the linked list of pending games.
+*   Starts or stops the wheel's timer ticking.
 */
-PendingGame* get_last_game(PendingGame* head) {
-    PendingGame* curr = head;
-    PendingGame* temp = NULL;
-    while (curr->next != NULL) {
-        temp = curr;
-        curr = temp->next;
+static void set_wheel_timer(LobbyWheel* wheel, int running) {
+    struct itimerspec timer = {{0, 0}, {0, 0}};
+    if (running) {
+        timer.it_interval.tv_nsec = LOBBY_WHEEL_TICK * 1000000L;
+        timer.it_value = timer.it_interval;
     }
-    return curr;
+    timerfd_settime(wheel->timerFD, 0, &timer, NULL);
 }
 
 /*
-*   Searches for a given game name in the linked list of pending games.
+*   Initialises an empty wheel. Returns 0 if its timer cannot be created.
 */
-PendingGame* search_game_in_list(char* name, PendingGame* head) {
-    if (head == NULL) {
-        return NULL;
+int lobby_wheel_init(LobbyWheel* wheel) {
+    memset(wheel, 0, sizeof(LobbyWheel));
+    wheel->timerFD = timerfd_create(CLOCK_MONOTONIC,
+            TFD_NONBLOCK | TFD_CLOEXEC);
+    return wheel->timerFD >= 0;
+}
+
+/*
+*   Puts a lobby on the wheel to expire ttl milliseconds from now.
+*/
+void lobby_wheel_add(LobbyWheel* wheel, PendingGame* lobby, int ttl) {
+    long now = monotonic_ms();
+    if (wheel->count++ == 0) {
+        wheel->tick = now / LOBBY_WHEEL_TICK;
+        set_wheel_timer(wheel, 1);
     }
-    PendingGame* temp = NULL;
-    PendingGame* curr = head;
-    while (1) {
-        if (!strcmp(curr->game->name, name)) {
-            return curr;
-        }
-        if (curr->next == NULL) {
-            break;
-        }
-        temp = curr;
-        curr = temp->next;
+    lobby->expires = now + ttl;
+    long due = (lobby->expires + LOBBY_WHEEL_TICK - 1) / LOBBY_WHEEL_TICK;
+    if (due <= wheel->tick) {
+        due = wheel->tick + 1;
     }
-    return NULL;
+    PendingGame** slot = &wheel->slots[due % LOBBY_WHEEL_SLOTS];
+    lobby->wheelNext = *slot;
+    if (*slot != NULL) {
+        (*slot)->wheelLink = &lobby->wheelNext;
+    }
+    lobby->wheelLink = slot;
+    *slot = lobby;
 }
 
 /*
-*   Delete the pending game with given game from the list of pending games
+*   Takes a lobby off the wheel, if it is on it.
 */
-PendingGame* delete_game_from_list(char* name, PendingGame* head) {
-    PendingGame* temp = NULL;
-    PendingGame* curr = head;
-    while(1) {
-        if (!strcmp(curr->game->name, name)) {
-            if (!strcmp(curr->game->name, head->game->name)) {
-                return curr->next;
-            } else {
-                temp->next = curr->next;
-                return head;
-            }
-        } else if (curr->next == NULL) {
-            return NULL;
-        }
-        temp = curr;
-        curr = temp->next;
+void lobby_wheel_remove(LobbyWheel* wheel, PendingGame* lobby) {
+    if (lobby->wheelLink == NULL) {
+        return;
+    }
+    *lobby->wheelLink = lobby->wheelNext;
+    if (lobby->wheelNext != NULL) {
+        lobby->wheelNext->wheelLink = lobby->wheelLink;
+    }
+    lobby->wheelLink = NULL;
+    if (--wheel->count == 0) {
+        set_wheel_timer(wheel, 0);
     }
 }
 
 /*
-*   Check if any of the games in the list are complete and ready to start.
+*   Called when the wheel's timer ticks. Takes every lobby that has expired
+*   since the last tick off the wheel and returns them linked through
+*   wheelNext.
 */
-PendingGame* check_if_complete(PendingGame* head) {
-    if (head == NULL) {
+PendingGame* lobby_wheel_expired(LobbyWheel* wheel) {
+    uint64_t expirations;
+    if (read(wheel->timerFD, &expirations, sizeof(expirations)) < 0) {
         return NULL;
     }
-    PendingGame* temp = NULL;
-    PendingGame* curr = head;
-    while (1) {
-        if (curr->game->playerCount == 4) {
-            return curr;
-        }
-        if (curr->next == NULL) {
-            break;
+    long now = monotonic_ms();
+    long tick = now / LOBBY_WHEEL_TICK;
+    // A whole turn of the wheel visits every slot
+    long first = tick - wheel->tick > LOBBY_WHEEL_SLOTS ?
+            tick - LOBBY_WHEEL_SLOTS + 1 : wheel->tick + 1;
+    wheel->tick = tick;
+    PendingGame* expired = NULL;
+    for (long t = first; t <= tick; t++) {
+        PendingGame* lobby = wheel->slots[t % LOBBY_WHEEL_SLOTS];
+        while (lobby != NULL) {
+            PendingGame* next = lobby->wheelNext;
+            if (lobby->expires <= now) {
+                lobby_wheel_remove(wheel, lobby);
+                lobby->wheelNext = expired;
+                expired = lobby;
+            }
+            lobby = next;
         }
-        temp = curr;
-        curr = temp->next;
     }
-    return NULL;
+    return expired;
 }
@@ -1,17 +1,72 @@
+#ifndef PENDING_H
+#define PENDING_H
+
 #include <stdlib.h>
 #include <stdio.h>
 #include "game.h"
 
+// Options a table can be created with, listed after a '?' in the game name
+// and separated by commas
+#define TABLE_MANUAL 1
+#define TABLE_OPEN_HANDS 2
+
+// Default milliseconds a lobby may wait to fill before it is closed, and
+// most lobbies open across the server
+#define DEFAULT_LOBBY_TTL (10 * 60 * 1000)
+#define DEFAULT_LOBBY_LIMIT 65536
+// Slots in each reactor's lobby expiry wheel and the milliseconds each
+// slot covers
+#define LOBBY_WHEEL_SLOTS 256
+#define LOBBY_WHEEL_TICK 100
+// Hash buckets of each reactor's open lobbies, as a power of two
+#define LOBBY_BUCKET_BITS 14
+#define LOBBY_BUCKETS (1 << LOBBY_BUCKET_BITS)
+
+/*
+*   A lobby waiting for players, linked into its bucket of its reactor's
+*   lobby index by name. link points at whatever points at the lobby, so
+*   it can be taken out without a search. Lobbies with a time to live are
+*   also linked into a slot of their reactor's expiry wheel.
+*/
 struct GameList {
     Game* game;
+    unsigned int hash;
     struct GameList* next;
+    struct GameList** link;
+    long expires;
+    struct GameList* wheelNext;
+    struct GameList** wheelLink;
 };
 
 typedef struct GameList PendingGame;
 
-PendingGame* create_list(Game*);
-PendingGame* add_to_list(Game*, PendingGame*);
-PendingGame* get_last_game(PendingGame*);
-PendingGame* search_game_in_list(char*, PendingGame*);
-PendingGame* delete_game_from_list(char*, PendingGame*);
-PendingGame* check_if_complete(PendingGame*);
+/*
+*   A reactor's open lobbies, hashed by game name.
+*/
+typedef struct {
+    PendingGame* buckets[LOBBY_BUCKETS];
+} LobbyIndex;
+
+/*
+*   A hashed timer wheel of lobbies that expire. A lobby sits in the slot
+*   for the tick it expires in, so each tick only looks at one slot, and a
+*   lobby that fills is taken out without any search. Lobbies due more
+*   than one turn of the wheel away wait in their slot for later turns.
+*/
+typedef struct {
+    PendingGame* slots[LOBBY_WHEEL_SLOTS];
+    long tick;
+    int count;
+    int timerFD;
+} LobbyWheel;
+
+PendingGame* lobby_index_find(LobbyIndex*, const char*);
+PendingGame* lobby_index_add(LobbyIndex*, Game*);
+void lobby_index_remove(PendingGame*);
+int split_game_options(char*);
+int lobby_wheel_init(LobbyWheel*);
+void lobby_wheel_add(LobbyWheel*, PendingGame*, int);
+void lobby_wheel_remove(LobbyWheel*, PendingGame*);
+PendingGame* lobby_wheel_expired(LobbyWheel*);
+
+#endif
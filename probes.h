@@ -0,0 +1,60 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+*   Static tracepoints (USDT) for perf, bpftrace and SystemTap, all under
+*   the serv499 provider. Each is a single nop in the binary until a tool
+*   attaches to it, and its arguments are values already at hand. They
+*   are only built in where <sys/sdt.h> is installed, and can be left out
+*   with -DNO_PROBES. Otherwise every probe compiles to nothing.
+*
+*       connection_accept(connection, fd)
+*       handshake_complete(connection, player name, game name)
+*       lobby_join(connection, seat, game name), seat -1 for quick match
+*       table_start(table, game name, options)
+*       bid_received(table, seat, hand, bid value or -1 for a pass)
+*       card_played(table, seat, hand, card index, how)
+*       trick_won(table, seat, hand)
+*       hand_scored(table, hand, team 1 points, team 2 points)
+*       game_over(table, winning team, team 1 points, team 2 points)
+*/
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBE_CONNECTION_ACCEPT(connection, fd) \
+    DTRACE_PROBE2(serv499, connection_accept, connection, fd)
+#define PROBE_HANDSHAKE_COMPLETE(connection, name, game) \
+    DTRACE_PROBE3(serv499, handshake_complete, connection, name, game)
+#define PROBE_LOBBY_JOIN(connection, seat, game) \
+    DTRACE_PROBE3(serv499, lobby_join, connection, seat, game)
+#define PROBE_TABLE_START(table, game, options) \
+    DTRACE_PROBE3(serv499, table_start, table, game, options)
+#define PROBE_BID_RECEIVED(table, seat, hand, bid) \
+    DTRACE_PROBE4(serv499, bid_received, table, seat, hand, bid)
+#define PROBE_CARD_PLAYED(table, seat, hand, card, how) \
+    DTRACE_PROBE5(serv499, card_played, table, seat, hand, card, how)
+#define PROBE_TRICK_WON(table, seat, hand) \
+    DTRACE_PROBE3(serv499, trick_won, table, seat, hand)
+#define PROBE_HAND_SCORED(table, hand, team1, team2) \
+    DTRACE_PROBE4(serv499, hand_scored, table, hand, team1, team2)
+#define PROBE_GAME_OVER(table, winner, team1, team2) \
+    DTRACE_PROBE4(serv499, game_over, table, winner, team1, team2)
+#else
+#define PROBE_CONNECTION_ACCEPT(connection, fd) do { } while (0)
+#define PROBE_HANDSHAKE_COMPLETE(connection, name, game) do { } while (0)
+#define PROBE_LOBBY_JOIN(connection, seat, game) do { } while (0)
+#define PROBE_TABLE_START(table, game, options) do { } while (0)
+#define PROBE_BID_RECEIVED(table, seat, hand, bid) do { } while (0)
+#define PROBE_CARD_PLAYED(table, seat, hand, card, how) do { } while (0)
+#define PROBE_TRICK_WON(table, seat, hand) do { } while (0)
+#define PROBE_HAND_SCORED(table, hand, team1, team2) do { } while (0)
+#define PROBE_GAME_OVER(table, winner, team1, team2) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,320 @@
+/*
+* query.c
+* Usage: query499 [-r] [-i] journal-dir player name|deck number
+* Lists the tables a player sat at, or where a deck was dealt, using the
+* index beside each journal segment. Records the index does not yet cover
+* are scanned. With -r every record of those tables is printed, and with
+* -i missing or stale indexes are rebuilt first.
+*/
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "indexer.h"
+#include "journal.h"
+
+// Records before the end of what an index covers that are read again with
+// the rest, so that a name split over records either side is seen whole
+#define NAME_RESCAN 4096
+
+/*
+*   A mapped file.
+*/
+typedef struct {
+    void* data;
+    size_t size;
+} Mapping;
+
+void usage(void);
+int map_file(const char*, Mapping*);
+void query_segment(const char*, const char*, char*, int, int);
+uint32_t lookup_index(const char*, const char*, uint32_t**, uint64_t*);
+uint32_t add_table(uint32_t**, uint32_t, uint32_t);
+void build_index(const char*, Mapping*);
+void print_tables(const char*, JournalRecord*, long, uint32_t*, uint32_t);
+void print_record(const char*, JournalRecord*);
+
+long totalTables = 0;
+
+int main(int argc, char** argv) {
+    int option;
+    int printRecords = 0;
+    int rebuild = 0;
+    char key[INDEX_KEY_LENGTH];
+    struct timespec start, end;
+    while ((option = getopt(argc, argv, "ri")) != -1) {
+        switch (option) {
+            case 'r':
+                printRecords = 1;
+                break;
+            case 'i':
+                rebuild = 1;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (argc - optind != 3) {
+        usage();
+    }
+    if (!strcmp(argv[optind + 1], "player")) {
+        player_key(key, argv[optind + 2]);
+    } else if (!strcmp(argv[optind + 1], "deck")) {
+        deck_key(key, atoi(argv[optind + 2]));
+    } else {
+        usage();
+    }
+
+    struct dirent** entries;
+    int count = scandir(argv[optind], &entries, NULL, alphasort);
+    if (count < 0) {
+        fprintf(stderr, "Cannot read %s\n", argv[optind]);
+        exit(2);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count; i++) {
+        int number;
+        if (sscanf(entries[i]->d_name, "journal-%d.seg", &number) == 1 &&
+                strstr(entries[i]->d_name, ".seg")) {
+            query_segment(argv[optind], entries[i]->d_name, key,
+                    printRecords, rebuild);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "%ld tables in %.3f ms\n", totalTables,
+            (end.tv_sec - start.tv_sec) * 1e3 +
+            (end.tv_nsec - start.tv_nsec) / 1e6);
+    return 0;
+}
+
+/*
+*   Prints the usage message and exits.
+*/
+void usage(void) {
+    fprintf(stderr, "Usage: query499 [-r] [-i] journal-dir "
+            "player name|deck number\n");
+    exit(1);
+}
+
+/*
+*   Maps a whole file read only. Returns 0 if it cannot be read or is
+*   empty.
+*/
+int map_file(const char* path, Mapping* mapping) {
+    struct stat info;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &info) < 0 || info.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    mapping->size = info.st_size;
+    mapping->data = mmap(NULL, mapping->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return mapping->data != MAP_FAILED;
+}
+
+/*
+*   Finds the tables in one segment matching key and prints them.
+*/
+void query_segment(const char* directory, const char* name, char* key,
+        int printRecords, int rebuild) {
+    char path[4096];
+    char indexPath[4096];
+    Mapping segment;
+    uint32_t* tables = NULL;
+    uint64_t covered = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    snprintf(indexPath, sizeof(indexPath), "%s", path);
+    strcpy(strstr(indexPath, ".seg"), ".idx");
+    if (!map_file(path, &segment) || segment.size < sizeof(JournalHeader)) {
+        return;
+    }
+    JournalHeader* header = segment.data;
+    if (memcmp(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) ||
+            header->version != JOURNAL_VERSION ||
+            header->recordSize != sizeof(JournalRecord)) {
+        fprintf(stderr, "Bad journal segment %s\n", path);
+        exit(3);
+    }
+    JournalRecord* records = (JournalRecord*)(header + 1);
+    // A segment being written may end part way through a record
+    long count = (segment.size - sizeof(JournalHeader)) /
+            sizeof(JournalRecord);
+
+    uint32_t found = lookup_index(indexPath, key, &tables, &covered);
+    if (rebuild && covered < segment.size) {
+        build_index(indexPath, &segment);
+        free(tables);
+        tables = NULL;
+        found = lookup_index(indexPath, key, &tables, &covered);
+    }
+    long first = covered > sizeof(JournalHeader) ?
+            (covered - sizeof(JournalHeader)) / sizeof(JournalRecord) : 0;
+    if (first < count) {
+        // The records the index does not cover are indexed here the same
+        // way, names and all
+        Indexer tail;
+        indexer_init(&tail);
+        for (long i = first > NAME_RESCAN ? first - NAME_RESCAN : 0;
+                i < count; i++) {
+            indexer_add_record(&tail, &records[i]);
+        }
+        IndexEntry* entry = indexer_lookup(&tail, key);
+        for (uint32_t i = 0; entry != NULL && i < entry->count; i++) {
+            found = add_table(&tables, found, entry->tables[i]);
+        }
+        indexer_clear(&tail);
+        free(tail.entries);
+    }
+
+    for (uint32_t i = 0; i < found; i++) {
+        printf("%s %u\n", name, tables[i]);
+    }
+    if (printRecords && found) {
+        print_tables(name, records, count, tables, found);
+    }
+    totalTables += found;
+    free(tables);
+    munmap(segment.data, segment.size);
+}
+
+/*
+*   Looks key up in an index file by binary search of its key directory.
+*   Returns the number of tables found, setting covered to how much of the
+*   segment the index covers, which is zero if there is no usable index.
+*/
+uint32_t lookup_index(const char* path, const char* key, uint32_t** tables,
+        uint64_t* covered) {
+    Mapping index;
+    uint32_t found = 0;
+    *covered = 0;
+    if (!map_file(path, &index)) {
+        return 0;
+    }
+    IndexHeader* header = index.data;
+    if (index.size < sizeof(IndexHeader) ||
+            memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) ||
+            header->version != INDEX_VERSION || index.size <
+            sizeof(IndexHeader) + sizeof(IndexKey) * header->keyCount) {
+        fprintf(stderr, "Ignoring bad index %s\n", path);
+        munmap(index.data, index.size);
+        return 0;
+    }
+    IndexKey* keys = (IndexKey*)(header + 1);
+    long low = 0;
+    long high = (long)header->keyCount - 1;
+    while (low <= high) {
+        long middle = (low + high) / 2;
+        int order = strncmp(keys[middle].key, key, INDEX_KEY_LENGTH);
+        if (order < 0) {
+            low = middle + 1;
+        } else if (order > 0) {
+            high = middle - 1;
+        } else {
+            if (keys[middle].offset + keys[middle].length <= index.size) {
+                *tables = malloc(sizeof(uint32_t) *
+                        (keys[middle].postingCount + 1));
+                found = decode_postings((uint8_t*)index.data +
+                        keys[middle].offset, keys[middle].length, *tables);
+            }
+            break;
+        }
+    }
+    *covered = header->segmentSize;
+    munmap(index.data, index.size);
+    return found;
+}
+
+/*
+*   Adds a table to a sorted list of count tables unless it is already
+*   there. Returns the new count.
+*/
+uint32_t add_table(uint32_t** tables, uint32_t count, uint32_t table) {
+    uint32_t i = count;
+    while (i > 0 && (*tables)[i - 1] > table) {
+        i--;
+    }
+    if (i > 0 && (*tables)[i - 1] == table) {
+        return count;
+    }
+    *tables = realloc(*tables, sizeof(uint32_t) * (count + 1));
+    memmove(*tables + i + 1, *tables + i, sizeof(uint32_t) * (count - i));
+    (*tables)[i] = table;
+    return count + 1;
+}
+
+/*
+*   Rebuilds the index for a whole segment.
+*/
+void build_index(const char* path, Mapping* segment) {
+    Indexer indexer;
+    JournalRecord* records = (JournalRecord*)((JournalHeader*)segment->data +
+            1);
+    long count = (segment->size - sizeof(JournalHeader)) /
+            sizeof(JournalRecord);
+    indexer_init(&indexer);
+    for (long i = 0; i < count; i++) {
+        indexer_add_record(&indexer, &records[i]);
+    }
+    if (!indexer_write(&indexer, path, sizeof(JournalHeader) +
+            count * sizeof(JournalRecord))) {
+        fprintf(stderr, "Cannot write %s\n", path);
+    }
+    indexer_clear(&indexer);
+    free(indexer.entries);
+}
+
+/*
+*   Prints every record belonging to one of the sorted tables.
+*/
+void print_tables(const char* name, JournalRecord* records, long count,
+        uint32_t* tables, uint32_t found) {
+    for (long i = 0; i < count; i++) {
+        uint32_t low = 0;
+        uint32_t high = found;
+        while (low < high) {
+            uint32_t middle = (low + high) / 2;
+            if (tables[middle] < records[i].table) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        if (low < found && tables[low] == records[i].table) {
+            print_record(name, &records[i]);
+        }
+    }
+}
+
+/*
+*   Prints one record as a line of text. A long name is printed a part at
+*   a time, as it is recorded.
+*/
+void print_record(const char* name, JournalRecord* record) {
+    static const char* types[] = {"?", "start", "player", "deal", "bid",
+            "play", "trick", "score", "over", "continued"};
+    const char* type = record->type <= JOURNAL_CONTINUED ?
+            types[record->type] : "?";
+    printf("%s %u %u %llu %s %u", name, record->table, record->hand,
+            (unsigned long long)record->timestamp, type, record->seat);
+    if (record->type == JOURNAL_PLAYER) {
+        printf(" %.*s\n", (int)strnlen(record->data.name,
+                JOURNAL_NAME_LENGTH), record->data.name);
+    } else {
+        printf(" %d %d %d %d\n", record->data.values.a,
+                record->data.values.b, record->data.values.c,
+                record->data.values.d);
+    }
+}
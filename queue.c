@@ -0,0 +1,169 @@
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "queue.h"
+#include "metrics.h"
+
+/*
+*   Initialises a queue holding up to capacity items. Capacity is rounded
+*   up to a power of two. Returns 0 on failure.
+*/
+int queue_init(Queue* queue, unsigned long capacity) {
+    unsigned long size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    queue->slots = malloc(sizeof(QueueSlot) * size);
+    queue->eventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->slots == NULL || queue->eventFD < 0) {
+        return 0;
+    }
+    for (unsigned long i = 0; i < size; i++) {
+        queue->slots[i].sequence = i;
+    }
+    queue->mask = size - 1;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->sleeping = 0;
+    queue->peakDepth = 0;
+    return 1;
+}
+
+/*
+*   Adds an item to the queue from any thread, waking the consumer if it is
+*   asleep. Returns 0 if the queue is full.
+*/
+int queue_push(Queue* queue, void* item) {
+    unsigned long pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    QueueSlot* slot;
+    while (1) {
+        slot = &queue->slots[pos & queue->mask];
+        unsigned long sequence = __atomic_load_n(&slot->sequence,
+                __ATOMIC_ACQUIRE);
+        long diff = (long)(sequence - pos);
+        if (diff == 0) {
+            // The slot is free, try to claim it
+            if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The consumer has not freed this slot yet, so we are full
+            METRIC_ADD(queueFull, 1);
+            return 0;
+        } else {
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->item = item;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    METRIC_ADD(queuePushes, 1);
+
+    unsigned long depth = pos + 1 - __atomic_load_n(&queue->tail,
+            __ATOMIC_RELAXED);
+    unsigned long peak = __atomic_load_n(&queue->peakDepth, __ATOMIC_RELAXED);
+    while (depth > peak && !__atomic_compare_exchange_n(&queue->peakDepth,
+            &peak, depth, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+
+    if (__atomic_exchange_n(&queue->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        while (write(queue->eventFD, &one, sizeof(one)) < 0 &&
+                errno == EINTR) {
+        }
+    }
+    return 1;
+}
+
+/*
+*   Adds an item to the queue, yielding until the consumer makes room.
+*/
+void queue_push_wait(Queue* queue, void* item) {
+    while (!queue_push(queue, item)) {
+        sched_yield();
+    }
+}
+
+/*
+*   Removes up to max items from the queue. Only the consumer may call this.
+*   Returns the number of items removed.
+*/
+int queue_pop_batch(Queue* queue, void** items, int max) {
+    int count = 0;
+    unsigned long pos = queue->tail;
+    while (count < max) {
+        QueueSlot* slot = &queue->slots[pos & queue->mask];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1) {
+            break;
+        }
+        items[count++] = slot->item;
+        __atomic_store_n(&slot->sequence, pos + queue->mask + 1,
+                __ATOMIC_RELEASE);
+        pos++;
+    }
+    __atomic_store_n(&queue->tail, pos, __ATOMIC_RELAXED);
+    if (count) {
+        METRIC_ADD(queueBatches, 1);
+        METRIC_ADD(queuePops, count);
+    }
+    return count;
+}
+
+/*
+*   Returns the number of items waiting in the queue.
+*/
+unsigned long queue_depth(Queue* queue) {
+    unsigned long tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    unsigned long head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    return head > tail ? head - tail : 0;
+}
+
+/*
+*   Tells producers the consumer is about to sleep on the eventfd. Returns
+*   0 if the next item is ready to pop, in which case the consumer should
+*   not sleep. A slot a producer has claimed but not yet filled does not
+*   count: that producer rings the doorbell once it publishes the item.
+*/
+int queue_prepare_sleep(Queue* queue) {
+    unsigned long tail = queue->tail;
+    __atomic_store_n(&queue->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->slots[tail & queue->mask].sequence,
+            __ATOMIC_SEQ_CST) == tail + 1) {
+        __atomic_store_n(&queue->sleeping, 0, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+*   Called by the consumer once it has woken up, whatever woke it.
+*/
+void queue_finish_sleep(Queue* queue) {
+    __atomic_store_n(&queue->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+*   Clears a wakeup posted to the queue's eventfd.
+*/
+void queue_clear_doorbell(Queue* queue) {
+    uint64_t count;
+    while (read(queue->eventFD, &count, sizeof(count)) < 0 &&
+            errno == EINTR) {
+    }
+}
+
+/*
+*   Blocks the consumer until there is something in the queue.
+*/
+void queue_wait(Queue* queue) {
+    struct pollfd doorbell = {queue->eventFD, POLLIN, 0};
+    while (queue_prepare_sleep(queue)) {
+        poll(&doorbell, 1, -1);
+        queue_finish_sleep(queue);
+        queue_clear_doorbell(queue);
+    }
+}
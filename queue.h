@@ -0,0 +1,39 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+/*
+*   One slot of a queue. The sequence number tells producers and the
+*   consumer whose turn it is to use the slot.
+*/
+typedef struct {
+    unsigned long sequence;
+    void* item;
+} QueueSlot;
+
+/*
+*   A bounded lock-free multi-producer single-consumer queue of pointers.
+*   A consumer that runs out of work sleeps on the eventfd, which producers
+*   only write to when the consumer has said it is sleeping.
+*/
+typedef struct {
+    QueueSlot* slots;
+    unsigned long mask;
+    // Producers and the consumer sit on separate cache lines
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long tail __attribute__((aligned(64)));
+    int sleeping __attribute__((aligned(64)));
+    int eventFD;
+    unsigned long peakDepth;
+} Queue;
+
+int queue_init(Queue*, unsigned long);
+int queue_push(Queue*, void*);
+void queue_push_wait(Queue*, void*);
+int queue_pop_batch(Queue*, void**, int);
+unsigned long queue_depth(Queue*);
+int queue_prepare_sleep(Queue*);
+void queue_finish_sleep(Queue*);
+void queue_clear_doorbell(Queue*);
+void queue_wait(Queue*);
+
+#endif
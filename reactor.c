@@ -0,0 +1,156 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "reactor.h"
+#include "networking.h"
+#include "connection.h"
+
+/*
+*   Hashes a game name (FNV-1a) so that every connection for a game is
+*   routed to the same shard.
+*/
+unsigned int hash_game_name(const char* name) {
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+*   Creates count reactors, each with its own listening socket on port, its
+*   own epoll instance, I/O backend, mailbox and lobby expiry wheel.
+*/
+Reactor* create_reactors(int count, int port) {
+    // The mailboxes want their own cache lines
+    Reactor* reactors = aligned_alloc(64, sizeof(Reactor) * count);
+    memset(reactors, 0, sizeof(Reactor) * count);
+    for (int i = 0; i < count; i++) {
+        Reactor* reactor = &reactors[i];
+        reactor->id = i;
+        reactor->localFD = -1;
+        matcher_init(&reactor->matcher);
+        reactor->listenFD = open_listen(port, count > 1);
+        fcntl(reactor->listenFD, F_SETFL,
+                fcntl(reactor->listenFD, F_GETFL) | O_NONBLOCK);
+        reactor->epollFD = epoll_create1(0);
+        reactor->io = io_backend_create();
+        if (reactor->epollFD < 0 ||
+                !queue_init(&reactor->mailbox, MAILBOX_SIZE) ||
+                !watch_fd(reactor, reactor->io->ops->listen(reactor->io,
+                reactor->listenFD), &reactor->listenFD) ||
+                !watch_fd(reactor, reactor->mailbox.eventFD,
+                &reactor->mailbox) ||
+                !lobby_wheel_init(&reactor->lobbies) ||
+                !watch_fd(reactor, reactor->lobbies.timerFD,
+                &reactor->lobbies)) {
+            exit(5);
+        }
+    }
+    return reactors;
+}
+
+/*
+*   Starts a thread for every reactor except the first, which is run by the
+*   calling thread.
+*/
+void start_reactors(Reactor* reactors, int count, void* (*loop)(void*)) {
+    for (int i = 1; i < count; i++) {
+        pthread_create(&reactors[i].thread, NULL, loop, &reactors[i]);
+    }
+    reactors[0].thread = pthread_self();
+    loop(&reactors[0]);
+}
+
+/*
+*   Returns the reactor that owns the lobby for the given game name.
+*/
+Reactor* shard_for_game(Reactor* reactors, int count, const char* name) {
+    return &reactors[hash_game_name(name) % count];
+}
+
+/*
+*   Hands a message to a reactor from any thread. The reactor is only woken
+*   if it is asleep. If its mailbox is full the caller waits for room rather
+*   than losing a player.
+*/
+void post_to_shard(Reactor* reactor, ShardMessage* message) {
+    queue_push_wait(&reactor->mailbox, message);
+}
+
+/*
+*   Adds a file descriptor to the reactor's event loop. Returns 0 on
+*   failure.
+*/
+int watch_fd(Reactor* reactor, int fd, void* data) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = data;
+    return epoll_ctl(reactor->epollFD, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+/*
+*   Changes whether the reactor's event loop waits for a watched file
+*   descriptor to have room to write as well as to be readable.
+*/
+void watch_writable(Reactor* reactor, int fd, void* data, int writable) {
+    struct epoll_event event;
+    event.events = writable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.ptr = data;
+    epoll_ctl(reactor->epollFD, EPOLL_CTL_MOD, fd, &event);
+}
+
+/*
+*   Removes a file descriptor from the reactor's event loop.
+*/
+void unwatch_fd(Reactor* reactor, int fd) {
+    epoll_ctl(reactor->epollFD, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*
+*   Returns one of the reactor's idle workers, starting a new worker
+*   running loop if they are all busy. Only the owning reactor may call
+*   this.
+*/
+Worker* take_worker(Reactor* reactor, void* (*loop)(void*)) {
+    Worker* worker = reactor->idleWorkers;
+    if (worker != NULL) {
+        reactor->idleWorkers = worker->next;
+        __atomic_store_n(&reactor->idleCount, reactor->idleCount - 1,
+                __ATOMIC_RELAXED);
+        return worker;
+    }
+    worker = aligned_alloc(64, sizeof(Worker));
+    memset(worker, 0, sizeof(Worker));
+    if (!queue_init(&worker->inbox, 2)) {
+        exit(5);
+    }
+    worker->owner = reactor;
+    worker->io = io_backend_create();
+    worker->idle.type = SHARD_WORKER_IDLE;
+    worker->idle.worker = worker;
+    pthread_create(&worker->thread, NULL, loop, worker);
+    pthread_detach(worker->thread);
+    __atomic_store_n(&reactor->workerCount, reactor->workerCount + 1,
+            __ATOMIC_RELAXED);
+    return worker;
+}
+
+/*
+*   Called by a worker once its game is over to tell its reactor that it
+*   can be given another one.
+*/
+void release_worker(Worker* worker) {
+    post_to_shard(worker->owner, &worker->idle);
+}
+
+/*
+*   Puts a released worker back on the reactor's idle list.
+*/
+void return_worker(Reactor* reactor, Worker* worker) {
+    worker->next = reactor->idleWorkers;
+    reactor->idleWorkers = worker;
+    __atomic_store_n(&reactor->idleCount, reactor->idleCount + 1,
+            __ATOMIC_RELAXED);
+}
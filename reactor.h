@@ -0,0 +1,120 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include "pending.h"
+#include "queue.h"
+#include "matcher.h"
+
+// Longest name + game name handshake accepted from a client
+#define MAX_HANDSHAKE 1024
+// Most events handled per epoll_wait call
+#define MAX_EVENTS 64
+// Most messages a reactor takes from its mailbox in one go
+#define MAX_BATCH 64
+// Capacity of each reactor's and worker's mailbox
+#define MAILBOX_SIZE 4096
+
+/*
+*   What a connection watched by a reactor's event loop is, stored first in
+*   whatever the event points to.
+*/
+typedef enum {
+    WATCH_HANDSHAKE,
+    WATCH_SPECTATOR
+} WatchType;
+
+/*
+*   A connection that has been accepted but has not yet sent its name and
+*   game name. A client on the Unix socket may first pass the rings it
+*   wants to be carried over.
+*/
+typedef struct {
+    WatchType type;
+    int fd;
+    int local;
+    struct ShmChannel* shm;
+    uint32_t id;
+    int length;
+    int lines;
+    char buffer[MAX_HANDSHAKE];
+} Handshake;
+
+typedef enum {
+    SHARD_JOIN,
+    SHARD_WORKER_IDLE,
+    SHARD_SPECTATE,
+    SHARD_TABLE_START,
+    SHARD_FRAME,
+    SHARD_TABLE_OVER
+} ShardMessageType;
+
+/*
+*   A message passed to the reactor that owns a lobby or a worker.
+*/
+typedef struct {
+    ShardMessageType type;
+    Player* player;
+    char* gameName;
+    int options;
+    int fd;
+    struct Worker* worker;
+    struct Broadcast* broadcast;
+    struct Frame* frame;
+} ShardMessage;
+
+/*
+*   A thread that runs one game at a time. Full games arrive through its
+*   inbox and it tells its reactor when it is free again. Its players'
+*   connections are carried by its own I/O backend.
+*/
+typedef struct Worker {
+    Queue inbox;
+    struct Reactor* owner;
+    struct IoBackend* io;
+    ShardMessage idle;
+    struct Worker* next;
+    pthread_t thread;
+} Worker;
+
+/*
+*   A reactor thread with its own listening socket, event loop, shard of
+*   the pending games with the wheel that expires them, and pool of game
+*   workers. The reactor that owns the quick-match name also runs the
+*   matcher. Only the owning reactor ever touches its lobbies and idle
+*   workers, everything else reaches them through the mailbox. New
+*   connections are accepted through the reactor's I/O backend. The first
+*   reactor also listens on the Unix socket, if there is one.
+*/
+typedef struct Reactor {
+    int id;
+    int listenFD;
+    int localFD;
+    struct IoBackend* io;
+    int epollFD;
+    Queue mailbox;
+    LobbyIndex pendingGames;
+    LobbyWheel lobbies;
+    Matcher matcher;
+    Worker* idleWorkers;
+    int workerCount;
+    int idleCount;
+    struct Broadcast* broadcasts;
+    struct Broadcast* dirtyBroadcasts;
+    int spectatorCount;
+    pthread_t thread;
+} Reactor;
+
+unsigned int hash_game_name(const char*);
+Reactor* create_reactors(int, int);
+void start_reactors(Reactor*, int, void* (*)(void*));
+Reactor* shard_for_game(Reactor*, int, const char*);
+void post_to_shard(Reactor*, ShardMessage*);
+int watch_fd(Reactor*, int, void*);
+void unwatch_fd(Reactor*, int);
+void watch_writable(Reactor*, int, void*, int);
+Worker* take_worker(Reactor*, void* (*)(void*));
+void release_worker(Worker*);
+void return_worker(Reactor*, Worker*);
+
+#endif
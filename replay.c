@@ -0,0 +1,518 @@
+/*
+* replay.c
+* Usage: replay499 [-x speed] [-o report] [-c baseline] capture host port
+* Replays traffic captured by serv499 -c against a server. Every captured
+* connection is opened again and sends its lines in the captured order,
+* at the captured times divided by speed, or as fast as the server answers
+* when speed is max. Lines other than the handshake are only sent once
+* the server has asked for a move, as a client would. The server should
+* be dealing the same decks as the captured one, or the moves will not
+* fit the hands. Prints throughput and the latency from each line to the
+* server's next message on the same connection. With -o the figures are
+* also written to report, and with -c they are compared with an earlier
+* report.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "capture.h"
+
+// Milliseconds to wait for the server once nothing is left to send
+#define DRAIN_TIMEOUT 5000
+// Messages from the server that ask for a move
+#define PROMPTS "BLP"
+
+/*
+*   A captured event, due at time microseconds after the replay starts.
+*   Each connection's events are chained in order through next.
+*/
+typedef struct {
+    CaptureRecord* record;
+    char* line;
+    uint64_t time;
+    long next;
+} Event;
+
+/*
+*   A replayed connection.
+*/
+typedef struct {
+    int fd;
+    int open;
+    int done;
+    long head;
+    long tail;
+    int handshake;
+    int prompted;
+    int lineStart;
+    uint64_t sentAt;
+    int awaiting;
+} Client;
+
+/*
+*   The figures a replay reports. Names and values line up with
+*   reportNames.
+*/
+#define REPORT_FIELDS 10
+const char* reportNames[REPORT_FIELDS] = {
+    "connections", "lines_sent", "lines_unsent", "messages_received",
+    "elapsed_ms", "lines_per_second", "latency_p50_us", "latency_p90_us",
+    "latency_p99_us", "latency_max_us"
+};
+
+void usage(void);
+char* read_capture(const char*, long*);
+long load_events(char*, long, double, Event**, Client**, uint32_t*,
+        uint32_t*);
+uint64_t now_us(void);
+void open_client(Client*, struct addrinfo*);
+void read_client(Client*, uint64_t);
+int run_events(Client*, Event*, uint64_t);
+void add_latency(uint64_t);
+int compare_latencies(const void*, const void*);
+void make_report(double*, uint64_t);
+void print_report(double*, const char*);
+void compare_reports(double*, const char*);
+
+// The server every client connects to
+struct addrinfo* serverAddress;
+long clientCount = 0;
+long openedCount = 0;
+long openCount = 0;
+long linesSent = 0;
+long linesUnsent = 0;
+long messages = 0;
+uint64_t* latencies = NULL;
+long latencyCount = 0;
+long latencyCapacity = 0;
+
+int main(int argc, char** argv) {
+    int option;
+    double speed = 1;
+    char* reportFile = NULL;
+    char* baselineFile = NULL;
+    char* end;
+    while ((option = getopt(argc, argv, "x:o:c:")) != -1) {
+        switch (option) {
+            case 'x':
+                if (!strcmp(optarg, "max")) {
+                    speed = 0;
+                } else {
+                    speed = strtod(optarg, &end);
+                    if (*end != '\0' || speed <= 0) {
+                        usage();
+                    }
+                }
+                break;
+            case 'o':
+                reportFile = optarg;
+                break;
+            case 'c':
+                baselineFile = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (argc - optind != 3) {
+        usage();
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(argv[optind + 1], argv[optind + 2], &hints,
+            &serverAddress)) {
+        fprintf(stderr, "Bad Server.\n");
+        exit(2);
+    }
+
+    long size;
+    char* capture = read_capture(argv[optind], &size);
+    Event* events;
+    Client* clients;
+    uint32_t first, last;
+    long eventCount = load_events(capture, size, speed, &events, &clients,
+            &first, &last);
+    clientCount = last - first + 1;
+    if (speed) {
+        printf("Replaying %ld events at %gx\n", eventCount, speed);
+    } else {
+        printf("Replaying %ld events as fast as possible\n", eventCount);
+    }
+
+    struct pollfd* polls = malloc(sizeof(struct pollfd) * clientCount);
+    long* polled = malloc(sizeof(long) * clientCount);
+    uint64_t start = now_us();
+    uint64_t lastActivity = start;
+    int pending = 1;
+    while (pending || openCount > 0) {
+        uint64_t now = now_us();
+        int timeout = -1;
+        if (run_events(clients, events, now - start)) {
+            lastActivity = now;
+        }
+        pending = 0;
+        uint64_t nextDue = UINT64_MAX;
+        for (long i = 0; i < clientCount; i++) {
+            if (clients[i].head >= 0 && !clients[i].done) {
+                pending = 1;
+                if (events[clients[i].head].time < nextDue) {
+                    nextDue = events[clients[i].head].time;
+                }
+            }
+        }
+        if (nextDue != UINT64_MAX && start + nextDue > now) {
+            timeout = (start + nextDue - now + 999) / 1000;
+        } else if (nextDue != UINT64_MAX) {
+            // Events are due but are waiting for the server to ask
+            timeout = DRAIN_TIMEOUT;
+        }
+        if (now - lastActivity > DRAIN_TIMEOUT * 1000ULL) {
+            break;
+        }
+        if (timeout < 0 || timeout > DRAIN_TIMEOUT) {
+            timeout = DRAIN_TIMEOUT;
+        }
+
+        int count = 0;
+        for (long i = 0; i < clientCount; i++) {
+            if (clients[i].open) {
+                polls[count].fd = clients[i].fd;
+                polls[count].events = POLLIN;
+                polled[count++] = i;
+            }
+        }
+        if (poll(polls, count, timeout) > 0) {
+            now = now_us();
+            for (int i = 0; i < count; i++) {
+                if (polls[i].revents) {
+                    read_client(&clients[polled[i]], now);
+                    lastActivity = now;
+                }
+            }
+        }
+    }
+    // Time spent waiting for a server that had nothing more to say is
+    // left out
+    uint64_t elapsed = lastActivity - start;
+    for (long i = 0; i < clientCount; i++) {
+        for (long e = clients[i].head; e >= 0; e = events[e].next) {
+            if (events[e].record->type == CAPTURE_LINE) {
+                linesUnsent++;
+            }
+        }
+    }
+
+    double report[REPORT_FIELDS];
+    make_report(report, elapsed);
+    print_report(report, reportFile);
+    if (baselineFile != NULL) {
+        compare_reports(report, baselineFile);
+    }
+    return 0;
+}
+
+/*
+*   Prints the usage message and exits.
+*/
+void usage(void) {
+    fprintf(stderr, "Usage: replay499 [-x speed|max] [-o report] "
+            "[-c baseline] capture host port\n");
+    exit(1);
+}
+
+/*
+*   Reads a whole capture file and checks its header. Returns the records
+*   after the header.
+*/
+char* read_capture(const char* path, long* size) {
+    struct stat info;
+    CaptureHeader header;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &info) < 0 ||
+            read(fd, &header, sizeof(header)) != sizeof(header) ||
+            memcmp(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) ||
+            header.version != CAPTURE_VERSION ||
+            header.recordSize != sizeof(CaptureRecord)) {
+        fprintf(stderr, "Bad capture file %s\n", path);
+        exit(3);
+    }
+    *size = info.st_size - sizeof(header);
+    char* data = malloc(*size + 1);
+    long done = 0;
+    while (done < *size) {
+        ssize_t count = read(fd, data + done, *size - done);
+        if (count <= 0) {
+            break;
+        }
+        done += count;
+    }
+    *size = done;
+    close(fd);
+    return data;
+}
+
+/*
+*   Turns the captured records into events and chains each connection's
+*   events together. A record cut short by the server stopping is left
+*   out. Returns the number of events.
+*/
+long load_events(char* data, long size, double speed, Event** events,
+        Client** clients, uint32_t* first, uint32_t* last) {
+    long count = 0;
+    long capacity = 1024;
+    uint64_t time = 0;
+    long offset = 0;
+    *events = malloc(sizeof(Event) * capacity);
+    *first = UINT32_MAX;
+    *last = 0;
+    while (offset + (long)sizeof(CaptureRecord) <= size) {
+        CaptureRecord* record = (CaptureRecord*)(data + offset);
+        if (offset + sizeof(CaptureRecord) + record->length > size) {
+            break;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            *events = realloc(*events, sizeof(Event) * capacity);
+        }
+        time += record->delay;
+        Event* event = &(*events)[count++];
+        event->record = record;
+        event->line = data + offset + sizeof(CaptureRecord);
+        event->time = speed ? time / speed : 0;
+        event->next = -1;
+        if (record->connection < *first) {
+            *first = record->connection;
+        }
+        if (record->connection > *last) {
+            *last = record->connection;
+        }
+        offset += sizeof(CaptureRecord) + record->length;
+    }
+    if (count == 0) {
+        fprintf(stderr, "Nothing to replay\n");
+        exit(3);
+    }
+
+    *clients = calloc(*last - *first + 1, sizeof(Client));
+    for (long i = 0; i <= *last - *first; i++) {
+        (*clients)[i].head = -1;
+        (*clients)[i].tail = -1;
+        (*clients)[i].lineStart = 1;
+    }
+    for (long i = 0; i < count; i++) {
+        Client* client = &(*clients)[(*events)[i].record->connection - *first];
+        if (client->tail < 0) {
+            client->head = i;
+        } else {
+            (*events)[client->tail].next = i;
+        }
+        client->tail = i;
+    }
+    return count;
+}
+
+/*
+*   Returns the monotonic time in microseconds.
+*/
+uint64_t now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/*
+*   Connects a client to the server.
+*/
+void open_client(Client* client, struct addrinfo* address) {
+    client->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (client->fd < 0 || connect(client->fd, address->ai_addr,
+            address->ai_addrlen) < 0) {
+        fprintf(stderr, "Bad Server.\n");
+        exit(2);
+    }
+    // Lines go out as soon as they are due, as they did from the clients
+    int one = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    client->open = 1;
+    openedCount++;
+    openCount++;
+}
+
+/*
+*   Reads what the server has sent a client, noting when it is asked for a
+*   move and how long the server took to answer its last line.
+*/
+void read_client(Client* client, uint64_t now) {
+    char buffer[4096];
+    ssize_t count = recv(client->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    } else if (count <= 0) {
+        close(client->fd);
+        client->open = 0;
+        client->done = 1;
+        openCount--;
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        if (client->lineStart) {
+            messages++;
+            if (client->awaiting) {
+                add_latency(now - client->sentAt);
+                client->awaiting = 0;
+            }
+            if (strchr(PROMPTS, buffer[i])) {
+                client->prompted = 1;
+            }
+        }
+        client->lineStart = buffer[i] == '\n';
+    }
+}
+
+/*
+*   Runs every event that is due, elapsed microseconds into the replay.
+*   Handshake lines and closes only wait for their time, and other lines
+*   also wait for the server to ask for them. A connection the server has
+*   closed gives up its remaining events. Returns whether anything ran.
+*/
+int run_events(Client* clients, Event* events, uint64_t elapsed) {
+    int ran = 0;
+    for (long i = 0; i < clientCount; i++) {
+        Client* client = &clients[i];
+        while (client->head >= 0 && !client->done) {
+            Event* event = &events[client->head];
+            if (event->time > elapsed) {
+                break;
+            }
+            if (!client->open) {
+                open_client(client, serverAddress);
+            }
+            if (event->record->type == CAPTURE_CLOSE) {
+                close(client->fd);
+                client->open = 0;
+                client->done = 1;
+                openCount--;
+                client->head = event->next;
+                ran = 1;
+                break;
+            }
+            if (client->handshake >= 2 && !client->prompted) {
+                break;
+            }
+            char line[UINT16_MAX + 2];
+            memcpy(line, event->line, event->record->length);
+            line[event->record->length] = '\n';
+            if (send(client->fd, line, event->record->length + 1,
+                    MSG_NOSIGNAL) < 0) {
+                break;
+            }
+            if (client->handshake < 2) {
+                client->handshake++;
+            } else {
+                client->prompted = 0;
+            }
+            if (!client->awaiting && client->handshake == 2) {
+                client->sentAt = now_us();
+                client->awaiting = 1;
+            }
+            linesSent++;
+            client->head = event->next;
+            ran = 1;
+        }
+    }
+    return ran;
+}
+
+/*
+*   Records how long the server took to answer a line.
+*/
+void add_latency(uint64_t latency) {
+    if (latencyCount == latencyCapacity) {
+        latencyCapacity = latencyCapacity ? latencyCapacity * 2 : 1024;
+        latencies = realloc(latencies, sizeof(uint64_t) * latencyCapacity);
+    }
+    latencies[latencyCount++] = latency;
+}
+
+int compare_latencies(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+*   Fills in the figures for a replay that took elapsed microseconds.
+*/
+void make_report(double* report, uint64_t elapsed) {
+    qsort(latencies, latencyCount, sizeof(uint64_t), compare_latencies);
+    report[0] = openedCount;
+    report[1] = linesSent;
+    report[2] = linesUnsent;
+    report[3] = messages;
+    report[4] = elapsed / 1000.0;
+    report[5] = elapsed ? linesSent * 1e6 / elapsed : 0;
+    report[6] = latencyCount ? latencies[latencyCount / 2] : 0;
+    report[7] = latencyCount ? latencies[latencyCount * 9 / 10] : 0;
+    report[8] = latencyCount ? latencies[latencyCount * 99 / 100] : 0;
+    report[9] = latencyCount ? latencies[latencyCount - 1] : 0;
+}
+
+/*
+*   Prints the figures, and writes them to a report file if one is given.
+*/
+void print_report(double* report, const char* path) {
+    FILE* file = path != NULL ? fopen(path, "w") : NULL;
+    if (path != NULL && file == NULL) {
+        fprintf(stderr, "Cannot write %s\n", path);
+    }
+    for (int i = 0; i < REPORT_FIELDS; i++) {
+        printf("%-20s %.1f\n", reportNames[i], report[i]);
+        if (file != NULL) {
+            fprintf(file, "%s %.1f\n", reportNames[i], report[i]);
+        }
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+}
+
+/*
+*   Compares the figures with those in an earlier report.
+*/
+void compare_reports(double* report, const char* path) {
+    char name[64];
+    double value;
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        return;
+    }
+    printf("\n%-20s %12s %12s %8s\n", "", "baseline", "now", "change");
+    while (fscanf(file, "%63s %lf", name, &value) == 2) {
+        for (int i = 0; i < REPORT_FIELDS; i++) {
+            if (strcmp(name, reportNames[i])) {
+                continue;
+            }
+            printf("%-20s %12.1f %12.1f", name, value, report[i]);
+            if (value != 0) {
+                printf(" %+7.1f%%", (report[i] - value) * 100 / value);
+            }
+            printf("\n");
+        }
+    }
+    fclose(file);
+}
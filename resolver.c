@@ -0,0 +1,163 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include "resolver.h"
+#include "queue.h"
+#include "metrics.h"
+
+/*
+*   An accepted connection whose address is to be named.
+*/
+typedef struct {
+    uint32_t connection;
+    struct sockaddr_in address;
+} Lookup;
+
+/*
+*   A remembered name, or the address itself if it has none.
+*/
+typedef struct {
+    uint32_t address;
+    long expires;
+    char name[RESOLVER_NAME];
+} CachedName;
+
+/*
+*   The names the resolver threads have found, and the threads, each with
+*   its own queue of lookups. Lookups are handed to the threads in turn.
+*/
+static struct {
+    pthread_mutex_t lock;
+    CachedName* cache;
+    int enabled;
+    long ttl;
+    Queue queues[RESOLVER_THREADS];
+    pthread_t threads[RESOLVER_THREADS];
+    unsigned int next;
+} resolver = {PTHREAD_MUTEX_INITIALIZER};
+
+/*
+*   Copies the remembered name of an address into name. Returns 0 if it is
+*   not remembered or has expired.
+*/
+static int find_cached(uint32_t address, char* name) {
+    CachedName* entry = &resolver.cache[ntohl(address) &
+            (RESOLVER_CACHE - 1)];
+    int found = 0;
+    pthread_mutex_lock(&resolver.lock);
+    if (entry->address == address && entry->expires > monotonic_ms()) {
+        memcpy(name, entry->name, RESOLVER_NAME);
+        found = 1;
+    }
+    pthread_mutex_unlock(&resolver.lock);
+    return found;
+}
+
+/*
+*   Remembers an address's name for ttl milliseconds.
+*/
+static void add_cached(uint32_t address, const char* name, long ttl) {
+    CachedName* entry = &resolver.cache[ntohl(address) &
+            (RESOLVER_CACHE - 1)];
+    pthread_mutex_lock(&resolver.lock);
+    entry->address = address;
+    entry->expires = monotonic_ms() + ttl;
+    memcpy(entry->name, name, RESOLVER_NAME);
+    pthread_mutex_unlock(&resolver.lock);
+}
+
+/*
+*   Logs the name found for a connection.
+*/
+static void log_name(Lookup* lookup, const char* name) {
+    fprintf(stderr, "serv499: connection %u from %s\n", lookup->connection,
+            name);
+}
+
+/*
+*   Names one connection's address, from the cache if it can, and logs it.
+*   An address without a name is logged as itself.
+*/
+static void resolve(Lookup* lookup) {
+    char name[RESOLVER_NAME];
+    uint32_t address = lookup->address.sin_addr.s_addr;
+    if (find_cached(address, name)) {
+        METRIC_ADD(resolverHits, 1);
+        log_name(lookup, name);
+        return;
+    }
+    METRIC_ADD(resolverLookups, 1);
+    if (!getnameinfo((struct sockaddr*)&lookup->address,
+            sizeof(lookup->address), name, sizeof(name), NULL, 0,
+            NI_NAMEREQD)) {
+        add_cached(address, name, resolver.ttl);
+    } else {
+        METRIC_ADD(resolverFailures, 1);
+        inet_ntop(AF_INET, &lookup->address.sin_addr, name, sizeof(name));
+        add_cached(address, name, RESOLVER_NEGATIVE_TTL * 1000L);
+    }
+    log_name(lookup, name);
+}
+
+/*
+*   A resolver thread's loop. Looks up whatever is in its queue.
+*/
+static void* run_resolver(void* arg) {
+    Queue* queue = (Queue*)arg;
+    void* lookup;
+    while (1) {
+        queue_wait(queue);
+        while (queue_pop_batch(queue, &lookup, 1)) {
+            resolve((Lookup*)lookup);
+            free(lookup);
+        }
+    }
+    return NULL;
+}
+
+/*
+*   Starts the resolver threads, with names remembered for ttl seconds.
+*   Returns 0 on failure.
+*/
+int resolver_start(long ttl) {
+    resolver.ttl = ttl * 1000;
+    resolver.cache = calloc(RESOLVER_CACHE, sizeof(CachedName));
+    if (resolver.cache == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < RESOLVER_THREADS; i++) {
+        if (!queue_init(&resolver.queues[i], RESOLVER_QUEUE)) {
+            return 0;
+        }
+        pthread_create(&resolver.threads[i], NULL, run_resolver,
+                &resolver.queues[i]);
+    }
+    resolver.enabled = 1;
+    return 1;
+}
+
+/*
+*   Returns whether client addresses are being named.
+*/
+int resolver_enabled(void) {
+    return resolver.enabled;
+}
+
+/*
+*   Asks for a connection's address to be named. This never blocks: if
+*   the resolver's queue is full the lookup is dropped and counted.
+*/
+void resolver_lookup(uint32_t connection, const struct sockaddr_in* from) {
+    Lookup* lookup = malloc(sizeof(Lookup));
+    lookup->connection = connection;
+    lookup->address = *from;
+    unsigned int next = __atomic_fetch_add(&resolver.next, 1,
+            __ATOMIC_RELAXED);
+    if (!queue_push(&resolver.queues[next % RESOLVER_THREADS], lookup)) {
+        METRIC_ADD(resolverDropped, 1);
+        free(lookup);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Threads looking up host names, and lookups each may have waiting
+#define RESOLVER_THREADS 4
+#define RESOLVER_QUEUE 1024
+// Addresses whose names are remembered, a power of two
+#define RESOLVER_CACHE 4096
+// Longest host name kept
+#define RESOLVER_NAME 256
+// Seconds an address that has no name is remembered as having none
+#define RESOLVER_NEGATIVE_TTL 30
+
+int resolver_start(long);
+int resolver_enabled(void);
+void resolver_lookup(uint32_t, const struct sockaddr_in*);
+
+#endif
@@ -1,18 +1,55 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #include "networking.h"
 #include "pending.h"
+#include "reactor.h"
+#include "metrics.h"
+#include "cards.h"
+#include "journal.h"
+#include "deckcache.h"
+#include "decks.h"
+#include "spectators.h"
+#include "connection.h"
+#include "capture.h"
+#include "trace.h"
+#include "probes.h"
+#include "tables.h"
+#include "admission.h"
+#include "resolver.h"
+#include "shmring.h"
 
-void validate_arguments(int, char**);
+int validate_arguments(int, char**);
+void usage(void);
 void read_deck_file(char*, Server*);
-void wait_for_players(int);
-void add_player_to_game(Player*, char*);
-void check_for_full_games(void);
+void* wait_for_players(void*);
+void* run_games(void*);
+void read_console_command(Reactor*);
+void print_server_metrics(FILE*);
+void accept_players(Reactor*);
+void accept_local_players(Reactor*);
+void start_handshake(Reactor*, int, struct sockaddr_in*);
+void read_handshake(Reactor*, Handshake*);
+void attach_rings(Reactor*, Handshake*);
+void drop_handshake(Reactor*, Handshake*);
+void join_game(Reactor*, Player*, char*, int);
+void watch_table(Reactor*, int, char*);
+void read_shard_messages(Reactor*);
+void add_player_to_game(Reactor*, Player*, char*, int);
+void start_if_full(Reactor*, PendingGame*);
+void expire_lobbies(Reactor*);
+void turn_away(Connection*, const char*);
+void start_full_game(Reactor*, Game*);
+void seat_quick_match_players(Reactor*);
 void* start_game(void*);
-void send_welcome_message(FILE*);
+void send_welcome_message(Connection*);
 void deal_cards(Game*);
 void increment_game_deck(Game*);
 void initiate_bidding(Game*);
@@ -22,239 +59,849 @@ int get_winning_bidder_index(Game*);
 void print_teams(Game*);
 void send_to_players(Game*, char, char*, int);
 int play_trick(Game*, int);
+void play_forced_card(Game*, int, Card*);
+int ask_for_card(Game*, int, char, Card*);
 int get_trick_winner(Card**, Game*, char);
 void set_points(Game*);
 int check_points(Game*);
 int check_for_empty_hand(Game*);
 void reorder_players(Game*);
-void create_player(int);
+Player* create_player(int, uint32_t, ShmChannel*, char*);
+char* read_move(Game*, int);
 void check_for_eof(Game*, char*, int);
 void get_players_bid(Game*, Card*, Card*, int, int);
+void record_event(Game*, int, int, int, int, int, int);
+void record_players(Game*);
+
+// Number of times a player is asked for a legal move before one is made
+// for them
+#define MOVE_ATTEMPTS 3
+// Memory held by an open lobby, and by each player waiting in one
+#define LOBBY_BYTES (sizeof(PendingGame) + sizeof(TableSlab) / TABLE_SLAB_SIZE)
+#define LOBBY_PLAYER_BYTES (sizeof(Player) + sizeof(Connection) + \
+        CONNECTION_OUTPUT)
 
 // Global instance of the server
 Server* server;
-// Stores all of the pending games before they are started
-PendingGame* pendingGameList;
+// Identifier given to the next table that starts
+uint32_t nextTableId = 1;
+// Identifier given to the next connection accepted, used in captures
+uint32_t nextConnectionId = 1;
 
 int main(int argc, char *argv[]) {
     signal(SIGPIPE, SIG_IGN);
 
-    // Validate that all of the input arguments are valid
-    validate_arguments(argc, argv);
-
     // Allocate the global server struct instance
-    server = malloc(sizeof(Server));
+    server = calloc(1, sizeof(Server));
+
+    // Validate that all of the input arguments are valid
+    int arg = validate_arguments(argc, argv);
 
     // Store the server greeting message
-    server->greeting = strdup(argv[2]);
+    server->greeting = strdup(argv[arg + 1]);
+
+    // Check for a valid deck file and read in the contents, unless every
+    // deal is generated from the seed
+    if (!server->seeded) {
+        read_deck_file(argv[arg + 2], server);
+
+        // Analyse the decks in the background, unless told not to or an
+        // earlier run already left the analyses in the cache file
+        if ((server->deckCache == NULL ||
+                strcmp(server->deckCache, DECK_CACHE_OFF)) &&
+                !deck_cache_open(argv[arg + 2], server->deckCache,
+                server->decks, server->deckCount)) {
+            fprintf(stderr, "serv499: decks will not be analysed\n");
+        }
+    }
 
-    // Initialise the pending game list to zero
-    pendingGameList = malloc(sizeof(PendingGame));
-    pendingGameList = NULL;
+    // Start capturing client traffic if asked to
+    if (server->captureFile != NULL && !capture_open(server->captureFile)) {
+        fprintf(stderr, "Capture Error\n");
+        exit(8);
+    }
 
-    // Check for a valid deck file and read in the contents
-    read_deck_file(argv[3], server);
+    // Start naming clients if asked to. The server runs without names if
+    // the resolver cannot start.
+    if (server->resolveTTL && !resolver_start(server->resolveTTL)) {
+        fprintf(stderr, "serv499: client host names will not be logged\n");
+    }
 
-    // Open a listening socket on the supplied port.
-    int fdServer = open_listen(atoi(argv[1]));
+    // Start recording hand histories if asked to
+    if (server->journalDirectory != NULL &&
+            !journal_open(server->journalDirectory, server->fsyncPolicy)) {
+        fprintf(stderr, "Journal Error\n");
+        exit(7);
+    }
+
+    // Open a listening socket on the supplied port for every reactor. Each
+    // reactor owns its own shard of the pending games.
+    server->reactors = create_reactors(server->reactorCount,
+            atoi(argv[arg]));
+
+    // Clients on the same host may also connect through a Unix socket,
+    // which the first reactor listens on
+    if (server->localPath != NULL) {
+        Reactor* first = &server->reactors[0];
+        first->localFD = open_local_listen(server->localPath);
+        if (!watch_fd(first, first->localFD, &first->localFD)) {
+            exit(5);
+        }
+    }
 
     // Wait for incoming client connections
-    wait_for_players(fdServer);
+    start_reactors(server->reactors, server->reactorCount, wait_for_players);
 }
 
 /*
-*   Validate the command line input arguments.
+*   Validate the command line input arguments. Options come before the
+*   positional arguments:
+*       -r reactors   number of reactor threads (0 for one per CPU)
+*       -w window     quick-match batching window in milliseconds
+*       -l seconds    close lobbies that have not filled after this long
+*                     (0 for never)
+*       -L lobbies    most lobbies open at once (0 for no limit)
+*       -a rate       most new connections a second from each source
+*                     address, as rate or rate/burst (0 for no limit)
+*       -m conns      most connections open at once (0 for no limit),
+*                     by default what the descriptor limit allows
+*       -k count      most connections in their handshake at once (0 for
+*                     no limit)
+*       -n seconds    log the host name of every client, looked up away
+*                     from the reactors and remembered for seconds
+*       -u path       also listen on a Unix socket at path, over which
+*                     clients on the same host may instead pass
+*                     shared-memory rings to be carried over
+*       -j directory  record hand histories in a journal in directory
+*       -J policy     journal fsync policy: never, batch (every group
+*                     commit) or the most milliseconds between syncs
+*       -s seed       shuffle every deal from seed, the table id and the
+*                     hand number instead of reading a deck file, which
+*                     is then left out
+*       -b backend    network backend: epoll (the default) or uring,
+*                     which falls back to epoll if the kernel lacks it
+*       -c file       capture every line clients send to file, for
+*                     replay499
+*       -A cache      keep the analyses of the decks in the file cache
+*                     instead of beside the deck file, only in memory
+*                     (memory), or do not analyse the decks (off)
+*       -t sample     trace a fraction of tables, from 0 to 1, or every
+*                     table with the given name
+*   Returns the index of the port argument.
 */
-void validate_arguments(int argc, char** argv) {
-    if (argc != 4) {
-        // Throw usage error (exit(1))
-        fprintf(stderr, "Usage: serv499 port greeting deck\n");
-        exit(1);
+int validate_arguments(int argc, char** argv) {
+    int option;
+    char* end;
+    long seconds;
+    server->reactorCount = 1;
+    server->matchWindow = DEFAULT_MATCH_WINDOW;
+    server->lobbyTTL = DEFAULT_LOBBY_TTL;
+    server->lobbyLimit = DEFAULT_LOBBY_LIMIT;
+    server->connectionLimit = -1;
+    server->handshakeLimit = DEFAULT_HANDSHAKE_LIMIT;
+    server->journalDirectory = NULL;
+    server->fsyncPolicy = DEFAULT_FSYNC_INTERVAL;
+    while ((option = getopt(argc, argv,
+            "+r:w:l:L:a:m:k:n:u:j:J:s:b:c:A:t:")) != -1) {
+        switch (option) {
+            case 'b':
+                if (!io_backend_select(optarg)) {
+                    usage();
+                }
+                break;
+            case 's':
+                server->seeded = 1;
+                server->seed = strtoull(optarg, &end, 0);
+                if (*end != '\0') {
+                    usage();
+                }
+                break;
+            case 'j':
+                server->journalDirectory = optarg;
+                break;
+            case 'c':
+                server->captureFile = optarg;
+                break;
+            case 'A':
+                server->deckCache = optarg;
+                break;
+            case 't':
+                if (!trace_sample_rate(optarg)) {
+                    trace_table(optarg);
+                }
+                break;
+            case 'J':
+                if (!strcmp(optarg, "never")) {
+                    server->fsyncPolicy = FSYNC_NEVER;
+                } else if (!strcmp(optarg, "batch")) {
+                    server->fsyncPolicy = FSYNC_EVERY_BATCH;
+                } else {
+                    server->fsyncPolicy = strtol(optarg, &end, 10);
+                    if (*end != '\0' || server->fsyncPolicy <= 0) {
+                        usage();
+                    }
+                }
+                break;
+            case 'w':
+                server->matchWindow = strtol(optarg, &end, 10);
+                if (*end != '\0' || server->matchWindow < 0) {
+                    usage();
+                }
+                break;
+            case 'l':
+                seconds = strtol(optarg, &end, 10);
+                if (*end != '\0' || seconds < 0 || seconds > INT_MAX / 1000) {
+                    usage();
+                }
+                server->lobbyTTL = seconds * 1000;
+                break;
+            case 'L':
+                server->lobbyLimit = strtol(optarg, &end, 10);
+                if (*end != '\0' || server->lobbyLimit < 0) {
+                    usage();
+                }
+                break;
+            case 'a':
+                if (!admission_set_rate(optarg)) {
+                    usage();
+                }
+                break;
+            case 'm':
+                server->connectionLimit = strtol(optarg, &end, 10);
+                if (*end != '\0' || server->connectionLimit < 0) {
+                    usage();
+                }
+                break;
+            case 'k':
+                server->handshakeLimit = strtol(optarg, &end, 10);
+                if (*end != '\0' || server->handshakeLimit < 0) {
+                    usage();
+                }
+                break;
+            case 'n':
+                server->resolveTTL = strtol(optarg, &end, 10);
+                if (*end != '\0' || server->resolveTTL <= 0) {
+                    usage();
+                }
+                break;
+            case 'u':
+                server->localPath = optarg;
+                break;
+            case 'r':
+                server->reactorCount = strtol(optarg, &end, 10);
+                if (*end != '\0' || server->reactorCount < 0) {
+                    usage();
+                }
+                if (server->reactorCount == 0) {
+                    server->reactorCount = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    if (argc - optind != (server->seeded ? 2 : 3)) {
+        usage();
     }
 
     char** remainder = malloc(sizeof(char**));
-    int port = strtol(argv[1], remainder, 10);
+    int port = strtol(argv[optind], remainder, 10);
     if (strcmp(*remainder, "") || port < 1 || port > 65535) {
         fprintf(stderr, "Invalid Port\n");
         exit(4);
     }
     free(remainder);
+    admission_set_limits(server->connectionLimit, server->handshakeLimit);
+    return optind;
 }
 
 /*
-*   Reads multiple decks from a file and stores them in the server.
+*   Prints the usage message and exits. With -s the deck file is left out.
 */
-void read_deck_file(char* deckFile, Server* server) {
-    char** decks = NULL;
-    int deckCount = 0;
+void usage(void) {
+    fprintf(stderr, "Usage: serv499 [options] port greeting deck\n"
+            "       serv499 [options] -s seed port greeting\n");
+    exit(1);
+}
 
-    FILE* fp = fopen(deckFile, "r");
-    // Cannot open deck file
-    if (fp == NULL) {
+/*
+*   Reads multiple decks from a file and stores them in the server, each
+*   ready to be dealt. Every deck must hold each card exactly once.
+*/
+void read_deck_file(char* deckFile, Server* server) {
+    long deckCount = load_decks(deckFile, &server->decks);
+    if (deckCount < 0) {
+        fprintf(stderr, "Deck Error\n");
+        exit(6);
+    }
+    server->deckCount = deckCount;
+    server->deals = prepare_deals(server->decks, deckCount);
+    if (server->deals == NULL) {
         fprintf(stderr, "Deck Error\n");
         exit(6);
     }
-    // Loop through each line (deck) until there is no more
+}
+
+/*
+*   A reactor's event loop. Accepts clients on the reactor's own listening
+*   socket, reads their handshakes without blocking and forwards each
+*   player to the shard that owns their game.
+*/
+void* wait_for_players(void* arg) {
+    Reactor* reactor = (Reactor*)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    // The first reactor also listens for operator commands
+    if (reactor->id == 0) {
+        watch_fd(reactor, STDIN_FILENO, stdin);
+    }
+
     while (1) {
-        // Add enough memory for one whole deck + null terminator
-        char* deck = malloc(sizeof(char) * 105);
-        if (fgets(deck, 105, fp) == NULL) {
-            free(deck);
-            break;
-        }
-        // Check if there are 52 cards in the deck
-        if (strlen(deck) != 104) {
-            fprintf(stderr, "Deck Error\n");
-            exit(6);
-        }
-        if (!validate_deck(deck)) {
-            fprintf(stderr, "Deck Error\n");
-            exit(6);
+        /* Block until any activity happens on the file descriptors, unless
+         * messages are already waiting in the mailbox */
+        int timeout = queue_prepare_sleep(&reactor->mailbox) ? -1 : 0;
+        int ready = epoll_wait(reactor->epollFD, events, MAX_EVENTS, timeout);
+        queue_finish_sleep(&reactor->mailbox);
+        // If we get here something happened
+        for (int i = 0; i < ready; i++) {
+            void* source = events[i].data.ptr;
+            if (source == &reactor->listenFD) {
+                accept_players(reactor);
+            } else if (source == &reactor->localFD) {
+                accept_local_players(reactor);
+            } else if (source == &reactor->mailbox) {
+                queue_clear_doorbell(&reactor->mailbox);
+            } else if (source == &reactor->matcher) {
+                seat_quick_match_players(reactor);
+            } else if (source == &reactor->lobbies) {
+                expire_lobbies(reactor);
+            } else if (source == stdin) {
+                read_console_command(reactor);
+            } else if (*(WatchType*)source == WATCH_SPECTATOR) {
+                service_spectator(reactor, (Spectator*)source,
+                        events[i].events);
+            } else {
+                read_handshake(reactor, (Handshake*)source);
+            }
         }
+        read_shard_messages(reactor);
+    }
+    return NULL;
+}
 
-        decks = realloc(decks, sizeof(decks) + strlen(deck) + 1);
-        decks[deckCount] = malloc(strlen(deck) + 1);
-        memcpy(decks[deckCount++], deck, strlen(deck) + 1);
-        free(deck);
-        fgetc(fp);
+/*
+*   Reads and runs one operator command from stdin:
+*       metrics           print every metric
+*       trace table name  trace tables called name from now on
+*       trace dump file   write the spans traced so far to file as Chrome
+*                         trace JSON
+*/
+void read_console_command(Reactor* reactor) {
+    char command[128];
+    char argument[128];
+    ssize_t count = read(STDIN_FILENO, command, sizeof(command) - 1);
+    if (count <= 0) {
+        unwatch_fd(reactor, STDIN_FILENO);
+        return;
     }
-    server->decks = decks;
-    server->deckCount = deckCount;
+    command[count] = '\0';
+    if (!strncmp(command, "metrics", 7)) {
+        print_server_metrics(stdout);
+    } else if (sscanf(command, "trace table %127s", argument) == 1) {
+        trace_table(argument);
+    } else if (sscanf(command, "trace dump %127s", argument) == 1) {
+        int spans = trace_export(argument);
+        if (spans < 0) {
+            fprintf(stderr, "serv499: cannot write %s\n", argument);
+        } else {
+            printf("Wrote %d spans to %s\n", spans, argument);
+        }
+    }
+    fflush(stdout);
 }
 
 /*
-*   Wait for players (clients) to connect and forwards them through to games.
+*   Prints the server wide counters followed by each reactor's mailbox and
+*   worker pool.
 */
-void wait_for_players(int fdServer) {
-    int maxFD = fdServer;
-    int newFD;
+void print_server_metrics(FILE* out) {
+    char labels[32];
+    print_metrics(out);
+    sprintf(labels, "backend=\"%s\"", io_backend_name());
+    print_metric(out, "io_syscalls_total", labels, METRIC_GET(ioSyscalls));
+    print_metric(out, "journal_depth", NULL, journal_depth());
+    for (int i = 0; i < server->reactorCount; i++) {
+        Reactor* reactor = &server->reactors[i];
+        sprintf(labels, "reactor=\"%d\"", i);
+        print_metric(out, "mailbox_depth", labels,
+                queue_depth(&reactor->mailbox));
+        print_metric(out, "mailbox_peak_depth", labels,
+                __atomic_load_n(&reactor->mailbox.peakDepth,
+                __ATOMIC_RELAXED));
+        print_metric(out, "workers", labels,
+                __atomic_load_n(&reactor->workerCount, __ATOMIC_RELAXED));
+        print_metric(out, "idle_workers", labels,
+                __atomic_load_n(&reactor->idleCount, __ATOMIC_RELAXED));
+        print_metric(out, "quickmatch_waiting", labels,
+                __atomic_load_n(&reactor->matcher.waiting, __ATOMIC_RELAXED));
+        print_metric(out, "spectators", labels,
+                __atomic_load_n(&reactor->spectatorCount, __ATOMIC_RELAXED));
+    }
+}
 
-    fd_set baseSet, readSet;
+/*
+*   Accepts every pending connection on the reactor's listening socket and
+*   waits for their handshakes.
+*/
+void accept_players(Reactor* reactor) {
     struct sockaddr_in fromAddr;
     socklen_t fromAddrSize;
-    char hostname[124];
 
-    FD_ZERO(&baseSet);
-    FD_SET(fdServer, &baseSet);
-    FD_SET(STDIN_FILENO, &baseSet);
+    while (1) {
+        // New connect request
+        fromAddrSize = sizeof(struct sockaddr_in);
+        int newFD = reactor->io->ops->accept(reactor->io, reactor->listenFD,
+                &fromAddr, &fromAddrSize);
+        if (newFD == -1) {
+            return;
+        } else if (newFD < 0) {
+            exit(5);
+        }
+        // Refuse connections over the limits before anything is allocated
+        // for them
+        if (admit_connection(ntohl(fromAddr.sin_addr.s_addr)) != ADMIT_OK) {
+            close(newFD);
+            continue;
+        }
+        start_handshake(reactor, newFD, &fromAddr);
+    }
+}
 
+/*
+*   Accepts every pending connection on the Unix socket. These are few, so
+*   they are accepted directly rather than through the reactor's backend.
+*/
+void accept_local_players(Reactor* reactor) {
     while (1) {
-        readSet = baseSet;
-        /* Block until any activity happens on the file descriptors */
-        if (select(maxFD + 1, &readSet, NULL, NULL, NULL) < 0) {
-            //exit(5);
+        int newFD = accept4(reactor->localFD, NULL, NULL, SOCK_NONBLOCK);
+        METRIC_ADD(ioSyscalls, 1);
+        if (newFD < 0 && (errno == EAGAIN || errno == EINTR ||
+                errno == ECONNABORTED)) {
+            return;
+        } else if (newFD < 0) {
+            exit(5);
         }
-        // If we get here something happened
-        for (int fd = maxFD; fd >= 0; fd--) {
-            if (FD_ISSET(fd, &readSet)) {
-                if (fd == fdServer) {
-                    // New connect request
-                    fromAddrSize = sizeof(struct sockaddr_in);
-                    newFD = accept(fdServer, (struct sockaddr*)&fromAddr,
-                            &fromAddrSize);
-                    if (newFD < 0) {
-                        exit(5);
-                    }
-                    // Add new file descriptor to our master set
-                    FD_SET(newFD, &baseSet);
-                    // Update max if necessary
-                    if (newFD > maxFD) {
-                        maxFD = newFD;
-                    }
-                    int error = getnameinfo((struct sockaddr*)&fromAddr,
-                            fromAddrSize, hostname, 124, NULL, 0, 0);
-                    if (error) {
-                        exit(5);
-                    } else {
-                        create_player(newFD);
-                    }
-                }
-            }
+        // Local clients have no address to be limited by, only the
+        // number of connections
+        if (admit_connection(0) != ADMIT_OK) {
+            close(newFD);
+            continue;
         }
+        METRIC_ADD(localConnections, 1);
+        start_handshake(reactor, newFD, NULL);
     }
 }
 
 /*
-*   Creates a new player to add to a game.
+*   Waits for the handshake of a connection just admitted. A connection
+*   with no address came through the Unix socket.
 */
-void create_player(int newFD) {
+void start_handshake(Reactor* reactor, int newFD, struct sockaddr_in* from) {
+    Handshake* handshake = calloc(1, sizeof(Handshake));
+    handshake->fd = newFD;
+    handshake->local = from == NULL;
+    handshake->id = __atomic_fetch_add(&nextConnectionId, 1,
+            __ATOMIC_RELAXED);
+    PROBE_CONNECTION_ACCEPT(handshake->id, newFD);
+    if (from != NULL && resolver_enabled()) {
+        resolver_lookup(handshake->id, from);
+    }
+    watch_fd(reactor, newFD, handshake);
+}
+
+/*
+*   Reads the player name and game name sent by a newly connected client.
+*   Only the handshake lines are consumed so that nothing the client sends
+*   after them is lost once the connection is handed to the game.
+*/
+void read_handshake(Reactor* reactor, Handshake* handshake) {
+    char peek[MAX_HANDSHAKE];
+    int space = MAX_HANDSHAKE - handshake->length;
+    ssize_t count = recv(handshake->fd, peek, space, MSG_PEEK);
+    if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    } else if (count <= 0) {
+        drop_handshake(reactor, handshake);
+        return;
+    } else if (handshake->local && handshake->length == 0 &&
+            handshake->shm == NULL && peek[0] == '\0') {
+        attach_rings(reactor, handshake);
+        return;
+    }
+
+    int take = count;
+    for (int i = 0; i < count; i++) {
+        if (peek[i] == '\n' && ++handshake->lines == 2) {
+            take = i + 1;
+            break;
+        }
+    }
+    recv(handshake->fd, handshake->buffer + handshake->length, take, 0);
+    handshake->length += take;
+    if (handshake->lines < 2) {
+        if (handshake->length == MAX_HANDSHAKE) {
+            drop_handshake(reactor, handshake);
+        }
+        return;
+    }
+
+    // Both lines have arrived
+    METRIC_ADD(handshakesOpen, -1);
+    int fd = handshake->fd;
+    unwatch_fd(reactor, fd);
+    char* newline = memchr(handshake->buffer, '\n', handshake->length);
+    char* name = strndup(handshake->buffer, newline - handshake->buffer);
+    char* gameName = strndup(newline + 1,
+            handshake->length - (newline - handshake->buffer) - 2);
+    uint32_t id = handshake->id;
+    ShmChannel* shm = handshake->shm;
+    free(handshake);
+    capture_line(id, name, strlen(name));
+    capture_line(id, gameName, strlen(gameName));
+    int options = split_game_options(gameName);
+    PROBE_HANDSHAKE_COMPLETE(id, name, gameName);
+    if (!strcmp(name, SPECTATOR_NAME) && shm != NULL) {
+        // Spectators are only ever sent to over their socket
+        shm_channel_close(shm);
+        close(fd);
+        free(name);
+        free(gameName);
+        METRIC_ADD(connectionsOpen, -1);
+        return;
+    } else if (!strcmp(name, SPECTATOR_NAME)) {
+        free(name);
+        watch_table(reactor, fd, gameName);
+        return;
+    }
+
+    // Players stay non-blocking so that one who stops reading cannot hold
+    // up the rest of their table
+    Player* player = create_player(fd, id, shm, name);
+    free(name);
+    join_game(reactor, player, gameName, options);
+}
+
+/*
+*   Takes the shared-memory rings a local client has passed ahead of its
+*   handshake, over which its game is carried from then on. A client whose
+*   rings cannot be used is dropped, as it will not be reading its socket.
+*/
+void attach_rings(Reactor* reactor, Handshake* handshake) {
+    if (io_backend_carries_rings()) {
+        handshake->shm = shm_channel_attach(handshake->fd);
+    }
+    if (handshake->shm == NULL) {
+        drop_handshake(reactor, handshake);
+        return;
+    }
+    METRIC_ADD(ringConnections, 1);
+}
+
+/*
+*   Closes a connection that disconnected or misbehaved during its
+*   handshake.
+*/
+void drop_handshake(Reactor* reactor, Handshake* handshake) {
+    unwatch_fd(reactor, handshake->fd);
+    if (handshake->shm != NULL) {
+        shm_channel_close(handshake->shm);
+    }
+    close(handshake->fd);
+    free(handshake);
+    METRIC_ADD(handshakesOpen, -1);
+    METRIC_ADD(connectionsOpen, -1);
+}
+
+/*
+*   Creates a new player to add to a game, carried over shm if they passed
+*   rings.
+*/
+Player* create_player(int newFD, uint32_t id, ShmChannel* shm, char* name) {
     Player* player = malloc(sizeof(Player));
-    player->writeFD = fdopen(newFD, "w");
-    player->readFD = fdopen(newFD, "r");
-    player->name = read_socket_message(player->readFD);
-    char* gameName = read_socket_message(player->readFD);
-    send_welcome_message(player->writeFD);
-    add_player_to_game(player, gameName);
+    player->conn = connection_create(newFD);
+    player->conn->id = id;
+    player->conn->shm = shm;
+    player->name = intern_name(name);
+    send_welcome_message(player->conn);
+    return player;
+}
+
+/*
+*   Adds a player to their game if this reactor owns it, otherwise passes
+*   them to the reactor that does.
+*/
+void join_game(Reactor* reactor, Player* player, char* gameName,
+        int options) {
+    Reactor* owner = shard_for_game(server->reactors, server->reactorCount,
+            gameName);
+    if (owner == reactor) {
+        add_player_to_game(reactor, player, gameName, options);
+        return;
+    }
+    ShardMessage* message = malloc(sizeof(ShardMessage));
+    message->type = SHARD_JOIN;
+    message->player = player;
+    message->gameName = gameName;
+    message->options = options;
+    post_to_shard(owner, message);
+}
+
+/*
+*   Starts a spectator watching a table if this reactor owns the table's
+*   name, otherwise passes them to the reactor that does. Spectators keep
+*   their non-blocking connection, which only the owning reactor writes to.
+*/
+void watch_table(Reactor* reactor, int fd, char* gameName) {
+    Reactor* owner = shard_for_game(server->reactors, server->reactorCount,
+            gameName);
+    if (owner == reactor) {
+        add_spectator(reactor, fd, gameName);
+        return;
+    }
+    ShardMessage* message = malloc(sizeof(ShardMessage));
+    message->type = SHARD_SPECTATE;
+    message->fd = fd;
+    message->gameName = gameName;
+    post_to_shard(owner, message);
+}
+
+/*
+*   Handles every message other threads have posted to this reactor,
+*   taking them from the mailbox in batches. Spectators are written to
+*   after each batch.
+*/
+void read_shard_messages(Reactor* reactor) {
+    ShardMessage* messages[MAX_BATCH];
+    int count;
+    while ((count = queue_pop_batch(&reactor->mailbox, (void**)messages,
+            MAX_BATCH)) > 0) {
+        for (int i = 0; i < count; i++) {
+            switch (messages[i]->type) {
+                case SHARD_JOIN:
+                    add_player_to_game(reactor, messages[i]->player,
+                            messages[i]->gameName, messages[i]->options);
+                    free(messages[i]);
+                    break;
+                case SHARD_WORKER_IDLE:
+                    return_worker(reactor, messages[i]->worker);
+                    break;
+                case SHARD_SPECTATE:
+                    add_spectator(reactor, messages[i]->fd,
+                            messages[i]->gameName);
+                    free(messages[i]);
+                    break;
+                case SHARD_TABLE_START:
+                    add_broadcast(reactor, messages[i]->broadcast);
+                    break;
+                case SHARD_FRAME:
+                    deliver_frame(reactor, messages[i]->frame);
+                    break;
+                case SHARD_TABLE_OVER:
+                    remove_broadcast(reactor, messages[i]->broadcast);
+                    break;
+            }
+        }
+        flush_broadcasts(reactor);
+    }
 }
 
 /*
 *   Adds a connected player (client) to a game if it exists, otherwise
-*   creates a new game.
+*   creates a new game with the player's table options.
 */
-void add_player_to_game(Player* player, char* gameName) {
+void add_player_to_game(Reactor* reactor, Player* player, char* gameName,
+        int options) {
     PendingGame* pg;
-    if ((pg = search_game_in_list(gameName, pendingGameList)) != NULL) {
+    if (!strcmp(gameName, QUICK_MATCH_NAME)) {
+        // The player will be seated with whoever else is waiting when the
+        // matcher's window closes
+        PROBE_LOBBY_JOIN(player->conn->id, -1, gameName);
+        free(gameName);
+        if (matcher_add(&reactor->matcher, player, server->matchWindow)) {
+            watch_fd(reactor, reactor->matcher.timerFD, &reactor->matcher);
+        }
+        return;
+    }
+    if ((pg = lobby_index_find(&reactor->pendingGames, gameName)) != NULL) {
         // The game exists so append player to game
         pg->game->playerCount++;
         player->id = pg->game->playerCount;
         pg->game->players[(pg->game->playerCount) - 1] = *player;
+        METRIC_ADD(lobbyBytes, LOBBY_PLAYER_BYTES);
     } else {
+        // Refuse the player before anything is allocated for a new lobby
+        // if too many are already open
+        long open = METRIC_ADD(lobbiesOpen, 1);
+        if (server->lobbyLimit && open >= server->lobbyLimit) {
+            METRIC_ADD(lobbiesOpen, -1);
+            METRIC_ADD(lobbiesRejected, 1);
+            turn_away(player->conn, "Too many games are waiting to start");
+            release_name(player->name);
+            free(gameName);
+            free(player);
+            return;
+        }
         // The game does not exist, so create it and add to list
-        Game* game = malloc(sizeof(Game));
-        game->players = malloc(sizeof(Player) * 4);
-        game->name = gameName;
+        Game* game = table_create();
+        game->name = intern_name(gameName);
+        game->options = options;
         game->playerCount = 1;
-        game->players[0] = *player;
         player->id = 1;
-        if (NULL == pendingGameList) {
-            // If this is the first game created, make it the head of the
-            // linked list
-            pendingGameList = add_to_list(game, NULL);
-        } else {
-            // Otherwise we don't care so add it on the end
-            add_to_list(game, pendingGameList);
+        game->players[0] = *player;
+        pg = lobby_index_add(&reactor->pendingGames, game);
+        if (server->lobbyTTL) {
+            lobby_wheel_add(&reactor->lobbies, pg, server->lobbyTTL);
         }
+        METRIC_ADD(lobbyBytes, LOBBY_BYTES + LOBBY_PLAYER_BYTES);
     }
-    check_for_full_games();
+    METRIC_ADD(lobbyPlayers, 1);
+    PROBE_LOBBY_JOIN(player->conn->id, player->id, gameName);
+    free(gameName);
+    free(player);
+    start_if_full(reactor, pg);
 }
 
 /*
-*   Iterates through the pending games and checks if any of them have
-*   the full 4 players needed to start the game.
+*   Starts the game in a lobby once it has the full 4 players. Only the
+*   lobby a player has just joined can have filled.
 */
-void check_for_full_games(void) {
-    pthread_t threadId;
-    PendingGame* pg;
-    // Gets a completed game. Because this is called after every player
-    // addition, there can only be one game to possible fill at a time.
-    if ((pg = check_if_complete(pendingGameList)) != NULL) {
+void start_if_full(Reactor* reactor, PendingGame* pg) {
+    if (pg->game->playerCount == 4) {
         Game* game = pg->game;
-        pendingGameList = delete_game_from_list(game->name, pendingGameList);
-        pthread_create(&threadId, NULL, start_game, (void*)(Game*)game);
-        pthread_detach(threadId);
+        lobby_wheel_remove(&reactor->lobbies, pg);
+        lobby_index_remove(pg);
+        METRIC_ADD(lobbiesOpen, -1);
+        METRIC_ADD(lobbyPlayers, -4);
+        METRIC_ADD(lobbyBytes, -(long)(LOBBY_BYTES + 4 * LOBBY_PLAYER_BYTES));
+        start_full_game(reactor, game);
     }
 }
 
 /*
-*   The main game thread.
+*   Closes the lobbies on the reactor's wheel that have waited too long to
+*   fill, telling the players in them why.
+*/
+void expire_lobbies(Reactor* reactor) {
+    PendingGame* lobby = lobby_wheel_expired(&reactor->lobbies);
+    while (lobby != NULL) {
+        PendingGame* next = lobby->wheelNext;
+        Game* game = lobby->game;
+        for (int i = 0; i < game->playerCount; i++) {
+            turn_away(game->players[i].conn,
+                    "Not enough players joined in time");
+        }
+        METRIC_ADD(lobbiesOpen, -1);
+        METRIC_ADD(lobbiesExpired, 1);
+        METRIC_ADD(lobbyPlayers, -game->playerCount);
+        METRIC_ADD(lobbyBytes, -(long)(LOBBY_BYTES +
+                game->playerCount * LOBBY_PLAYER_BYTES));
+        lobby_index_remove(lobby);
+        table_release(game);
+        lobby = next;
+    }
+}
+
+/*
+*   Tells a player who is waiting for a game why they will not get one, as
+*   far as their socket will take it without waiting, and closes their
+*   connection.
+*/
+void turn_away(Connection* conn, const char* reason) {
+    char message[128];
+    snprintf(message, sizeof(message), "M%s\nO", reason);
+    connection_send_now(conn, message);
+    connection_close(conn);
+    METRIC_ADD(connectionsOpen, -1);
+}
+
+/*
+*   Seats the quick-match players gathered during the last batching window
+*   at as many full tables as possible.
+*/
+void seat_quick_match_players(Reactor* reactor) {
+    Game* game;
+    if (!matcher_window_closed(&reactor->matcher, server->matchWindow)) {
+        return;
+    }
+    while ((game = matcher_next_table(&reactor->matcher)) != NULL) {
+        start_full_game(reactor, game);
+    }
+}
+
+/*
+*   Hands a table with four players to an idle worker. Workers only take a
+*   new game once they are idle, so there is always room in the inbox.
+*/
+void start_full_game(Reactor* reactor, Game* game) {
+    Worker* worker = take_worker(reactor, run_games);
+    queue_push_wait(&worker->inbox, game);
+}
+
+/*
+*   A game worker's loop. Runs each game it is handed on the worker's own
+*   I/O backend and then tells its reactor it is free for another. A wake
+*   with nothing popped must not release the worker, or it would go back
+*   on the idle list twice.
+*/
+void* run_games(void* arg) {
+    Worker* worker = (Worker*)arg;
+    void* game;
+    while (1) {
+        int played = 0;
+        queue_wait(&worker->inbox);
+        while (queue_pop_batch(&worker->inbox, &game, 1)) {
+            played++;
+            for (int i = 0; i < 4; i++) {
+                connection_attach(((Game*)game)->players[i].conn,
+                        worker->io);
+            }
+            start_game(game);
+        }
+        if (played) {
+            release_worker(worker);
+        }
+    }
+    return NULL;
+}
+
+/*
+*   Plays a full game on the calling worker thread.
 */
 void* start_game(void* arg) {
     Game* game = (Game*)arg;
     int currentPlayer;
     // Initialise some stuff
     game->currentDeck = 0;
-    game->team1Points = 0;
-    game->team2Points = 0;
+    game->id = __atomic_fetch_add(&nextTableId, 1, __ATOMIC_RELAXED);
+    game->hand = 0;
+    game->traced = trace_choose(game);
     // Print the informational team message
     reorder_players(game);
+    game->broadcast = broadcast_open(game, shard_for_game(server->reactors,
+            server->reactorCount, game->name));
     print_teams(game);
+    record_event(game, JOURNAL_TABLE_START, 0, server->deckCount, 0, 0, 0);
+    PROBE_TABLE_START(game->id, game->name, game->options);
+    record_players(game);
 
     // Main Game Loop
     while (!check_points(game)) {
-        game->team1Wins = 0;
-        game->team2Wins = 0;
+        TABLE(game, tricks)[0] = 0;
+        TABLE(game, tricks)[1] = 0;
         // Deal cards
+        uint64_t start = TRACE_START(game);
         deal_cards(game);
+        TRACE_END(game, TRACE_DEAL, start, -1);
         // Initiate bidding
         initiate_bidding(game);
         // Select the player who won bidding to start first
@@ -264,74 +911,140 @@ void* start_game(void* arg) {
             if (check_for_empty_hand(game)) {
                 break;
             }
+            start = TRACE_START(game);
             int winner = play_trick(game, currentPlayer);
+            TRACE_END(game, TRACE_TRICK, start, currentPlayer);
             currentPlayer = winner;
         }
+        start = TRACE_START(game);
         set_points(game);
+        TRACE_END(game, TRACE_SCORE, start, -1);
         char pointsMsg[1028];
-        sprintf(pointsMsg, "Team 1=%d, Team 2=%d", game->team1Points,
-                game->team2Points);
+        sprintf(pointsMsg, "Team 1=%d, Team 2=%d", TABLE(game, points)[0],
+                TABLE(game, points)[1]);
         send_to_players(game, 'M', pointsMsg, -1);
     }
     send_to_players(game, 'O', "", -1);
+    broadcast_close(game);
+    for (int i = 0; i < 4; i++) {
+        connection_close(game->players[i].conn);
+    }
+    METRIC_ADD(connectionsOpen, -4);
+    METRIC_ADD(tablesFinished, 1);
+    capture_flush();
+    table_release(game);
+    return NULL;
+}
+
+/*
+*   Records a hand history event for the game, if the journal is enabled.
+*/
+void record_event(Game* game, int type, int seat, int a, int b, int c,
+        int d) {
+    JournalRecord record;
+    if (!journal_enabled()) {
+        return;
+    }
+    record.timestamp = realtime_ns();
+    record.table = game->id;
+    record.hand = game->hand;
+    record.type = type;
+    record.seat = seat;
+    record.data.values.a = a;
+    record.data.values.b = b;
+    record.data.values.c = c;
+    record.data.values.d = d;
+    journal_append(&record);
+}
+
+/*
+*   Records who is sitting in each seat of the game. Each name is split
+*   over as many records as it takes, the last of which is not full.
+*/
+void record_players(Game* game) {
+    JournalRecord record;
+    if (!journal_enabled()) {
+        return;
+    }
     for (int i = 0; i < 4; i++) {
-        fclose(game->players[i].readFD);
-        fclose(game->players[i].writeFD);
+        const char* name = game->players[i].name;
+        int length = strlen(name);
+        for (int part = 0; part <= length / JOURNAL_NAME_LENGTH; part++) {
+            memset(&record, 0, sizeof(record));
+            record.timestamp = realtime_ns();
+            record.table = game->id;
+            record.hand = part;
+            record.type = JOURNAL_PLAYER;
+            record.seat = i;
+            int left = length - part * JOURNAL_NAME_LENGTH;
+            memcpy(record.data.name, name + part * JOURNAL_NAME_LENGTH,
+                    left < JOURNAL_NAME_LENGTH ? left : JOURNAL_NAME_LENGTH);
+            journal_append(&record);
+        }
     }
-    pthread_exit(NULL);
 }
 
 /*
 *   Check if any team has surpassed 499.
 */
 int check_points(Game* game) {
-    if (game->contractTeam == 1) {
-        if (game->team1Points > 499) {
-            send_to_players(game, 'M', "Winner is Team 1", -1);
-            return 1;
-        } else if (game->team1Points < -499) {
-            send_to_players(game, 'M', "Winner is Team 2", -1);
-            return 1;
+    int16_t* points = TABLE(game, points);
+    int winner = 0;
+    if (TABLE(game, contractTeam) == 1) {
+        if (points[0] > 499) {
+            winner = 1;
+        } else if (points[0] < -499) {
+            winner = 2;
         }
     } else {
-        if (game->team2Points > 499) {
-            send_to_players(game, 'M', "Winner is Team 2", -1);
-            return 1;
-        } else if (game->team2Points < -499) {
-            send_to_players(game, 'M', "Winner is Team 1", -1);
-            return 1;
+        if (points[1] > 499) {
+            winner = 2;
+        } else if (points[1] < -499) {
+            winner = 1;
         }
     }
-    return 0;
+    if (winner == 0) {
+        return 0;
+    }
+    send_to_players(game, 'M', winner == 1 ? "Winner is Team 1" :
+            "Winner is Team 2", -1);
+    record_event(game, JOURNAL_GAME_OVER, 0, winner, 0, points[0],
+            points[1]);
+    PROBE_GAME_OVER(game->id, winner, points[0], points[1]);
+    return 1;
 }
 
 /*
 *   Alters the appropriate team's points depending on the game result.
 */
 void set_points(Game* game) {
-    if (game->contractTeam == 1) {
-        if (game->contractGoal > game->team1Wins) {
-            game->team1Points -= game->contractPoints;
+    int16_t* points = TABLE(game, points);
+    int team = TABLE(game, contractTeam);
+    int goal = TABLE(game, contractGoal);
+    if (team == 1 || team == 2) {
+        if (goal > TABLE(game, tricks)[team - 1]) {
+            points[team - 1] -= TABLE(game, contractPoints);
         } else {
-            game->team1Points += game->contractPoints;
-        }
-    } else if (game->contractTeam == 2) {
-        if (game->contractGoal > game->team2Wins) {
-            game->team2Points -= game->contractPoints;
-        } else {
-            game->team2Points += game->contractPoints;
+            points[team - 1] += TABLE(game, contractPoints);
         }
     }
+    int tricks = TABLE(game, tricks)[team == 1 ? 0 : 1];
+    record_event(game, JOURNAL_SCORE, 0,
+            bid_value('0' + goal, TABLE(game, trumps)),
+            SCORE_PACK(team, tricks, tricks >= goal), points[0], points[1]);
+    PROBE_HAND_SCORED(game->id, game->hand, points[0], points[1]);
 }
 
 /*
-* Plays a trick, being one card from each player.
+* Plays a trick, being one card from each player. Every card is checked
+* against the player's hand. A player with only one legal card has it
+* played for them without a round trip, unless the table opted out.
 */
 int play_trick(Game* game, int startingPlayer) {
     // Because starting player is an index we want to add 1
     int p = startingPlayer + 1;
     Card** cards = malloc(sizeof(Card*) * 4);
-    char leadSuit;
+    char leadSuit = 0;
     for (int i = 0; i < 4; i++) {
         if (startingPlayer > 3) {
             p = ((startingPlayer++) % 4);
@@ -339,30 +1052,30 @@ int play_trick(Game* game, int startingPlayer) {
             p = startingPlayer++;
         }
         cards[p] = malloc(sizeof(Card));
-        if (i == 0) {
-            send_socket_message(game->players[p].writeFD, "L");
-            char* response = read_socket_message(game->players[p].readFD);
-            check_for_eof(game, response, p);
-            read_card_input_from_string(cards[p], response);
-            if (!is_valid_card(cards[p])) {
-                fprintf(stderr, "server: bad card from client\n");
-            } else {
-                leadSuit = cards[p]->suit;
-            }
+        uint64_t legal = legal_plays(TABLE(game, hands)[p], leadSuit);
+        int how = PLAY_CHOSEN;
+        if (hand_size(legal) == 1 && !(game->options & TABLE_MANUAL)) {
+            how = PLAY_FORCED;
+            *cards[p] = card_from_index(lowest_card(legal));
+            play_forced_card(game, p, cards[p]);
+        } else if (ask_for_card(game, p, leadSuit, cards[p])) {
+            connection_send(game->players[p].conn, "A");
         } else {
-            char c[2];
-            sprintf(c, "%c", leadSuit);
-            char* msg = create_message('P', c);
-            send_socket_message(game->players[p].writeFD, msg);
-            free(msg);
-            char* response = read_socket_message(game->players[p].readFD);
-            check_for_eof(game, response, p);
-            read_card_input_from_string(cards[p], response);
-            if (!is_valid_card(cards[p])) {
-                fprintf(stderr, "server: bad card from client\n");
-            }
+            // The player kept sending illegal cards, so their lowest legal
+            // card is played for them
+            how = PLAY_PENALTY;
+            METRIC_ADD(movePenalties, 1);
+            *cards[p] = card_from_index(lowest_card(legal));
+            play_forced_card(game, p, cards[p]);
+        }
+        if (i == 0) {
+            leadSuit = cards[p]->suit;
         }
-        send_socket_message(game->players[p].writeFD, "A");
+        // Every card played is now known to be legal and in the hand
+        int index = card_index(cards[p]->rank, cards[p]->suit);
+        TABLE(game, hands)[p] &= ~(1ULL << index);
+        record_event(game, JOURNAL_PLAY, p, index, how, 0, 0);
+        PROBE_CARD_PLAYED(game->id, p, game->hand, index, how);
         game->players[p].cardCount--;
         char play[1024];
         sprintf(play, "%s plays %s", game->players[p].name,
@@ -372,6 +1085,70 @@ int play_trick(Game* game, int startingPlayer) {
     return get_trick_winner(cards, game, leadSuit);
 }
 
+/*
+*   Asks a player for a card, leading if leadSuit is zero, and checks it
+*   against their hand. Illegal cards are asked for again up to
+*   MOVE_ATTEMPTS times. Returns 0 if no legal card was given.
+*/
+int ask_for_card(Game* game, int p, char leadSuit, Card* card) {
+    uint64_t legal = legal_plays(TABLE(game, hands)[p], leadSuit);
+    for (int attempt = 0; attempt < MOVE_ATTEMPTS; attempt++) {
+        if (leadSuit == 0) {
+            connection_send(game->players[p].conn, "L");
+        } else {
+            char c[2];
+            sprintf(c, "%c", leadSuit);
+            char* msg = create_message('P', c);
+            connection_send(game->players[p].conn, msg);
+            free(msg);
+        }
+        char* response = read_move(game, p);
+        if (!strcmp(response, "EOF")) {
+            return 0;
+        }
+        read_card_input_from_string(card, response);
+        int index = card_index(card->rank, card->suit);
+        if (index == NO_CARD) {
+            METRIC_ADD(badCards, 1);
+            fprintf(stderr, "server: bad card from client\n");
+        } else if (!(TABLE(game, hands)[p] & (1ULL << index))) {
+            METRIC_ADD(cardsNotHeld, 1);
+        } else if (!(legal & (1ULL << index))) {
+            METRIC_ADD(revokes, 1);
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+*   Plays a player's only legal card for them. The acknowledgement carries
+*   the card so that the client can take it out of its hand.
+*/
+void play_forced_card(Game* game, int p, Card* card) {
+    char* played = card_to_string(card);
+    char* msg = create_message('A', played);
+    connection_send(game->players[p].conn, msg);
+    free(msg);
+    free(played);
+}
+
+/*
+*   Reads a player's next line, capturing it if traffic is being captured,
+*   and tells the table if they have gone.
+*/
+char* read_move(Game* game, int p) {
+    char* response = connection_read_line(game->players[p].conn);
+    if (!strcmp(response, "EOF")) {
+        capture_close(TABLE(game, seats)[p]);
+    } else {
+        capture_line(TABLE(game, seats)[p], response, strlen(response));
+    }
+    check_for_eof(game, response, p);
+    return response;
+}
+
 /*
 *   Checks for eof given by a client.
 */
@@ -416,9 +1193,9 @@ int get_trick_winner(Card** cards, Game* game, char leadSuit) {
         }
     }
     for (int i = 0; i < 4; i++) {
-        if (cards[i]->suit == game->trumps) {
+        if (cards[i]->suit == TABLE(game, trumps)) {
             if ((currentCard->suit == leadSuit) &&
-                    (leadSuit != game->trumps)) {
+                    (leadSuit != TABLE(game, trumps))) {
                 currentCard = cards[i];
                 currentWinner = i;
             } else if (is_higher(currentCard, cards[i])) {
@@ -428,47 +1205,42 @@ int get_trick_winner(Card** cards, Game* game, char leadSuit) {
         }
     }
     free(currentCard);
-    char msg[1028];
-    sprintf(msg, "%s won", game->players[currentWinner].name);
-    send_to_players(game, 'M', msg, -1);
-
     if (currentWinner == 0 || currentWinner == 2) {
-        game->team1Wins++;
+        TABLE(game, tricks)[0]++;
     } else {
-        game->team2Wins++;
+        TABLE(game, tricks)[1]++;
     }
 
+    char msg[1028];
+    sprintf(msg, "%s won", game->players[currentWinner].name);
+    send_to_players(game, 'M', msg, -1);
+    record_event(game, JOURNAL_TRICK, currentWinner, 0, 0, 0, 0);
+    PROBE_TRICK_WON(game->id, currentWinner, game->hand);
+
     return currentWinner;
 }
 
 /*
-*   Reorders players in lexographical order.
+*   Reorders players in lexographical order and notes which connection
+*   sits in each seat.
 */
 void reorder_players(Game* game) {
-    char* players[4];
-    int playerOrders[4];
-    int k = 0;
-    players[0] = game->players[0].name;
-    players[1] = game->players[1].name;
-    players[2] = game->players[2].name;
-    players[3] = game->players[3].name;
-    qsort(players, 4, sizeof(players[0]), &compare_players);
+    // Names are interned, so players who share one keep the order they
+    // joined in
+    Player sorted[4];
     for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 4; j++) {
-            if (players[i] == game->players[j].name) {
-                playerOrders[k++] = j;
-            }
+        int j = i;
+        while (j > 0 && strcmp(sorted[j - 1].name,
+                game->players[i].name) > 0) {
+            sorted[j] = sorted[j - 1];
+            j--;
         }
+        sorted[j] = game->players[i];
+    }
+    memcpy(game->players, sorted, sizeof(sorted));
+    for (int i = 0; i < 4; i++) {
+        TABLE(game, seats)[i] = game->players[i].conn->id;
     }
-    Player* tempPlayers = malloc(sizeof(Player) * 4);
-    tempPlayers[0] = game->players[playerOrders[0]];
-    tempPlayers[1] = game->players[playerOrders[1]];
-    tempPlayers[2] = game->players[playerOrders[2]];
-    tempPlayers[3] = game->players[playerOrders[3]];
-    game->players[0] = tempPlayers[0];
-    game->players[1] = tempPlayers[1];
-    game->players[2] = tempPlayers[2];
-    game->players[3] = tempPlayers[3];
 }
 
 /*
@@ -481,67 +1253,49 @@ void print_teams(Game* game) {
             game->players[2].name);
     sprintf(team2, "Team2: %s, %s", game->players[1].name,
             game->players[3].name);
-    char* msg1 = create_message('M', team1);
-    char* msg2 = create_message('M', team2);
-
-    for (int i = 0; i < 4; i++) {
-        send_socket_message(game->players[i].writeFD, msg1);
-        send_socket_message(game->players[i].writeFD, msg2);
-    }
+    send_to_players(game, 'M', team1, -1);
+    send_to_players(game, 'M', team2, -1);
 }
 
 /*
-*   Sends a welcome message to all players.
+*   Sends a welcome message to a new player. It is written straight away,
+*   before the player has a table and a thread to send for them.
 */
-void send_welcome_message(FILE* fd) {
+void send_welcome_message(Connection* conn) {
     char* welcome = create_message('M', server->greeting);
-    send_socket_message(fd, welcome);
+    connection_send_now(conn, welcome);
     free(welcome);
 }
 
 /*
-*   Deals out a single hand to each player in the game.
+*   Deals out a single hand to each player in the game. Decks from the
+*   deck file were prepared when they were loaded, so only generated
+*   decks need splitting into hands here.
 */
 void deal_cards(Game* game) {
-    char* deck = server->decks[game->currentDeck];
-    char* p1 = malloc(sizeof(char) * 28);
-    char* p2 = malloc(sizeof(char) * 28);
-    char* p3 = malloc(sizeof(char) * 28);
-    char* p4 = malloc(sizeof(char) * 28);
-    int a = 0;
-    int b = 0;
-    int c = 0;
-    int d = 0;
-
-    for(int i = 0; i < 104; i++) {
-        p1[a++] = deck[i++];
-        p1[a++] = deck[i++];
-        p2[b++] = deck[i++];
-        p2[b++] = deck[i++];
-        p3[c++] = deck[i++];
-        p3[c++] = deck[i++];
-        p4[d++] = deck[i++];
-        p4[d++] = deck[i];
-    }
-
-    send_socket_message(game->players[0].writeFD,
-            create_message('H', p1));
-    send_socket_message(game->players[1].writeFD,
-            create_message('H', p2));
-    send_socket_message(game->players[2].writeFD,
-            create_message('H', p3));
-    send_socket_message(game->players[3].writeFD,
-            create_message('H', p4));
-
-    store_hand(p1, &game->players[0]);
-    store_hand(p2, &game->players[1]);
-    store_hand(p3, &game->players[2]);
-    store_hand(p4, &game->players[3]);
-
-    free(p1);
-    free(p2);
-    free(p3);
-    free(p4);
+    Deal generated;
+    Deal* deal = &generated;
+    game->hand++;
+    if (server->seeded) {
+        char deck[DECK_LENGTH + 1];
+        generate_deck(deal_seed(server->seed, game->id, game->hand), deck);
+        prepare_deal(deck, &generated);
+        record_event(game, JOURNAL_DEAL, 0, -1, -1, 0, 0);
+    } else {
+        deal = &server->deals[game->currentDeck];
+        const DealAnalysis* analysis = deck_analysis(game->currentDeck);
+        record_event(game, JOURNAL_DEAL, 0, game->currentDeck,
+                analysis ? analysis->par : -1,
+                analysis ? analysis->parScore : 0, 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        connection_send(game->players[i].conn, deal->messages[i]);
+        game->players[i].cardCount = CARD_COUNT / 4;
+    }
+    memcpy(TABLE(game, hands), deal->hands, sizeof(TABLE(game, hands)));
+    if (game->options & TABLE_OPEN_HANDS) {
+        broadcast_hands(game);
+    }
 
     increment_game_deck(game);
 }
@@ -551,6 +1305,9 @@ void deal_cards(Game* game) {
 *   used.
 */
 void increment_game_deck(Game* game) {
+    if (server->seeded) {
+        return;
+    }
     game->currentDeck = (game->currentDeck + 1) % server->deckCount;
 }
 
@@ -571,7 +1328,9 @@ void initiate_bidding(Game* game) {
             go = check_for_eligibility(game);
 
             if (game->players[i].eligible && go) {
+                uint64_t start = TRACE_START(game);
                 get_players_bid(game, currentBid, sentBid, i, first);
+                TRACE_END(game, TRACE_BID, start, i);
                 first = 0;
             }
 
@@ -588,17 +1347,17 @@ void initiate_bidding(Game* game) {
             }
         }
     }
-    game->trumps = currentBid->suit;
+    TABLE(game, trumps) = currentBid->suit;
     char goal[2];
     goal[0] = currentBid->rank;
     goal[1] = '\0';
-    game->contractGoal = atoi(goal);
-    game->contractPoints = calculate_contract_points(currentBid);
+    TABLE(game, contractGoal) = atoi(goal);
+    TABLE(game, contractPoints) = calculate_contract_points(currentBid);
     int team = get_winning_bidder_index(game);
     if (team == 0 || team == 2) {
-        game->contractTeam = 1;
+        TABLE(game, contractTeam) = 1;
     } else {
-        game->contractTeam = 2;
+        TABLE(game, contractTeam) = 2;
     }
     char* msg = card_to_string(currentBid);
     send_to_players(game, 'T', msg, -1);
@@ -608,58 +1367,59 @@ void initiate_bidding(Game* game) {
 }
 
 /*
-*   Gets an individual player's bid and parses it.
+*   Gets an individual player's bid and parses it. A bid must be a valid
+*   bid higher than the current one, or a pass. Illegal bids are asked for
+*   again up to MOVE_ATTEMPTS times, after which the player passes.
 */
 void get_players_bid(Game* game, Card* currentBid, Card* sentBid, int i,
         int first) {
     char buff[1028];
-    if (first) {
-        first = 0;
-        // First bid
-        send_socket_message(game->players[i].writeFD, "B");
-        char* response = read_socket_message(
-                game->players[i].readFD);
-        check_for_eof(game, response, i);
-        read_card_input_from_string(sentBid, response);
-        if (!is_valid_bid(sentBid)) {
-            if (sentBid->rank == 'P' && sentBid->suit == 'P') {
-                game->players[i].eligible = 0;
-                sprintf(buff, "%s passes",
-                        game->players[i].name);
-                send_to_players(game, 'M', buff, i);
-            } else {
-                fprintf(stderr, "server: bad bid\n");
-            }
+    int current = first ? -1 : bid_value(currentBid->rank, currentBid->suit);
+    for (int attempt = 0; attempt < MOVE_ATTEMPTS; attempt++) {
+        if (first) {
+            // First bid
+            connection_send(game->players[i].conn, "B");
         } else {
-            memcpy(currentBid, sentBid, sizeof(Card));
-            sprintf(buff, "%s bids %s", game->players[i].name,
-                    card_to_string(currentBid));
-            send_to_players(game, 'M', buff, i);
+            char* bid = card_to_string(currentBid);
+            char* msg = create_message('B', bid);
+            connection_send(game->players[i].conn, msg);
+            free(msg);
+            free(bid);
+        }
+        char* response = read_move(game, i);
+        if (!strcmp(response, "EOF")) {
+            break;
         }
-    } else {
-        send_socket_message(game->players[i].writeFD,
-                create_message('B', card_to_string(currentBid)));
-        char* response = read_socket_message(
-                game->players[i].readFD);
-        check_for_eof(game, response, i);
         read_card_input_from_string(sentBid, response);
-        if (!is_valid_bid(sentBid) ||
-                !is_higher_bid(currentBid, sentBid)) {
-            if (sentBid->rank == 'P' && sentBid->suit == 'P') {
-                game->players[i].eligible = 0;
-                sprintf(buff, "%s passes",
-                        game->players[i].name);
-                send_to_players(game, 'M', buff, i);
-            } else {
-                fprintf(stderr, "server: bad bid\n");
-            }
-        } else {
+        if (sentBid->rank == 'P' && sentBid->suit == 'P') {
+            game->players[i].eligible = 0;
+            sprintf(buff, "%s passes",
+                    game->players[i].name);
+            send_to_players(game, 'M', buff, i);
+            record_event(game, JOURNAL_BID, i, -1, PLAY_CHOSEN, 0, 0);
+            PROBE_BID_RECEIVED(game->id, i, game->hand, -1);
+            return;
+        }
+        int value = bid_value(sentBid->rank, sentBid->suit);
+        if (value > current) {
+            record_event(game, JOURNAL_BID, i, value, PLAY_CHOSEN, 0, 0);
+            PROBE_BID_RECEIVED(game->id, i, game->hand, value);
             memcpy(currentBid, sentBid, sizeof(Card));
             sprintf(buff, "%s bids %s", game->players[i].name,
                     card_to_string(currentBid));
             send_to_players(game, 'M', buff, i);
+            return;
         }
+        METRIC_ADD(badBids, 1);
+        fprintf(stderr, "server: bad bid\n");
     }
+    // Out of attempts, so the player is treated as having passed
+    METRIC_ADD(movePenalties, 1);
+    game->players[i].eligible = 0;
+    sprintf(buff, "%s passes", game->players[i].name);
+    send_to_players(game, 'M', buff, i);
+    record_event(game, JOURNAL_BID, i, -1, PLAY_PENALTY, 0, 0);
+    PROBE_BID_RECEIVED(game->id, i, game->hand, -1);
 }
 
 /*
@@ -721,14 +1481,15 @@ int calculate_contract_points(Card* bid) {
 
 /*
 *   Sends a structured message to all players, excluding the player index
-*   given as the exclude parameter.
+*   given as the exclude parameter. Spectators always get it.
 */
 void send_to_players(Game* game, char type, char* message, int exclude) {
+    char* msg = create_message(type, message);
     for (int i = 0; i < 4; i++) {
         if (i != exclude) {
-            char* msg = create_message(type, message);
-            send_socket_message(game->players[i].writeFD, msg);
-            free(msg);
+            connection_send(game->players[i].conn, msg);
         }
     }
+    free(msg);
+    broadcast_frame(game, type, message);
 }
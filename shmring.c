@@ -0,0 +1,328 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "shmring.h"
+
+// Descriptors a client passes to set up its rings: the shared memory, the
+// server's doorbell and its own
+#define SHM_DESCRIPTORS 3
+// Seals a ring's memory must carry so that the client cannot shrink it
+// under the server
+#define SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+/*
+*   Wakes the other side.
+*/
+static void ring_bell(int bell) {
+    uint64_t one = 1;
+    while (write(bell, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+/*
+*   Maps a pair of rings and makes a channel for one side of them. Returns
+*   NULL if the memory is not a pair of rings.
+*/
+static ShmChannel* map_channel(int memory, int bell, int peerBell,
+        int socket, int server) {
+    struct stat status;
+    if (fstat(memory, &status) < 0 || status.st_size != sizeof(ShmRegion)) {
+        return NULL;
+    }
+    ShmRegion* region = mmap(NULL, sizeof(ShmRegion),
+            PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0);
+    if (region == MAP_FAILED) {
+        return NULL;
+    }
+    ShmChannel* channel = calloc(1, sizeof(ShmChannel));
+    channel->region = region;
+    channel->in = server ? &region->toServer : &region->toClient;
+    channel->out = server ? &region->toClient : &region->toServer;
+    channel->bell = bell;
+    channel->peerBell = peerBell;
+    channel->socket = socket;
+    return channel;
+}
+
+/*
+*   Sets up a pair of rings for a client connected to the server's Unix
+*   socket, and passes them to the server ahead of the handshake as a
+*   single zero byte carrying the descriptors. Returns NULL on failure.
+*/
+ShmChannel* shm_channel_open(int socket) {
+    int fds[SHM_DESCRIPTORS];
+    fds[0] = memfd_create("serv499-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fds[0] < 0 || fds[1] < 0 || fds[2] < 0 ||
+            ftruncate(fds[0], sizeof(ShmRegion)) < 0 ||
+            fcntl(fds[0], F_ADD_SEALS, SHM_SEALS) < 0) {
+        return NULL;
+    }
+    ShmChannel* channel = map_channel(fds[0], fds[2], fds[1], socket, 0);
+    if (channel == NULL) {
+        return NULL;
+    }
+    channel->region->magic = SHM_RING_MAGIC;
+    channel->region->size = sizeof(ShmRegion);
+
+    char zero = '\0';
+    struct iovec data = {&zero, 1};
+    union {
+        char buffer[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message = {0};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(header), fds, sizeof(fds));
+    if (sendmsg(socket, &message, MSG_NOSIGNAL) != 1) {
+        shm_channel_close(channel);
+        return NULL;
+    }
+    // The mapping keeps the memory, and the server now has the server's
+    // doorbell
+    close(fds[0]);
+    return channel;
+}
+
+/*
+*   Takes the rings a client has passed over its Unix socket. The zero byte
+*   carrying them must be next on the socket. Returns NULL if the client
+*   sent anything else or the memory is not a sealed pair of rings.
+*/
+ShmChannel* shm_channel_attach(int socket) {
+    // The control message is padded, and may bring in more descriptors
+    // than were asked for
+    int fds[CMSG_SPACE(sizeof(int) * SHM_DESCRIPTORS) / sizeof(int)];
+    char zero;
+    struct iovec data = {&zero, 1};
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * SHM_DESCRIPTORS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message = {0};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    if (recvmsg(socket, &message, MSG_CMSG_CLOEXEC) != 1) {
+        return NULL;
+    }
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (header == NULL || header->cmsg_level != SOL_SOCKET ||
+            header->cmsg_type != SCM_RIGHTS) {
+        return NULL;
+    }
+    int count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(header), sizeof(int) * count);
+    if (count != SHM_DESCRIPTORS || zero != '\0' ||
+            fcntl(fds[0], F_GET_SEALS) != SHM_SEALS) {
+        for (int i = 0; i < count; i++) {
+            close(fds[i]);
+        }
+        return NULL;
+    }
+    ShmChannel* channel = map_channel(fds[0], fds[1], fds[2], socket, 1);
+    close(fds[0]);
+    if (channel != NULL && (channel->region->magic != SHM_RING_MAGIC ||
+            channel->region->size != sizeof(ShmRegion))) {
+        shm_channel_close(channel);
+        return NULL;
+    } else if (channel == NULL) {
+        close(fds[1]);
+        close(fds[2]);
+    } else {
+        // Whatever the client passed as doorbells must never block the
+        // server
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[2], F_SETFL, fcntl(fds[2], F_GETFL) | O_NONBLOCK);
+    }
+    return channel;
+}
+
+/*
+*   Copies as much of length bytes into the outgoing ring as it has room
+*   for, and wakes the reader if it is waiting. Returns the bytes copied,
+*   or -1 if the other side has broken the ring.
+*/
+int shm_channel_write(ShmChannel* channel, const char* data, int length) {
+    ShmRing* ring = channel->out;
+    uint64_t head = ring->head;
+    uint64_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (used > SHM_RING_SIZE) {
+        return -1;
+    }
+    if (length > SHM_RING_SIZE - (int)used) {
+        length = SHM_RING_SIZE - used;
+    }
+    int offset = head & (SHM_RING_SIZE - 1);
+    int first = length < SHM_RING_SIZE - offset ?
+            length : SHM_RING_SIZE - offset;
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, data + first, length - first);
+    __atomic_store_n(&ring->head, head + length, __ATOMIC_SEQ_CST);
+    if (length > 0 &&
+            __atomic_exchange_n(&ring->readerWaiting, 0, __ATOMIC_SEQ_CST)) {
+        ring_bell(channel->peerBell);
+    }
+    return length;
+}
+
+/*
+*   Copies up to length bytes out of the incoming ring, and wakes the
+*   writer if it is waiting for room. Returns the bytes copied, 0 if the
+*   ring is empty, or -1 if the other side has broken the ring.
+*/
+int shm_channel_read(ShmChannel* channel, char* data, int length) {
+    ShmRing* ring = channel->in;
+    uint64_t tail = ring->tail;
+    uint64_t used = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+    if (used > SHM_RING_SIZE) {
+        return -1;
+    }
+    if (length > (int)used) {
+        length = used;
+    }
+    int offset = tail & (SHM_RING_SIZE - 1);
+    int first = length < SHM_RING_SIZE - offset ?
+            length : SHM_RING_SIZE - offset;
+    memcpy(data, ring->data + offset, first);
+    memcpy(data + first, ring->data, length - first);
+    __atomic_store_n(&ring->tail, tail + length, __ATOMIC_SEQ_CST);
+    if (length > 0 &&
+            __atomic_exchange_n(&ring->writerWaiting, 0, __ATOMIC_SEQ_CST)) {
+        ring_bell(channel->peerBell);
+    }
+    return length;
+}
+
+/*
+*   Says this side is about to sleep until there is something to read, if
+*   reading, or room to write, if writing. Returns 0 if there already is,
+*   when it must not sleep.
+*/
+int shm_channel_prepare_wait(ShmChannel* channel, int reading,
+        int writing) {
+    if (reading) {
+        __atomic_store_n(&channel->in->readerWaiting, 1, __ATOMIC_SEQ_CST);
+    }
+    if (writing) {
+        __atomic_store_n(&channel->out->writerWaiting, 1, __ATOMIC_SEQ_CST);
+    }
+    if ((reading && __atomic_load_n(&channel->in->head, __ATOMIC_SEQ_CST) !=
+            channel->in->tail) || (writing &&
+            __atomic_load_n(&channel->out->tail, __ATOMIC_SEQ_CST) +
+            SHM_RING_SIZE != channel->out->head)) {
+        shm_channel_finish_wait(channel);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+*   Called once this side has woken up, whatever woke it.
+*/
+void shm_channel_finish_wait(ShmChannel* channel) {
+    uint64_t count;
+    __atomic_store_n(&channel->in->readerWaiting, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&channel->out->writerWaiting, 0, __ATOMIC_SEQ_CST);
+    while (read(channel->bell, &count, sizeof(count)) < 0 &&
+            errno == EINTR) {
+    }
+}
+
+/*
+*   Blocks until there may be something to read or room to write. Returns
+*   0 once the other side has gone, though what it wrote before it went
+*   may still be waiting to be read.
+*/
+int shm_channel_wait(ShmChannel* channel, int reading, int writing) {
+    struct pollfd polls[2] = {
+        {channel->bell, POLLIN, 0},
+        {channel->socket, POLLIN, 0}
+    };
+    if (shm_channel_prepare_wait(channel, reading, writing)) {
+        while (poll(polls, 2, -1) < 0 && errno == EINTR) {
+        }
+        if (polls[1].revents) {
+            channel->gone = 1;
+        }
+        shm_channel_finish_wait(channel);
+    }
+    return !channel->gone;
+}
+
+/*
+*   Reads for a stream opened on a channel, waiting for the other side if
+*   the ring is empty.
+*/
+static ssize_t read_stream(void* cookie, char* buffer, size_t size) {
+    ShmChannel* channel = (ShmChannel*)cookie;
+    while (1) {
+        int count = shm_channel_read(channel, buffer,
+                size < INT_MAX ? size : INT_MAX);
+        if (count != 0) {
+            return count;
+        } else if (channel->gone) {
+            return 0;
+        }
+        shm_channel_wait(channel, 1, 0);
+    }
+}
+
+/*
+*   Writes for a stream opened on a channel, waiting for room if the ring
+*   is full.
+*/
+static ssize_t write_stream(void* cookie, const char* buffer, size_t size) {
+    ShmChannel* channel = (ShmChannel*)cookie;
+    size_t written = 0;
+    while (written < size) {
+        int count = shm_channel_write(channel, buffer + written,
+                size - written < INT_MAX ? size - written : INT_MAX);
+        if (count < 0 || (count == 0 && channel->gone)) {
+            return written ? (ssize_t)written : -1;
+        }
+        written += count;
+        if (written < size) {
+            shm_channel_wait(channel, 0, 1);
+        }
+    }
+    return written;
+}
+
+/*
+*   Opens a stdio stream that reads or writes a channel's rings, so that a
+*   client can use them in place of its socket.
+*/
+FILE* shm_channel_fopen(ShmChannel* channel, const char* mode) {
+    cookie_io_functions_t functions = {read_stream, write_stream, NULL,
+            NULL};
+    return fopencookie(channel, mode, functions);
+}
+
+/*
+*   Unmaps a channel's rings and closes its doorbells. The socket belongs
+*   to whoever opened it.
+*/
+void shm_channel_close(ShmChannel* channel) {
+    munmap(channel->region, sizeof(ShmRegion));
+    close(channel->bell);
+    close(channel->peerBell);
+    free(channel);
+}
@@ -0,0 +1,64 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Bytes each direction of a ring holds, a power of two
+#define SHM_RING_SIZE (64 * 1024)
+// Marks memory set up as a pair of rings, and the layout it has
+#define SHM_RING_MAGIC 0x34393952
+
+/*
+*   One direction of a shared-memory connection, a byte stream carrying the
+*   same lines as a socket. head and tail count every byte ever written and
+*   read. A reader or writer with nothing to do says so before it sleeps on
+*   its doorbell, and the other side only rings the doorbell when it has.
+*/
+typedef struct {
+    // The writer and the reader sit on separate cache lines
+    uint64_t head __attribute__((aligned(64)));
+    uint32_t readerWaiting;
+    uint64_t tail __attribute__((aligned(64)));
+    uint32_t writerWaiting;
+    char data[SHM_RING_SIZE] __attribute__((aligned(64)));
+} ShmRing;
+
+/*
+*   The memory a client shares with the server: a ring towards the server
+*   and one back.
+*/
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+    ShmRing toServer;
+    ShmRing toClient;
+} ShmRegion;
+
+/*
+*   One side's view of a shared-memory connection. Each side sleeps on its
+*   own eventfd and rings the other's. The Unix socket the rings were set
+*   up over stays open only so that each side sees the other go, and gone
+*   is set once it has.
+*/
+typedef struct ShmChannel {
+    ShmRegion* region;
+    ShmRing* in;
+    ShmRing* out;
+    int bell;
+    int peerBell;
+    int socket;
+    int gone;
+} ShmChannel;
+
+ShmChannel* shm_channel_open(int);
+ShmChannel* shm_channel_attach(int);
+int shm_channel_write(ShmChannel*, const char*, int);
+int shm_channel_read(ShmChannel*, char*, int);
+int shm_channel_prepare_wait(ShmChannel*, int, int);
+void shm_channel_finish_wait(ShmChannel*);
+int shm_channel_wait(ShmChannel*, int, int);
+FILE* shm_channel_fopen(ShmChannel*, const char*);
+void shm_channel_close(ShmChannel*);
+
+#endif
@@ -0,0 +1,70 @@
+/*
+* solve.c
+* Usage: solve499 deck [number]
+* Prints how many tricks the leader's side takes with every card visible,
+* for each trump suit and each leader, in one deal of a deck file. Deals
+* are numbered from 0.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "solver.h"
+
+void usage(void);
+
+int main(int argc, char** argv) {
+    char deck[106];
+    SolverTable table;
+    Solver solver;
+    struct timespec start, end;
+    if (argc < 2 || argc > 3) {
+        usage();
+    }
+    int number = argc == 3 ? atoi(argv[2]) : 0;
+    FILE* file = fopen(argv[1], "r");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot read %s\n", argv[1]);
+        exit(2);
+    }
+    for (int i = 0; i <= number; i++) {
+        if (fgets(deck, sizeof(deck), file) == NULL) {
+            fprintf(stderr, "No deal %d in %s\n", number, argv[1]);
+            exit(3);
+        }
+    }
+    fclose(file);
+    if (strlen(deck) < 104) {
+        fprintf(stderr, "Bad deal %d in %s\n", number, argv[1]);
+        exit(3);
+    }
+    if (!solver_table_init(&table, SOLVER_TABLE_SIZE)) {
+        fprintf(stderr, "Out of memory\n");
+        exit(4);
+    }
+    solver_init(&solver, &table);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    printf("trumps lead0 lead1 lead2 lead3\n");
+    for (const char* trump = "SCDH"; *trump; trump++) {
+        printf("%c     ", *trump);
+        for (int leader = 0; leader < 4; leader++) {
+            printf(" %5d", solve_deal(&solver, deck, *trump, leader));
+        }
+        printf("\n");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "%ld nodes in %.1f ms\n", solver.nodes,
+            (end.tv_sec - start.tv_sec) * 1e3 +
+            (end.tv_nsec - start.tv_nsec) / 1e6);
+    return 0;
+}
+
+/*
+*   Prints the usage message and exits.
+*/
+void usage(void) {
+    fprintf(stderr, "Usage: solve499 deck [number]\n");
+    exit(1);
+}
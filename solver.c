@@ -0,0 +1,939 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cards.h"
+#include "solver.h"
+
+// Suit index used when no suit is trumps
+#define NO_TRUMPS 4
+
+#define SUIT_OF(card) ((card) / 13)
+#define SUIT_BITS(suit) (0x1FFFULL << ((suit) * 13))
+// Bits of an entry word holding the owners of the top cards of two suits
+#define PATTERN_BITS ((1ULL << 52) - 1)
+
+// The number of cards in a set, inlined since the solver counts cards at
+// every node
+#define count_cards(cards) __builtin_popcountll(cards)
+
+/*
+*   Describes a position at the start of a trick for the transposition
+*   table. codes holds the owners of the cards left in each suit, two bits
+*   each from the highest card down, and lengths holds how many cards of
+*   each suit each hand has, four bits each. cards is the cards left.
+*/
+typedef struct {
+    uint64_t lengths;
+    uint64_t cards;
+    uint32_t codes[4];
+    int counts[4];
+} Shape;
+
+/*
+*   A deal part way through being played. cards holds the cards played to
+*   the current trick in the order they were played, starting with the
+*   leader's. shape describes the position at the start of the current
+*   trick, and is NULL until the first trick is searched.
+*/
+typedef struct {
+    uint64_t hands[4];
+    int trump;
+    int leader;
+    int cards[4];
+    int played;
+    const Shape* shape;
+} Position;
+
+static int search(Solver*, Position*, int, uint64_t*);
+
+/*
+*   Allocates a transposition table with room for about size entries,
+*   rounded down to a power of two blocks. Returns 0 on failure.
+*/
+int solver_table_init(SolverTable* table, size_t size) {
+    size_t blocks = 1;
+    while (blocks <= size / SOLVER_BLOCK_ENTRIES / 2) {
+        blocks <<= 1;
+    }
+    if (blocks > SIZE_MAX / sizeof(SolverBlock)) {
+        return 0;
+    }
+    table->blocks = aligned_alloc(64, sizeof(SolverBlock) * blocks);
+    table->blockMask = blocks - 1;
+    if (table->blocks == NULL) {
+        return 0;
+    }
+    solver_table_clear(table);
+    return 1;
+}
+
+/*
+*   Forgets everything in a transposition table. No solver may be using it.
+*/
+void solver_table_clear(SolverTable* table) {
+    memset(table->blocks, 0, sizeof(SolverBlock) * (table->blockMask + 1));
+}
+
+/*
+*   Frees a transposition table's memory.
+*/
+void solver_table_free(SolverTable* table) {
+    free(table->blocks);
+}
+
+/*
+*   Initialises a solver that uses the given table.
+*/
+void solver_init(Solver* solver, SolverTable* table) {
+    solver->table = table;
+    solver->nodes = 0;
+    solver->lastTrump = -1;
+    memset(solver->killers, -1, sizeof(solver->killers));
+}
+
+/*
+*   Splits a deck string into the four hands, dealt one card at a time in
+*   the same way as deal_cards.
+*/
+void hands_from_deck(const char* deck, uint64_t* hands) {
+    memset(hands, 0, sizeof(uint64_t) * 4);
+    for (int i = 0; i < CARD_COUNT && deck[i * 2] && deck[i * 2 + 1]; i++) {
+        int index = card_index(deck[i * 2], deck[i * 2 + 1]);
+        if (index != NO_CARD) {
+            hands[i % 4] |= 1ULL << index;
+        }
+    }
+}
+
+/*
+*   Returns whether card beats the card currently winning the trick, using
+*   the same rules as get_trick_winner.
+*/
+static int beats(int card, int winning, int trump) {
+    if (SUIT_OF(card) == SUIT_OF(winning)) {
+        return card > winning;
+    }
+    return SUIT_OF(card) == trump;
+}
+
+/*
+*   Returns the position in the trick of the card currently winning it.
+*/
+static int winning_card(Position* pos) {
+    int best = 0;
+    for (int i = 1; i < pos->played; i++) {
+        if (beats(pos->cards[i], pos->cards[best], pos->trump)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+/*
+*   Describes a position from scratch, card by card.
+*/
+static void make_shape(Position* pos, Shape* shape) {
+    uint64_t all = pos->hands[0] | pos->hands[1] | pos->hands[2] |
+            pos->hands[3];
+    shape->lengths = 0;
+    shape->cards = all;
+    for (int s = 0; s < 4; s++) {
+        uint64_t bits = all & SUIT_BITS(s);
+        uint32_t code = 0;
+        int count = 0;
+        while (bits) {
+            int card = 63 - __builtin_clzll(bits);
+            bits ^= 1ULL << card;
+            int owner = ((pos->hands[1] >> card) & 1) |
+                    ((pos->hands[2] >> card) & 1) * 2 |
+                    ((pos->hands[3] >> card) & 1) * 3;
+            code = code << 2 | owner;
+            shape->lengths += 1ULL << (s * 16 + owner * 4);
+            count++;
+        }
+        shape->codes[s] = code;
+        shape->counts[s] = count;
+    }
+}
+
+/*
+*   Describes a position from the shape at the start of the trick before,
+*   which is much cheaper than make_shape. The cards played since are taken
+*   out from the highest down, so that each leaves the places of the
+*   smaller cards of its suit in codes as they were.
+*/
+static void next_shape(const Shape* last, Position* pos, Shape* shape) {
+    uint64_t all = pos->hands[0] | pos->hands[1] | pos->hands[2] |
+            pos->hands[3];
+    uint64_t played = last->cards & ~all;
+    *shape = *last;
+    shape->cards = all;
+    while (played) {
+        int card = 63 - __builtin_clzll(played);
+        int suit = SUIT_OF(card);
+        played ^= 1ULL << card;
+        int below = count_cards(last->cards & SUIT_BITS(suit) &
+                ((1ULL << card) - 1));
+        uint32_t code = shape->codes[suit];
+        int owner = (code >> (2 * below)) & 3;
+        shape->codes[suit] = (code >> (2 * below + 2)) << (2 * below) |
+                (code & ((1U << (2 * below)) - 1));
+        shape->counts[suit]--;
+        shape->lengths -= 1ULL << (suit * 16 + owner * 4);
+    }
+}
+
+/*
+*   Returns the highest depth cards left in a suit.
+*/
+static uint64_t top_cards(const Shape* shape, int suit, int depth) {
+    uint64_t top = shape->cards & SUIT_BITS(suit);
+    for (int i = depth; i < shape->counts[suit]; i++) {
+        top &= top - 1;
+    }
+    return top;
+}
+
+/*
+*   Returns the bits of a suit's 26 in an entry word that hold the owners
+*   of its top depth cards.
+*/
+static uint64_t owner_mask(int depth) {
+    return (0x3FFFFFFULL << (26 - 2 * depth)) & 0x3FFFFFF;
+}
+
+/*
+*   Packs the owners of every card left in a suit and the one after it
+*   into the low 52 bits of a word, each suit highest card first from the
+*   top of its 26 bits.
+*/
+static uint64_t pack_owners(const Shape* shape, int suit) {
+    return (uint64_t)shape->codes[suit] <<
+            (2 * (13 - shape->counts[suit]) + 26) |
+            shape->codes[suit + 1] << (2 * (13 - shape->counts[suit + 1]));
+}
+
+/*
+*   Hashes the suit lengths, leader and trumps of a position. Entries for
+*   positions that differ in any of them never match.
+*/
+static uint64_t position_hash(Position* pos, Shape* shape) {
+    uint64_t hash = (shape->lengths ^ (pos->leader | pos->trump << 2)) *
+            0x9E3779B97F4A7C15ULL;
+    hash = (hash ^ hash >> 29) * 0xBF58476D1CE4E5B9ULL;
+    return hash ^ hash >> 32;
+}
+
+/*
+*   Returns the owner of a suit's top card plus one, or 0 if it is empty.
+*/
+static int top_owner(Shape* shape, int suit) {
+    int count = shape->counts[suit];
+    return count ? 1 + (shape->codes[suit] >> (2 * count - 2)) : 0;
+}
+
+/*
+*   Returns the block holding the entries for a position whose top cards
+*   of suits 0 and 1 have the given owners, as from top_owner, each 0 if
+*   none of the suit mattered. A position's entries are spread over
+*   neighbouring blocks this way, so that there is room for many of them.
+*/
+static SolverBlock* entry_block(SolverTable* table, uint64_t hash,
+        int first, int second) {
+    return &table->blocks[(hash + first * 5 + second) & table->blockMask];
+}
+
+/*
+*   Returns the tag for an entry from the top of the hash and the owners
+*   of the top cards of suits 2 and 3, in the same way. Never 0.
+*/
+static uint64_t entry_tag(uint64_t hash, int first, int second) {
+    return ((hash >> 56) + first * 5 + second) % 255 + 1;
+}
+
+/*
+*   Returns a word with the high bit of each of the eight tags in a word
+*   of tags set if it equals tag. A tag above a matching one may be set
+*   by mistake too, but is then rejected when its entry is decoded.
+*/
+static uint64_t match_tags(uint64_t tags, uint64_t tag) {
+    uint64_t bytes = tags ^ tag * 0x0101010101010101ULL;
+    return (bytes - 0x0101010101010101ULL) & ~bytes & 0x8080808080808080ULL;
+}
+
+/*
+*   Reads an entry and undoes the XORs it is stored with.
+*/
+static void read_entry(SolverBlock* block, int index, uint64_t hash,
+        uint64_t* words) {
+    uint64_t first = __atomic_load_n(&block->words[2 * index],
+            __ATOMIC_RELAXED);
+    uint64_t second = __atomic_load_n(&block->words[2 * index + 1],
+            __ATOMIC_RELAXED);
+    words[0] = first ^ hash;
+    words[1] = second ^ first;
+}
+
+/*
+*   Searches one block for an entry with one of the given tags that
+*   matches the position and settles target, as for lookup. owners holds
+*   the position's packed owners.
+*/
+static int lookup_block(SolverBlock* block, Shape* shape, uint64_t hash,
+        const uint64_t* owners, const uint64_t* tags, int target,
+        uint64_t* relevant) {
+    for (int i = 0; i < SOLVER_BLOCK_ENTRIES / 8; i++) {
+        uint64_t word = __atomic_load_n(&block->tags[i], __ATOMIC_RELAXED);
+        // Each entry goes in the first empty place and stays there, so
+        // the rest of the block is empty too
+        if (!word) {
+            break;
+        }
+        uint64_t matches = match_tags(word, tags[0]) |
+                match_tags(word, tags[1]) | match_tags(word, tags[2]) |
+                match_tags(word, tags[3]);
+        while (matches) {
+            int index = i * 8 + __builtin_ctzll(matches) / 8;
+            uint64_t words[2];
+            int depths[4];
+            matches &= matches - 1;
+            read_entry(block, index, hash, words);
+            for (int s = 0; s < 4; s++) {
+                depths[s] = (words[s / 2] >> (52 + 4 * (s & 1))) & 15;
+            }
+            if ((words[0] & PATTERN_BITS) != (owners[0] &
+                    (owner_mask(depths[0]) << 26 | owner_mask(depths[1]))) ||
+                    (words[1] & PATTERN_BITS) != (owners[1] &
+                    (owner_mask(depths[2]) << 26 | owner_mask(depths[3])))) {
+                continue;
+            }
+            int lower = words[0] >> 60;
+            int upper = words[1] >> 60;
+            if (lower >= target || upper < target) {
+                *relevant = 0;
+                for (int s = 0; s < 4; s++) {
+                    *relevant |= top_cards(shape, s, depths[s]);
+                }
+                return lower >= target;
+            }
+        }
+    }
+    return -1;
+}
+
+/*
+*   Looks a position up in the transposition table. An entry matches if
+*   the hands have the same suit lengths and the cards that mattered when
+*   it was stored, and every card above them, have the same owners; the
+*   smaller cards can be swapped around freely. Whether any card of each
+*   suit mattered is not known beforehand, so each block and tag it may
+*   have been stored under is tried. Returns 1 or 0 if an entry settles
+*   whether seats 0 and 2 reach target, setting relevant to the cards that
+*   entry depended on, or -1 if none does.
+*/
+static int lookup(SolverTable* table, Position* pos, Shape* shape,
+        int target, uint64_t* relevant) {
+    uint64_t hash = position_hash(pos, shape);
+    uint64_t owners[2] = {pack_owners(shape, 0), pack_owners(shape, 2)};
+    int top[4];
+    for (int s = 0; s < 4; s++) {
+        top[s] = top_owner(shape, s);
+    }
+    uint64_t tags[4] = {entry_tag(hash, 0, 0), entry_tag(hash, top[2], 0),
+            entry_tag(hash, 0, top[3]), entry_tag(hash, top[2], top[3])};
+    SolverBlock* blocks[4];
+    int count = 0;
+    for (int i = 0; i < 4; i++) {
+        if ((i & 1 && !top[0]) || (i & 2 && !top[1])) {
+            continue;
+        }
+        // The blocks are far enough apart to miss the cache separately,
+        // so they are all asked for at once
+        blocks[count] = entry_block(table, hash, i & 1 ? top[0] : 0,
+                i & 2 ? top[1] : 0);
+        __builtin_prefetch(blocks[count++]);
+    }
+    for (int i = 0; i < count; i++) {
+        int found = lookup_block(blocks[i], shape, hash, owners, tags,
+                target, relevant);
+        if (found >= 0) {
+            return found;
+        }
+    }
+    return -1;
+}
+
+/*
+*   Stores a bound for a position, keeping only as much of each suit as
+*   the relevant cards need. The bounds of an entry with the same pattern
+*   are tightened. Otherwise the entry goes in the first empty place in
+*   its block or, once that is full, over any entry, the node count
+*   standing in for a random choice.
+*/
+static void store(Solver* solver, Position* pos, Shape* shape,
+        uint64_t relevant, int lower, int upper) {
+    uint64_t hash = position_hash(pos, shape);
+    uint64_t entry[2] = {pack_owners(shape, 0), pack_owners(shape, 2)};
+    int top[4];
+    for (int s = 0; s < 4; s++) {
+        uint64_t cards = relevant & SUIT_BITS(s);
+        uint64_t depth = 0;
+        if (cards) {
+            depth = count_cards(shape->cards & SUIT_BITS(s) &
+                    ~((1ULL << __builtin_ctzll(cards)) - 1));
+        }
+        entry[s / 2] &= ~(owner_mask(13) << (s & 1 ? 0 : 26)) |
+                owner_mask(depth) << (s & 1 ? 0 : 26);
+        entry[s / 2] |= depth << (52 + 4 * (s & 1));
+        top[s] = depth ? top_owner(shape, s) : 0;
+    }
+    SolverBlock* block = entry_block(solver->table, hash, top[0], top[1]);
+    uint64_t tag = entry_tag(hash, top[2], top[3]);
+
+    int place = -1;
+    for (int i = 0; i < SOLVER_BLOCK_ENTRIES / 8 && place < 0; i++) {
+        uint64_t word = __atomic_load_n(&block->tags[i], __ATOMIC_RELAXED);
+        uint64_t matches = match_tags(word, tag);
+        while (matches) {
+            int index = i * 8 + __builtin_ctzll(matches) / 8;
+            uint64_t words[2];
+            matches &= matches - 1;
+            read_entry(block, index, hash, words);
+            if ((words[0] & ~(15ULL << 60)) == entry[0] &&
+                    (words[1] & ~(15ULL << 60)) == entry[1]) {
+                if (lower < (int)(words[0] >> 60)) {
+                    lower = words[0] >> 60;
+                }
+                if (upper > (int)(words[1] >> 60)) {
+                    upper = words[1] >> 60;
+                }
+                place = index;
+                break;
+            }
+        }
+        matches = match_tags(word, 0);
+        if (place < 0 && matches) {
+            place = i * 8 + __builtin_ctzll(matches) / 8;
+        }
+    }
+    if (place < 0) {
+        place = (solver->nodes * 7) % SOLVER_BLOCK_ENTRIES;
+    }
+    uint64_t first = (entry[0] | (uint64_t)lower << 60) ^ hash;
+    uint64_t second = (entry[1] | (uint64_t)upper << 60) ^ first;
+    __atomic_store_n(&block->words[2 * place], first, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->words[2 * place + 1], second,
+            __ATOMIC_RELAXED);
+    uint64_t* tags = &block->tags[place / 8];
+    int shift = 8 * (place % 8);
+    uint64_t word = __atomic_load_n(tags, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(tags, &word,
+            (word & ~(0xFFULL << shift)) | tag << shift, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/*
+*   Returns how many of the top cards of a suit, all held by one hand, the
+*   side on lead can cash, adding them to cards. A side suit only counts
+*   for as long as every opponent holding trumps must follow it. all is the
+*   cards left.
+*/
+static int cash_suit(Position* pos, int seat, int suit, uint64_t all,
+        uint64_t* cards) {
+    uint64_t hand = pos->hands[seat];
+    uint64_t remaining = all & SUIT_BITS(suit);
+    // The run is every card above the highest one the seat does not hold
+    uint64_t missing = remaining & ~hand;
+    uint64_t run = remaining;
+    if (missing) {
+        run &= ~((2ULL << (63 - __builtin_clzll(missing))) - 1);
+    }
+    int top = count_cards(run);
+    if (top && suit != pos->trump && pos->trump != NO_TRUMPS) {
+        for (int o = 1; o < 4; o += 2) {
+            uint64_t opponent = pos->hands[(pos->leader + o) & 3];
+            int length = count_cards(opponent & SUIT_BITS(suit));
+            if ((opponent & SUIT_BITS(pos->trump)) && length < top) {
+                top = length;
+            }
+        }
+        while (count_cards(run) > top) {
+            run &= run - 1;
+        }
+    }
+    *cards |= run;
+    return top;
+}
+
+/*
+*   Returns how many tricks the side on lead is sure to take straight
+*   away, adding the cards counted to relevant. That is either the
+*   leader's top cards suit by suit, the partner's top cards in one suit
+*   the leader can lead to them, or a ruff by the partner followed by
+*   their top cards, whichever is more.
+*/
+static int quick_tricks(Position* pos, uint64_t* relevant) {
+    int leader = pos->leader;
+    int partner = (leader + 2) & 3;
+    uint64_t all = pos->hands[0] | pos->hands[1] | pos->hands[2] |
+            pos->hands[3];
+    uint64_t own = 0;
+    int tricks = 0;
+    for (int s = 0; s < 4; s++) {
+        tricks += cash_suit(pos, leader, s, all, &own);
+    }
+    uint64_t best = own;
+    for (int s = 0; s < 4; s++) {
+        uint64_t cards = 0;
+        if (pos->hands[leader] & SUIT_BITS(s) && !(own & SUIT_BITS(s))) {
+            int partnerTricks = cash_suit(pos, partner, s, all,
+                    &cards);
+            if (partnerTricks > tricks) {
+                tricks = partnerTricks;
+                best = cards;
+            }
+        }
+    }
+    // A lead partner ruffs while both opponents follow gives partner the
+    // lead to cash their own winners
+    if (pos->trump != NO_TRUMPS && pos->hands[partner] &
+            SUIT_BITS(pos->trump)) {
+        for (int s = 0; s < 4; s++) {
+            uint64_t suit = SUIT_BITS(s);
+            if (s == pos->trump || !(pos->hands[leader] & suit) ||
+                    (pos->hands[partner] & suit) ||
+                    !(pos->hands[(leader + 1) & 3] & suit) ||
+                    !(pos->hands[(leader + 3) & 3] & suit)) {
+                continue;
+            }
+            uint64_t saved = pos->hands[partner];
+            uint64_t trumps = saved & SUIT_BITS(pos->trump);
+            pos->hands[partner] &= ~(trumps & -trumps);
+            uint64_t left = all & ~(trumps & -trumps);
+            uint64_t cards = 0;
+            int ruffTricks = 1;
+            for (int t = 0; t < 4; t++) {
+                ruffTricks += cash_suit(pos, partner, t, left, &cards);
+            }
+            pos->hands[partner] = saved;
+            if (ruffTricks > tricks) {
+                tricks = ruffTricks;
+                best = cards;
+            }
+            break;
+        }
+    }
+    *relevant |= best;
+    return tricks;
+}
+
+/*
+*   Returns whether the side of the given seat is sure to take at least
+*   tricks tricks with its trumps, adding the trumps that showed it to
+*   relevant. A trump above every trump the other side holds wins whenever
+*   it is played, so a hand with tricks such trumps is enough. Partners'
+*   trumps are not added together, since they may fall together.
+*/
+static int trump_tricks(Position* pos, int seat, int tricks,
+        uint64_t* relevant) {
+    if (pos->trump == NO_TRUMPS || tricks <= 0) {
+        return tricks <= 0;
+    }
+    uint64_t suit = SUIT_BITS(pos->trump);
+    uint64_t own = pos->hands[seat] & suit;
+    uint64_t partner = pos->hands[(seat + 2) & 3] & suit;
+    uint64_t others = (pos->hands[(seat + 1) & 3] |
+            pos->hands[(seat + 3) & 3]) & suit;
+    if (!others) {
+        // The lengths alone settle it
+        return count_cards(own) >= tricks || count_cards(partner) >= tricks;
+    }
+    // Walk down from the top trump until one hand has enough or the other
+    // side's highest trump is reached
+    uint64_t left = own | partner;
+    int counts[2] = {0, 0};
+    uint64_t cards = 0;
+    while (left) {
+        int card = 63 - __builtin_clzll(left);
+        if ((others >> card) != 0) {
+            break;
+        }
+        left ^= 1ULL << card;
+        cards |= 1ULL << card;
+        if (++counts[!((own >> card) & 1)] >= tricks) {
+            *relevant |= cards;
+            return 1;
+        }
+    }
+    // The top two trumps in different hands both take tricks if either
+    // hand has another trump to play first
+    if (tricks == 2 && counts[0] == 1 && counts[1] == 1 &&
+            count_cards(cards) == 2 &&
+            (count_cards(own) > 1 || count_cards(partner) > 1)) {
+        *relevant |= cards;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+*   Returns whether a seat still to play to the trick could beat card.
+*/
+static int can_beat(Position* pos, int seat, int card) {
+    uint64_t hand = pos->hands[seat];
+    int lead = SUIT_OF(pos->cards[0]);
+    uint64_t following = hand & SUIT_BITS(lead);
+    if (following) {
+        return SUIT_OF(card) == lead && following >> card > 1;
+    }
+    if (pos->trump == NO_TRUMPS) {
+        return 0;
+    }
+    uint64_t trumps = hand & SUIT_BITS(pos->trump);
+    return trumps && (SUIT_OF(card) != pos->trump || trumps >> card > 1);
+}
+
+/*
+*   Scores a lead. Winners come first, then leads to partner's winners or
+*   for partner to ruff, then the other cards highest first, since a high
+*   card drives out the opponents' winners sooner than a low one.
+*/
+static int lead_score(Position* pos, int card, uint64_t all) {
+    int rank = card % 13;
+    int suit = SUIT_OF(card);
+    int partner = (pos->leader + 2) & 3;
+    uint64_t remaining = all & SUIT_BITS(suit);
+    int top = 63 - __builtin_clzll(remaining);
+    int ruffable = 0;
+    if (suit != pos->trump && pos->trump != NO_TRUMPS) {
+        for (int o = 1; o < 4; o += 2) {
+            uint64_t opponent = pos->hands[(pos->leader + o) & 3];
+            if (!(opponent & SUIT_BITS(suit)) &&
+                    (opponent & SUIT_BITS(pos->trump))) {
+                ruffable = 1;
+            }
+        }
+    }
+    if (card == top) {
+        return ruffable ? 15 + rank : 60 + rank;
+    }
+    if (pos->hands[partner] & (1ULL << top)) {
+        return 45 - rank;
+    }
+    if (!ruffable && suit != pos->trump && pos->trump != NO_TRUMPS &&
+            !(pos->hands[partner] & SUIT_BITS(suit)) &&
+            (pos->hands[partner] & SUIT_BITS(pos->trump))) {
+        return 50 + rank;
+    }
+    return 20 + rank;
+}
+
+/*
+*   Scores a move so that the likeliest best moves are tried first. When
+*   following, the cheapest card that wins the trick for good comes first,
+*   then the lowest cards, and overtaking a partner who is already sure to
+*   win comes last. best is the card winning the trick so far.
+*/
+static int order_score(Position* pos, int card, uint64_t all, int best) {
+    int rank = card % 13;
+    if (pos->played == 0) {
+        return lead_score(pos, card, all);
+    }
+    int turn = (pos->leader + pos->played) & 3;
+    int partnerWinning = ((pos->leader + best) & 1) == (turn & 1);
+    int wins = beats(card, pos->cards[best], pos->trump);
+    int winning = wins ? card : pos->cards[best];
+    if (!wins && !partnerWinning) {
+        return 25 - rank;
+    }
+    int safe = 1;
+    for (int later = pos->played + 1; later < 4; later++) {
+        int seat = (pos->leader + later) & 3;
+        if ((seat & 1) != (turn & 1) && can_beat(pos, seat, winning)) {
+            safe = 0;
+        }
+    }
+    if (!wins) {
+        return safe ? 70 - rank : 25 - rank;
+    }
+    if (partnerWinning && safe) {
+        return 10 - rank;
+    }
+    return safe ? 80 - rank : 20 - rank;
+}
+
+/*
+*   Fills moves with the cards the player to move should try, best first.
+*   Of cards in one hand that are next to each other once played cards are
+*   removed only the highest is put in moves, since they are equivalent
+*   here; the others are put in skipped. Returns the number of moves.
+*/
+static int generate_moves(Position* pos, int turn, int* moves,
+        uint64_t* skipped) {
+    int scores[13];
+    int count = 0;
+    uint64_t hand = pos->hands[turn];
+    uint64_t all = pos->hands[0] | pos->hands[1] | pos->hands[2] |
+            pos->hands[3];
+    for (int i = 0; i < pos->played; i++) {
+        all |= 1ULL << pos->cards[i];
+    }
+    uint64_t legal = hand;
+    int best = winning_card(pos);
+    *skipped = 0;
+    if (pos->played) {
+        uint64_t following = hand & SUIT_BITS(SUIT_OF(pos->cards[0]));
+        legal = following ? following : hand;
+    }
+    while (legal) {
+        int card = __builtin_ctzll(legal);
+        legal &= legal - 1;
+        uint64_t higher = all & SUIT_BITS(SUIT_OF(card)) &
+                ~((2ULL << card) - 1);
+        if (higher && (hand & (higher & -higher))) {
+            *skipped |= 1ULL << card;
+            continue;
+        }
+        int score = order_score(pos, card, all, best);
+        int i = count++;
+        while (i > 0 && scores[i - 1] < score) {
+            moves[i] = moves[i - 1];
+            scores[i] = scores[i - 1];
+            i--;
+        }
+        moves[i] = card;
+        scores[i] = score;
+    }
+    return count;
+}
+
+/*
+*   Every move failed, which only holds in another position if the cards
+*   skipped as equivalent there still are. A skipped card is always next to
+*   a card above it in the same hand. Where that card counts, the skipped
+*   card is made to count as well, so that positions the answer is stored
+*   for have them next to each other too. Below that, the ranks do not
+*   matter and any card there fails as well as another. Returns the
+*   relevant cards with the skipped cards that count added.
+*/
+static uint64_t keep_equivalents(Position* pos, uint64_t relevant,
+        uint64_t skipped) {
+    uint64_t all = pos->hands[0] | pos->hands[1] | pos->hands[2] |
+            pos->hands[3];
+    for (int i = 0; i < pos->played; i++) {
+        all |= 1ULL << pos->cards[i];
+    }
+    while (skipped) {
+        int card = 63 - __builtin_clzll(skipped);
+        skipped ^= 1ULL << card;
+        uint64_t counted = relevant & SUIT_BITS(SUIT_OF(card));
+        uint64_t higher = all & SUIT_BITS(SUIT_OF(card)) &
+                ~((2ULL << card) - 1);
+        if (counted && __builtin_ctzll(counted) <= __builtin_ctzll(higher)) {
+            relevant |= 1ULL << card;
+        }
+    }
+    return relevant;
+}
+
+/*
+*   Returns whether seats 0 and 2 can take at least target of the tricks
+*   left, with both sides playing perfectly, and sets relevant to the
+*   cards whose ranks the answer depends on. Bounds are only stored at the
+*   start of a trick, when they do not depend on cards on the table.
+*/
+static int search(Solver* solver, Position* pos, int target,
+        uint64_t* relevant) {
+    int turn = (pos->leader + pos->played) & 3;
+    const Shape* last = pos->shape;
+    Shape shape;
+    solver->nodes++;
+    *relevant = 0;
+    if (pos->played == 0) {
+        int remaining = count_cards(pos->hands[turn]);
+        if (target <= 0) {
+            return 1;
+        }
+        if (target > remaining) {
+            return 0;
+        }
+        // Seats 0 and 2 are sure of some tricks and the other side of
+        // others, whatever is played
+        uint64_t sureCards = 0;
+        uint64_t concededCards = 0;
+        if (pos->leader & 1) {
+            if (remaining - quick_tricks(pos, &concededCards) < target) {
+                *relevant = concededCards;
+                return 0;
+            }
+        } else if (quick_tricks(pos, &sureCards) >= target) {
+            *relevant = sureCards;
+            return 1;
+        }
+        sureCards = 0;
+        concededCards = 0;
+        if (trump_tricks(pos, 0, target, &sureCards)) {
+            *relevant = sureCards;
+            return 1;
+        }
+        if (trump_tricks(pos, 1, remaining - target + 1, &concededCards)) {
+            *relevant = concededCards;
+            return 0;
+        }
+        if (last == NULL) {
+            make_shape(pos, &shape);
+        } else {
+            next_shape(last, pos, &shape);
+        }
+        int found = lookup(solver->table, pos, &shape, target, relevant);
+        if (found >= 0) {
+            return found;
+        }
+        pos->shape = &shape;
+    }
+
+    int moves[13];
+    uint64_t skipped;
+    int count = generate_moves(pos, turn, moves, &skipped);
+    // The lead that last settled a position at this trick often does again
+    int* killer = &solver->killers[count_cards(pos->hands[turn])][turn];
+    if (pos->played == 0) {
+        for (int i = 1; i < count; i++) {
+            if (moves[i] == *killer) {
+                memmove(moves + 1, moves, i * sizeof(int));
+                moves[0] = *killer;
+                break;
+            }
+        }
+    }
+    int maximising = !(turn & 1);
+    int result = !maximising;
+    uint64_t tried = 0;
+    uint64_t failing = 0;
+    for (int i = 0; i < count && result != maximising; i++) {
+        int value;
+        uint64_t cards;
+        if (failing & (1ULL << moves[i])) {
+            continue;
+        }
+        pos->hands[turn] &= ~(1ULL << moves[i]);
+        pos->cards[pos->played++] = moves[i];
+        if (pos->played == 4) {
+            int trick[4];
+            int leader = pos->leader;
+            int best = winning_card(pos);
+            int winner = (leader + best) & 3;
+            int byRank = 0;
+            for (int j = 0; j < 4; j++) {
+                byRank |= j != best &&
+                        SUIT_OF(pos->cards[j]) == SUIT_OF(pos->cards[best]);
+            }
+            memcpy(trick, pos->cards, sizeof(trick));
+            pos->leader = winner;
+            pos->played = 0;
+            value = search(solver, pos, target - !(winner & 1), &cards);
+            pos->leader = leader;
+            pos->played = 4;
+            memcpy(pos->cards, trick, sizeof(trick));
+            // The trick was won by rank, so the winning card matters
+            if (byRank) {
+                cards |= 1ULL << trick[best];
+            }
+        } else {
+            value = search(solver, pos, target, &cards);
+        }
+        pos->played--;
+        pos->hands[turn] |= 1ULL << moves[i];
+        if (value == maximising) {
+            if (pos->played == 0) {
+                *killer = moves[i];
+            }
+            result = value;
+            tried = cards;
+        } else {
+            // A failed card below every card of its suit that mattered
+            // fails like any other such card of the hand, since swapping
+            // them leaves the same position as far as the answer goes
+            uint64_t suit = SUIT_BITS(SUIT_OF(moves[i]));
+            uint64_t counted = cards & suit;
+            uint64_t below = counted ? (1ULL << __builtin_ctzll(counted)) - 1 :
+                    ~0ULL;
+            if ((1ULL << moves[i]) & below) {
+                failing |= pos->hands[turn] & suit & below;
+            }
+            tried |= cards;
+        }
+    }
+    if (result != maximising && skipped) {
+        tried = keep_equivalents(pos, tried, skipped);
+    }
+    *relevant = tried;
+
+    if (pos->played == 0) {
+        pos->shape = last;
+        if (result) {
+            store(solver, pos, &shape, tried, target, 13);
+        } else {
+            store(solver, pos, &shape, tried, 0, target - 1);
+        }
+    }
+    return result;
+}
+
+/*
+*   Returns the number of tricks the leader's side takes from the given
+*   hands with every card visible and both sides playing perfectly. trump
+*   is a suit character; anything else means no trumps. The answer is
+*   found by a series of yes or no searches, each narrowing the range.
+*/
+int solve_hands(Solver* solver, const uint64_t* hands, char trump,
+        int leader) {
+    Position pos;
+    memcpy(pos.hands, hands, sizeof(pos.hands));
+    int index = card_index('2', trump);
+    pos.trump = index == NO_CARD ? NO_TRUMPS : SUIT_OF(index);
+    pos.leader = leader;
+    pos.played = 0;
+    pos.shape = NULL;
+
+    int total = count_cards(hands[leader]);
+    int lower = 0;
+    int upper = total;
+    // Deals are usually solved for each leader in turn, and the tricks
+    // seats 0 and 2 took with the last one are a close guess. Searching
+    // next to the answer is much cheaper than halving the range, since
+    // most of the cost is in proving the answer itself.
+    int guess = -1;
+    if (solver->lastTrump == pos.trump && !memcmp(solver->lastHands, hands,
+            sizeof(solver->lastHands))) {
+        guess = solver->lastTricks;
+    }
+    while (lower < upper) {
+        uint64_t relevant;
+        int target = (lower + upper + 1) / 2;
+        if (guess >= 0) {
+            target = guess <= lower ? lower + 1 : guess > upper ? upper :
+                    guess;
+        }
+        if (search(solver, &pos, target, &relevant)) {
+            lower = target;
+            guess = target + 1;
+        } else {
+            upper = target - 1;
+            guess = target - 1;
+        }
+    }
+    memcpy(solver->lastHands, hands, sizeof(solver->lastHands));
+    solver->lastTrump = pos.trump;
+    solver->lastTricks = lower;
+    return leader & 1 ? total - lower : lower;
+}
+
+/*
+*   Solves a deal given as a deck string from the deck file.
+*/
+int solve_deal(Solver* solver, const char* deck, char trump, int leader) {
+    uint64_t hands[4];
+    hands_from_deck(deck, hands);
+    return solve_hands(solver, hands, trump, leader);
+}
@@ -0,0 +1,63 @@
+#ifndef SOLVER_H
+#define SOLVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Default number of transposition table entries
+#define SOLVER_TABLE_SIZE (1 << 22)
+// Entries in each block of the transposition table
+#define SOLVER_BLOCK_ENTRIES 128
+
+/*
+*   A block of the transposition table. tags has a byte for each entry,
+*   taken from the position's hash and the owners of its top cards, so
+*   that a lookup only decodes the entries likely to match; 0 marks an
+*   empty entry. Each entry is two words, a pair of suits each: the owners
+*   of the top cards of each suit, how many of them matter, and the lower
+*   or upper bound.
+*/
+typedef struct {
+    uint64_t tags[SOLVER_BLOCK_ENTRIES / 8];
+    uint64_t words[SOLVER_BLOCK_ENTRIES * 2];
+} SolverBlock;
+
+/*
+*   A transposition table of bounds on the tricks seats 0 and 2 can still
+*   take from positions at the start of a trick, shared by every thread
+*   without locks. The first word of an entry is stored XORed with the
+*   position's hash and the second with the first as stored, so an entry
+*   torn by two threads writing it at once, or read while being written,
+*   does not decode to a match. When a block is full a new entry replaces
+*   an old one, so the table never needs clearing.
+*/
+typedef struct {
+    SolverBlock* blocks;
+    size_t blockMask;
+} SolverTable;
+
+/*
+*   One thread's solver. The table may be shared with other solvers. The
+*   last deal solved, its trumps and the tricks seats 0 and 2 took are kept
+*   as a first guess for the next leader, and for each number of cards
+*   left and seat the last lead that settled a position, to be tried
+*   first; -1 if none.
+*/
+typedef struct {
+    SolverTable* table;
+    long nodes;
+    uint64_t lastHands[4];
+    int lastTrump;
+    int lastTricks;
+    int killers[14][4];
+} Solver;
+
+int solver_table_init(SolverTable*, size_t);
+void solver_table_clear(SolverTable*);
+void solver_table_free(SolverTable*);
+void solver_init(Solver*, SolverTable*);
+int solve_hands(Solver*, const uint64_t*, char, int);
+int solve_deal(Solver*, const char*, char, int);
+void hands_from_deck(const char*, uint64_t*);
+
+#endif
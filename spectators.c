@@ -0,0 +1,471 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "spectators.h"
+#include "cards.h"
+#include "metrics.h"
+#include "pending.h"
+#include "tables.h"
+
+static void flush_spectator(Reactor*, Spectator*);
+static void drop_spectator(Reactor*, Spectator*);
+
+/*
+*   Makes an unshared frame holding a message and its newline. Returns NULL
+*   if there is no memory.
+*/
+static Frame* create_frame(char type, const char* message) {
+    int length = strlen(message) + 2;
+    Frame* frame = malloc(sizeof(Frame) + length);
+    if (frame == NULL) {
+        return NULL;
+    }
+    frame->message.type = SHARD_FRAME;
+    frame->message.frame = frame;
+    frame->sequence = 0;
+    frame->references = 0;
+    frame->length = length;
+    frame->data[0] = type;
+    memcpy(frame->data + 1, message, length - 2);
+    frame->data[length - 1] = '\n';
+    return frame;
+}
+
+/*
+*   Lets go of one spectator's share of a frame.
+*/
+static void release_frame(Frame* frame) {
+    if (--frame->references == 0) {
+        free(frame);
+    }
+}
+
+/*
+*   Writes out who holds which cards, lowest index first, separated by
+*   spaces.
+*/
+static void describe_hand(char* out, size_t size, const char* name,
+        uint64_t hand) {
+    // Leave room for all 13 cards after the name
+    size_t length = snprintf(out, size - 40, "%s holds ", name);
+    if (length >= size - 40) {
+        length = size - 41;
+    }
+    for (int i = 0; i < CARD_COUNT; i++) {
+        if (hand & (1ULL << i)) {
+            Card card = card_from_index(i);
+            out[length++] = card.rank;
+            out[length++] = card.suit;
+            out[length++] = ' ';
+        }
+    }
+    out[length - 1] = '\0';
+}
+
+/*
+*   Starts a table's broadcast once its players are seated and tells the
+*   reactor that owns the table's name about it, so that spectators can
+*   find it. Returns NULL if there is no memory, leaving the table
+*   unwatchable.
+*/
+Broadcast* broadcast_open(Game* game, Reactor* owner) {
+    Broadcast* broadcast = calloc(1, sizeof(Broadcast));
+    if (broadcast == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&broadcast->lock, NULL);
+    broadcast->name = strdup(game->name);
+    broadcast->options = game->options;
+    for (int i = 0; i < 4; i++) {
+        broadcast->players[i] = strdup(game->players[i].name);
+    }
+    broadcast->owner = owner;
+    broadcast->startMessage.type = SHARD_TABLE_START;
+    broadcast->startMessage.broadcast = broadcast;
+    broadcast->endMessage.type = SHARD_TABLE_OVER;
+    broadcast->endMessage.broadcast = broadcast;
+    post_to_shard(owner, &broadcast->startMessage);
+    return broadcast;
+}
+
+/*
+*   Called by the table's worker for every message sent to all of its
+*   players. The table's state is always kept for spectators who join
+*   later, but a frame is only made when someone is watching. The worker
+*   never waits for the reactor: if its mailbox is full the frame is lost
+*   and the spectators are dropped instead.
+*/
+void broadcast_frame(Game* game, char type, const char* message) {
+    Broadcast* broadcast = game->broadcast;
+    if (broadcast == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&broadcast->lock);
+    unsigned long sequence = ++broadcast->sequence;
+    TableState* state = &broadcast->state;
+    state->hand = game->hand;
+    state->points[0] = TABLE(game, points)[0];
+    state->points[1] = TABLE(game, points)[1];
+    state->tricks[0] = TABLE(game, tricks)[0];
+    state->tricks[1] = TABLE(game, tricks)[1];
+    if (type == 'T') {
+        state->contractHand = game->hand;
+        state->contractTeam = TABLE(game, contractTeam);
+        strncpy(state->contract, message, sizeof(state->contract) - 1);
+    }
+    memcpy(state->hands, TABLE(game, hands), sizeof(state->hands));
+    int watching = broadcast->watching;
+    pthread_mutex_unlock(&broadcast->lock);
+    if (!watching) {
+        return;
+    }
+
+    Frame* frame = create_frame(type, message);
+    if (frame != NULL) {
+        frame->sequence = sequence;
+        frame->message.broadcast = broadcast;
+    }
+    if (frame == NULL ||
+            !queue_push(&broadcast->owner->mailbox, &frame->message)) {
+        free(frame);
+        __atomic_store_n(&broadcast->overrun, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+*   Shows spectators of an open table the hand each player was dealt.
+*/
+void broadcast_hands(Game* game) {
+    char message[1024];
+    for (int i = 0; i < 4; i++) {
+        describe_hand(message, sizeof(message), game->players[i].name,
+                TABLE(game, hands)[i]);
+        broadcast_frame(game, 'M', message);
+    }
+}
+
+/*
+*   Ends a table's broadcast. The worker must not touch it afterwards.
+*/
+void broadcast_close(Game* game) {
+    if (game->broadcast != NULL) {
+        post_to_shard(game->broadcast->owner, &game->broadcast->endMessage);
+        game->broadcast = NULL;
+    }
+}
+
+/*
+*   Makes a started table watchable.
+*/
+void add_broadcast(Reactor* reactor, Broadcast* broadcast) {
+    broadcast->next = reactor->broadcasts;
+    reactor->broadcasts = broadcast;
+}
+
+/*
+*   Frees a broadcast once its table is over and nobody is watching.
+*/
+static void free_broadcast(Broadcast* broadcast) {
+    pthread_mutex_destroy(&broadcast->lock);
+    free(broadcast->name);
+    for (int i = 0; i < 4; i++) {
+        free(broadcast->players[i]);
+    }
+    free(broadcast);
+}
+
+/*
+*   Drops everyone watching a table if its worker has lost a frame, since
+*   they missed it and have to join again.
+*/
+static void check_overrun(Reactor* reactor, Broadcast* broadcast) {
+    if (__atomic_exchange_n(&broadcast->overrun, 0, __ATOMIC_RELAXED)) {
+        while (broadcast->spectators != NULL) {
+            METRIC_ADD(spectatorsDropped, 1);
+            drop_spectator(reactor, broadcast->spectators);
+        }
+    }
+}
+
+/*
+*   Stops a finished table being watchable. Spectators who have seen
+*   everything leave now and the rest once their last frames are written.
+*   A frame lost near the end has no later frame to notice it, so the
+*   overrun is checked here too rather than closing a truncated stream as
+*   if it were whole.
+*/
+void remove_broadcast(Reactor* reactor, Broadcast* broadcast) {
+    check_overrun(reactor, broadcast);
+    flush_broadcasts(reactor);
+    Broadcast** link = &reactor->broadcasts;
+    while (*link != broadcast) {
+        link = &(*link)->next;
+    }
+    *link = broadcast->next;
+
+    Spectator* next;
+    for (Spectator* spectator = broadcast->spectators; spectator != NULL;
+            spectator = next) {
+        next = spectator->next;
+        if (spectator->tail == spectator->head) {
+            drop_spectator(reactor, spectator);
+        }
+    }
+    broadcast->finished = 1;
+    if (broadcast->spectators == NULL) {
+        free_broadcast(broadcast);
+    }
+}
+
+/*
+*   Queues a frame for a spectator.
+*/
+static void queue_frame(Spectator* spectator, Frame* frame) {
+    spectator->queue[spectator->head++ % SPECTATOR_QUEUE] = frame;
+    frame->references++;
+}
+
+/*
+*   Queues a frame from a table's worker for each of its spectators. They
+*   are written to once the whole batch of mailbox messages is handled, so
+*   that each spectator gets one write for many frames. A spectator who
+*   has fallen a full queue behind is dropped.
+*/
+void deliver_frame(Reactor* reactor, Frame* frame) {
+    Broadcast* broadcast = frame->message.broadcast;
+    check_overrun(reactor, broadcast);
+    // The reactor's own share keeps the frame alive while it is queued
+    frame->references = 1;
+    Spectator* next;
+    for (Spectator* spectator = broadcast->spectators; spectator != NULL;
+            spectator = next) {
+        next = spectator->next;
+        if (frame->sequence <= spectator->skip) {
+            continue;
+        }
+        if (spectator->head - spectator->tail == SPECTATOR_QUEUE) {
+            METRIC_ADD(spectatorsDropped, 1);
+            drop_spectator(reactor, spectator);
+            continue;
+        }
+        queue_frame(spectator, frame);
+    }
+    if (!broadcast->dirty) {
+        broadcast->dirty = 1;
+        broadcast->nextDirty = reactor->dirtyBroadcasts;
+        reactor->dirtyBroadcasts = broadcast;
+    }
+    release_frame(frame);
+}
+
+/*
+*   Writes out everything queued for the spectators of the tables that
+*   had frames delivered since the last flush.
+*/
+void flush_broadcasts(Reactor* reactor) {
+    Broadcast* broadcast = reactor->dirtyBroadcasts;
+    reactor->dirtyBroadcasts = NULL;
+    while (broadcast != NULL) {
+        Broadcast* nextDirty = broadcast->nextDirty;
+        Spectator* next;
+        broadcast->dirty = 0;
+        for (Spectator* spectator = broadcast->spectators;
+                spectator != NULL; spectator = next) {
+            next = spectator->next;
+            if (!spectator->blocked) {
+                flush_spectator(reactor, spectator);
+            }
+        }
+        broadcast = nextDirty;
+    }
+}
+
+/*
+*   Sends a spectator who has just joined the table's state as of the
+*   last frame its worker published.
+*/
+static void queue_snapshot(Spectator* spectator, TableState* state) {
+    Broadcast* broadcast = spectator->broadcast;
+    char message[1024];
+    Frame* frame;
+    snprintf(message, sizeof(message),
+            "%s: Team 1 (%s, %s) %d, Team 2 (%s, %s) %d, hand %d",
+            broadcast->name, broadcast->players[0], broadcast->players[2],
+            state->points[0], broadcast->players[1], broadcast->players[3],
+            state->points[1], state->hand);
+    if ((frame = create_frame('M', message)) != NULL) {
+        queue_frame(spectator, frame);
+    }
+    if (state->hand == 0) {
+        return;
+    }
+    if (state->contractHand == state->hand) {
+        snprintf(message, sizeof(message),
+                "Contract %s by Team %d, tricks %d-%d", state->contract,
+                state->contractTeam, state->tricks[0], state->tricks[1]);
+    } else {
+        strcpy(message, "Bidding");
+    }
+    if ((frame = create_frame('M', message)) != NULL) {
+        queue_frame(spectator, frame);
+    }
+    for (int i = 0; (broadcast->options & TABLE_OPEN_HANDS) && i < 4; i++) {
+        describe_hand(message, sizeof(message), broadcast->players[i],
+                state->hands[i]);
+        if ((frame = create_frame('M', message)) != NULL) {
+            queue_frame(spectator, frame);
+        }
+    }
+}
+
+/*
+*   Starts a connection watching the table with the given name, which
+*   this reactor owns. A table that has not started, or has finished, has
+*   nothing to watch and the connection is closed.
+*/
+void add_spectator(Reactor* reactor, int fd, char* gameName) {
+    static const char missing[] = "MNo such table\n";
+    Broadcast* broadcast = reactor->broadcasts;
+    while (broadcast != NULL && strcmp(broadcast->name, gameName)) {
+        broadcast = broadcast->next;
+    }
+    free(gameName);
+    Spectator* spectator = broadcast ? calloc(1, sizeof(Spectator)) : NULL;
+    if (spectator == NULL) {
+        send(fd, missing, sizeof(missing) - 1, MSG_DONTWAIT);
+        close(fd);
+        METRIC_ADD(connectionsOpen, -1);
+        return;
+    }
+    spectator->type = WATCH_SPECTATOR;
+    spectator->fd = fd;
+    spectator->broadcast = broadcast;
+
+    TableState state;
+    pthread_mutex_lock(&broadcast->lock);
+    state = broadcast->state;
+    spectator->skip = broadcast->sequence;
+    broadcast->watching++;
+    pthread_mutex_unlock(&broadcast->lock);
+
+    spectator->next = broadcast->spectators;
+    if (broadcast->spectators != NULL) {
+        broadcast->spectators->prev = spectator;
+    }
+    broadcast->spectators = spectator;
+    __atomic_store_n(&reactor->spectatorCount, reactor->spectatorCount + 1,
+            __ATOMIC_RELAXED);
+    METRIC_ADD(spectatorJoins, 1);
+
+    queue_snapshot(spectator, &state);
+    watch_fd(reactor, fd, spectator);
+    flush_spectator(reactor, spectator);
+}
+
+/*
+*   Writes as much of a spectator's queue as its socket will take. If the
+*   socket fills up, the reactor waits for it to drain before writing to it
+*   again.
+*/
+static void flush_spectator(Reactor* reactor, Spectator* spectator) {
+    struct iovec parts[SPECTATOR_WRITE_BATCH];
+    while (spectator->tail != spectator->head) {
+        int count = 0;
+        for (unsigned int i = spectator->tail; i != spectator->head &&
+                count < SPECTATOR_WRITE_BATCH; i++) {
+            Frame* frame = spectator->queue[i % SPECTATOR_QUEUE];
+            int skip = count ? 0 : spectator->sent;
+            parts[count].iov_base = frame->data + skip;
+            parts[count++].iov_len = frame->length - skip;
+        }
+        ssize_t written = writev(spectator->fd, parts, count);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!spectator->blocked) {
+                spectator->blocked = 1;
+                watch_writable(reactor, spectator->fd, spectator, 1);
+            }
+            return;
+        } else if (written < 0) {
+            drop_spectator(reactor, spectator);
+            return;
+        }
+        // Count from the start of the first frame, then let go of every
+        // frame that is now written in full
+        written += spectator->sent;
+        while (spectator->tail != spectator->head) {
+            Frame* frame = spectator->queue[spectator->tail %
+                    SPECTATOR_QUEUE];
+            if (written < frame->length) {
+                break;
+            }
+            written -= frame->length;
+            spectator->tail++;
+            release_frame(frame);
+        }
+        spectator->sent = written;
+    }
+    if (spectator->blocked) {
+        spectator->blocked = 0;
+        watch_writable(reactor, spectator->fd, spectator, 0);
+    }
+    if (spectator->broadcast->finished) {
+        drop_spectator(reactor, spectator);
+    }
+}
+
+/*
+*   Handles an event on a spectator's connection. Anything a spectator
+*   sends is ignored, and it is dropped when it hangs up.
+*/
+void service_spectator(Reactor* reactor, Spectator* spectator,
+        uint32_t events) {
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        char ignored[256];
+        ssize_t count = read(spectator->fd, ignored, sizeof(ignored));
+        if (count == 0 || (count < 0 && errno != EAGAIN && errno != EINTR)) {
+            drop_spectator(reactor, spectator);
+            return;
+        }
+    }
+    if (events & EPOLLOUT) {
+        flush_spectator(reactor, spectator);
+    }
+}
+
+/*
+*   Disconnects a spectator, letting go of everything queued for it. The
+*   last spectator of a finished table frees its broadcast.
+*/
+static void drop_spectator(Reactor* reactor, Spectator* spectator) {
+    Broadcast* broadcast = spectator->broadcast;
+    unwatch_fd(reactor, spectator->fd);
+    close(spectator->fd);
+    METRIC_ADD(connectionsOpen, -1);
+    while (spectator->tail != spectator->head) {
+        release_frame(spectator->queue[spectator->tail++ % SPECTATOR_QUEUE]);
+    }
+    if (spectator->prev != NULL) {
+        spectator->prev->next = spectator->next;
+    } else {
+        broadcast->spectators = spectator->next;
+    }
+    if (spectator->next != NULL) {
+        spectator->next->prev = spectator->prev;
+    }
+    pthread_mutex_lock(&broadcast->lock);
+    broadcast->watching--;
+    pthread_mutex_unlock(&broadcast->lock);
+    free(spectator);
+    __atomic_store_n(&reactor->spectatorCount, reactor->spectatorCount - 1,
+            __ATOMIC_RELAXED);
+    if (broadcast->finished && broadcast->spectators == NULL) {
+        free_broadcast(broadcast);
+    }
+}
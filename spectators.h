@@ -0,0 +1,94 @@
+#ifndef SPECTATORS_H
+#define SPECTATORS_H
+
+#include <pthread.h>
+#include "reactor.h"
+
+// Player name that makes a connection a spectator of the named table
+#define SPECTATOR_NAME "*"
+// Most frames waiting for one spectator before it is dropped as too slow
+#define SPECTATOR_QUEUE 256
+// Most frames written to a spectator in one system call
+#define SPECTATOR_WRITE_BATCH 64
+
+/*
+*   A message for spectators. One copy is shared by every spectator it is
+*   queued for and freed when the last of them has sent it. It travels to
+*   the owning reactor as its own mailbox message.
+*/
+typedef struct Frame {
+    ShardMessage message;
+    unsigned long sequence;
+    int references;
+    int length;
+    char data[];
+} Frame;
+
+/*
+*   A connection watching a table. Only the reactor that owns the table
+*   touches it. Frames up to skip were already covered by the snapshot it
+*   was sent when it joined.
+*/
+typedef struct Spectator {
+    WatchType type;
+    int fd;
+    Frame* queue[SPECTATOR_QUEUE];
+    unsigned int head;
+    unsigned int tail;
+    int sent;
+    int blocked;
+    unsigned long skip;
+    struct Broadcast* broadcast;
+    struct Spectator* prev;
+    struct Spectator* next;
+} Spectator;
+
+/*
+*   What a spectator joining part way through a table is told.
+*/
+typedef struct {
+    int hand;
+    int points[2];
+    int tricks[2];
+    int contractHand;
+    int contractTeam;
+    char contract[3];
+    uint64_t hands[4];
+} TableState;
+
+/*
+*   A table's spectators. The table's worker publishes frames and the
+*   table's state under the lock, and the reactor that owns the table's
+*   name does everything else.
+*/
+typedef struct Broadcast {
+    pthread_mutex_t lock;
+    unsigned long sequence;
+    int watching;
+    TableState state;
+    int overrun;
+    char* name;
+    int options;
+    char* players[4];
+    struct Reactor* owner;
+    ShardMessage startMessage;
+    ShardMessage endMessage;
+    Spectator* spectators;
+    int finished;
+    int dirty;
+    struct Broadcast* nextDirty;
+    struct Broadcast* next;
+} Broadcast;
+
+Broadcast* broadcast_open(Game*, struct Reactor*);
+void broadcast_frame(Game*, char, const char*);
+void broadcast_hands(Game*);
+void broadcast_close(Game*);
+void add_broadcast(struct Reactor*, Broadcast*);
+void remove_broadcast(struct Reactor*, Broadcast*);
+void deliver_frame(struct Reactor*, Frame*);
+void flush_broadcasts(struct Reactor*);
+void add_spectator(struct Reactor*, int, char*);
+void service_spectator(struct Reactor*, Spectator*, uint32_t);
+
+#endif
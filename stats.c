@@ -0,0 +1,428 @@
+/*
+* stats.c
+* Usage: stats499 [-t threads] [-f csv|json] [-b seconds] journal...
+* Reports contract success by bid, tricks by trump suit and points per team
+* over time from serv499 journal segments or directories of segments.
+*/
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "journal.h"
+
+// Number of possible bids, from 4S up to 9H
+#define BID_COUNT 24
+
+/*
+*   A mapped journal segment.
+*/
+typedef struct {
+    char* path;
+    JournalRecord* records;
+    long count;
+} Segment;
+
+/*
+*   Points won or lost by each team in one period of time.
+*/
+typedef struct {
+    long period;
+    long points[2];
+    long hands;
+} Period;
+
+/*
+*   Everything one thread learns from its share of the records. The
+*   periods are an open addressed hash table keyed by period.
+*/
+typedef struct {
+    long first;
+    long last;
+    long attempts[BID_COUNT];
+    long made[BID_COUNT];
+    long tricks[4];
+    long contracts[4];
+    Period* periods;
+    long periodCapacity;
+    long periodCount;
+} Totals;
+
+void usage(void);
+void add_segment(char*);
+void add_path(char*);
+void* scan_records(void*);
+void count_score(Totals*, JournalRecord*);
+Period* find_period(Totals*, long);
+void merge_totals(Totals*, Totals*);
+int compare_periods(const void*, const void*);
+long sorted_periods(Totals*, Period**);
+void print_csv(Totals*);
+void print_json(Totals*);
+char* bid_name(int, char*);
+
+Segment* segments = NULL;
+int segmentCount = 0;
+long totalRecords = 0;
+long periodLength = 3600;
+int threadCount = 0;
+
+int main(int argc, char** argv) {
+    int option;
+    char* format = "csv";
+    while ((option = getopt(argc, argv, "t:f:b:")) != -1) {
+        switch (option) {
+            case 't':
+                threadCount = atoi(optarg);
+                break;
+            case 'f':
+                format = optarg;
+                break;
+            case 'b':
+                periodLength = atol(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind == argc || periodLength <= 0 ||
+            (strcmp(format, "csv") && strcmp(format, "json"))) {
+        usage();
+    }
+    for (int i = optind; i < argc; i++) {
+        add_path(argv[i]);
+    }
+    if (threadCount <= 0) {
+        threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    // Split the records evenly between the threads, regardless of which
+    // segment they are in
+    pthread_t* threads = malloc(sizeof(pthread_t) * threadCount);
+    Totals* totals = calloc(threadCount, sizeof(Totals));
+    long share = (totalRecords + threadCount - 1) / threadCount;
+    for (int i = 0; i < threadCount; i++) {
+        totals[i].first = i * share;
+        totals[i].last = (i + 1) * share < totalRecords ?
+                (i + 1) * share : totalRecords;
+        pthread_create(&threads[i], NULL, scan_records, &totals[i]);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+        if (i > 0) {
+            merge_totals(&totals[0], &totals[i]);
+        }
+    }
+
+    if (!strcmp(format, "csv")) {
+        print_csv(&totals[0]);
+    } else {
+        print_json(&totals[0]);
+    }
+    return 0;
+}
+
+/*
+*   Prints the usage message and exits.
+*/
+void usage(void) {
+    fprintf(stderr, "Usage: stats499 [-t threads] [-f csv|json] "
+            "[-b seconds] journal...\n");
+    exit(1);
+}
+
+/*
+*   Adds a segment file, or every segment in a directory.
+*/
+void add_path(char* path) {
+    struct stat info;
+    if (stat(path, &info) < 0) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        exit(2);
+    }
+    if (!S_ISDIR(info.st_mode)) {
+        add_segment(path);
+        return;
+    }
+    struct dirent** entries;
+    int count = scandir(path, &entries, NULL, alphasort);
+    for (int i = 0; i < count; i++) {
+        if (!strncmp(entries[i]->d_name, "journal-", 8) &&
+                strstr(entries[i]->d_name, ".seg")) {
+            char* file = malloc(strlen(path) +
+                    strlen(entries[i]->d_name) + 2);
+            sprintf(file, "%s/%s", path, entries[i]->d_name);
+            add_segment(file);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+}
+
+/*
+*   Maps a segment into memory after checking its header.
+*/
+void add_segment(char* path) {
+    struct stat info;
+    JournalHeader* header;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        exit(2);
+    }
+    if (info.st_size < (off_t)sizeof(JournalHeader)) {
+        close(fd);
+        return;
+    }
+    header = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED || memcmp(header->magic, JOURNAL_MAGIC,
+            sizeof(JOURNAL_MAGIC)) || header->version != JOURNAL_VERSION ||
+            header->recordSize != sizeof(JournalRecord)) {
+        fprintf(stderr, "Bad journal segment %s\n", path);
+        exit(3);
+    }
+    madvise(header, info.st_size, MADV_SEQUENTIAL);
+    segments = realloc(segments, sizeof(Segment) * (segmentCount + 1));
+    segments[segmentCount].path = path;
+    segments[segmentCount].records = (JournalRecord*)(header + 1);
+    // A segment being written may end part way through a record
+    segments[segmentCount].count = (info.st_size - sizeof(JournalHeader)) /
+            sizeof(JournalRecord);
+    totalRecords += segments[segmentCount++].count;
+}
+
+/*
+*   Scans one thread's share of the records. Most records are plays, so
+*   the type bytes are compared four records at a time and only scores
+*   are decoded.
+*/
+void* scan_records(void* arg) {
+    Totals* totals = (Totals*)arg;
+    long start = 0;
+    for (int s = 0; s < segmentCount; s++) {
+        long end = start + segments[s].count;
+        long from = totals->first > start ? totals->first - start : 0;
+        long to = totals->last < end ? totals->last - start :
+                segments[s].count;
+        JournalRecord* records = segments[s].records;
+        long i = from;
+#ifdef __SSE2__
+        // The type is byte 14 of the first half of each record
+        const __m128i score = _mm_set1_epi8(JOURNAL_SCORE);
+        for (; i + 4 <= to; i += 4) {
+            __m128i r0 = _mm_loadu_si128((__m128i*)&records[i]);
+            __m128i r1 = _mm_loadu_si128((__m128i*)&records[i + 1]);
+            __m128i r2 = _mm_loadu_si128((__m128i*)&records[i + 2]);
+            __m128i r3 = _mm_loadu_si128((__m128i*)&records[i + 3]);
+            int mask = (_mm_movemask_epi8(_mm_cmpeq_epi8(r0, score)) >> 14 &
+                    1) | (_mm_movemask_epi8(_mm_cmpeq_epi8(r1, score)) >> 13 &
+                    2) | (_mm_movemask_epi8(_mm_cmpeq_epi8(r2, score)) >> 12 &
+                    4) | (_mm_movemask_epi8(_mm_cmpeq_epi8(r3, score)) >> 11 &
+                    8);
+            while (mask) {
+                count_score(totals, &records[i + __builtin_ctz(mask)]);
+                mask &= mask - 1;
+            }
+        }
+#endif
+        for (; i < to; i++) {
+            if (records[i].type == JOURNAL_SCORE) {
+                count_score(totals, &records[i]);
+            }
+        }
+        start = end;
+    }
+    return NULL;
+}
+
+/*
+*   Adds a scored hand to the totals.
+*/
+void count_score(Totals* totals, JournalRecord* record) {
+    int bid = record->data.values.a;
+    int packed = record->data.values.b;
+    int team = SCORE_TEAM(packed);
+    if (bid < 0 || bid >= BID_COUNT || (team != 1 && team != 2)) {
+        return;
+    }
+    totals->attempts[bid]++;
+    totals->made[bid] += SCORE_MADE(packed) ? 1 : 0;
+    totals->tricks[bid % 4] += SCORE_TRICKS(packed);
+    totals->contracts[bid % 4]++;
+
+    // Contract points as calculated by serv499
+    int points = (bid / 4) * 50 + 20 + (bid % 4) * 10;
+    Period* period = find_period(totals, record->timestamp /
+            (1000000000ULL * periodLength));
+    period->points[team - 1] += SCORE_MADE(packed) ? points : -points;
+    period->hands++;
+}
+
+/*
+*   Returns the totals for a period of time, adding it if it is new.
+*/
+Period* find_period(Totals* totals, long key) {
+    if (totals->periodCount * 2 >= totals->periodCapacity) {
+        // Grow the table and rehash everything already in it
+        Period* old = totals->periods;
+        long oldCapacity = totals->periodCapacity;
+        totals->periodCapacity = oldCapacity ? oldCapacity * 2 : 64;
+        totals->periods = calloc(totals->periodCapacity, sizeof(Period));
+        totals->periodCount = 0;
+        for (long i = 0; i < oldCapacity; i++) {
+            if (old[i].hands) {
+                *find_period(totals, old[i].period) = old[i];
+            }
+        }
+        free(old);
+    }
+    long slot = (key * 2654435761UL) & (totals->periodCapacity - 1);
+    while (totals->periods[slot].hands &&
+            totals->periods[slot].period != key) {
+        slot = (slot + 1) & (totals->periodCapacity - 1);
+    }
+    if (!totals->periods[slot].hands) {
+        totals->periods[slot].period = key;
+        totals->periodCount++;
+    }
+    return &totals->periods[slot];
+}
+
+/*
+*   Adds one thread's totals into another's.
+*/
+void merge_totals(Totals* into, Totals* from) {
+    for (int i = 0; i < BID_COUNT; i++) {
+        into->attempts[i] += from->attempts[i];
+        into->made[i] += from->made[i];
+    }
+    for (int i = 0; i < 4; i++) {
+        into->tricks[i] += from->tricks[i];
+        into->contracts[i] += from->contracts[i];
+    }
+    for (long i = 0; i < from->periodCapacity; i++) {
+        if (from->periods[i].hands) {
+            Period* period = find_period(into, from->periods[i].period);
+            period->points[0] += from->periods[i].points[0];
+            period->points[1] += from->periods[i].points[1];
+            period->hands += from->periods[i].hands;
+        }
+    }
+}
+
+/*
+*   Orders periods by time.
+*/
+int compare_periods(const void* x, const void* y) {
+    long a = ((const Period*)x)->period;
+    long b = ((const Period*)y)->period;
+    return (a > b) - (a < b);
+}
+
+/*
+*   Gathers the periods of a set of totals into time order. Returns the
+*   number of periods.
+*/
+long sorted_periods(Totals* totals, Period** sorted) {
+    long count = 0;
+    *sorted = malloc(sizeof(Period) * (totals->periodCount + 1));
+    for (long i = 0; i < totals->periodCapacity; i++) {
+        if (totals->periods[i].hands) {
+            (*sorted)[count++] = totals->periods[i];
+        }
+    }
+    qsort(*sorted, count, sizeof(Period), compare_periods);
+    return count;
+}
+
+/*
+*   Writes the name of a bid value, such as 7D, into buffer.
+*/
+char* bid_name(int bid, char* buffer) {
+    buffer[0] = '4' + bid / 4;
+    buffer[1] = "SCDH"[bid % 4];
+    buffer[2] = '\0';
+    return buffer;
+}
+
+/*
+*   Prints the reports as CSV tables separated by blank lines.
+*/
+void print_csv(Totals* totals) {
+    char bid[3];
+    Period* periods;
+    long count = sorted_periods(totals, &periods);
+
+    printf("bid,contracts,made,success_rate\n");
+    for (int i = 0; i < BID_COUNT; i++) {
+        if (totals->attempts[i]) {
+            printf("%s,%ld,%ld,%.4f\n", bid_name(i, bid),
+                    totals->attempts[i], totals->made[i],
+                    (double)totals->made[i] / totals->attempts[i]);
+        }
+    }
+    printf("\ntrumps,contracts,average_tricks\n");
+    for (int i = 0; i < 4; i++) {
+        if (totals->contracts[i]) {
+            printf("%c,%ld,%.4f\n", "SCDH"[i], totals->contracts[i],
+                    (double)totals->tricks[i] / totals->contracts[i]);
+        }
+    }
+    printf("\nperiod_start,hands,team1_points,team2_points\n");
+    for (long i = 0; i < count; i++) {
+        printf("%ld,%ld,%ld,%ld\n", periods[i].period * periodLength,
+                periods[i].hands, periods[i].points[0],
+                periods[i].points[1]);
+    }
+    free(periods);
+}
+
+/*
+*   Prints the reports as a single JSON object.
+*/
+void print_json(Totals* totals) {
+    char bid[3];
+    Period* periods;
+    long count = sorted_periods(totals, &periods);
+    int first = 1;
+
+    printf("{\"records\":%ld,\"contracts\":[", totalRecords);
+    for (int i = 0; i < BID_COUNT; i++) {
+        if (totals->attempts[i]) {
+            printf("%s{\"bid\":\"%s\",\"contracts\":%ld,\"made\":%ld,"
+                    "\"success_rate\":%.4f}", first ? "" : ",",
+                    bid_name(i, bid), totals->attempts[i], totals->made[i],
+                    (double)totals->made[i] / totals->attempts[i]);
+            first = 0;
+        }
+    }
+    printf("],\"trumps\":[");
+    first = 1;
+    for (int i = 0; i < 4; i++) {
+        if (totals->contracts[i]) {
+            printf("%s{\"trumps\":\"%c\",\"contracts\":%ld,"
+                    "\"average_tricks\":%.4f}", first ? "" : ",", "SCDH"[i],
+                    totals->contracts[i],
+                    (double)totals->tricks[i] / totals->contracts[i]);
+            first = 0;
+        }
+    }
+    printf("],\"periods\":[");
+    for (long i = 0; i < count; i++) {
+        printf("%s{\"start\":%ld,\"hands\":%ld,\"team1_points\":%ld,"
+                "\"team2_points\":%ld}", i ? "," : "",
+                periods[i].period * periodLength, periods[i].hands,
+                periods[i].points[0], periods[i].points[1]);
+    }
+    printf("]}\n");
+    free(periods);
+}
@@ -0,0 +1,158 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tables.h"
+#include "metrics.h"
+
+/*
+*   A name shared by every player and table that uses it.
+*/
+typedef struct Name {
+    struct Name* next;
+    unsigned int hash;
+    int references;
+    char text[];
+} Name;
+
+/*
+*   Every slab and the tables in them that are free. Slabs live as long as
+*   the server, and reactors and game threads take and give back tables
+*   under the lock.
+*/
+static struct {
+    pthread_mutex_t lock;
+    TableSlab* slabs;
+    Game** free;
+    int freeCount;
+    int freeSize;
+} store = {PTHREAD_MUTEX_INITIALIZER};
+
+/*
+*   The interned names, hashed into buckets.
+*/
+static struct {
+    pthread_mutex_t lock;
+    Name* buckets[NAME_BUCKETS];
+} names = {PTHREAD_MUTEX_INITIALIZER};
+
+/*
+*   Adds another slab of tables to the store and frees all of its tables.
+*   Must be called with the store locked.
+*/
+static void add_slab(void) {
+    TableSlab* slab = aligned_alloc(64, sizeof(TableSlab));
+    memset(slab, 0, sizeof(TableSlab));
+    slab->next = store.slabs;
+    store.slabs = slab;
+    store.freeSize += TABLE_SLAB_SIZE;
+    store.free = realloc(store.free, sizeof(Game*) * store.freeSize);
+    // Hand out the lowest tables first so that a quiet server stays in
+    // the front of its newest slab
+    for (int i = TABLE_SLAB_SIZE - 1; i >= 0; i--) {
+        slab->games[i].slab = slab;
+        slab->games[i].slot = i;
+        store.free[store.freeCount++] = &slab->games[i];
+    }
+    METRIC_ADD(tableSlots, TABLE_SLAB_SIZE);
+    METRIC_ADD(tableStoreBytes, sizeof(TableSlab));
+}
+
+/*
+*   Takes a table from the store, with all of its state cleared.
+*/
+Game* table_create(void) {
+    pthread_mutex_lock(&store.lock);
+    if (store.freeCount == 0) {
+        add_slab();
+    }
+    Game* game = store.free[--store.freeCount];
+    pthread_mutex_unlock(&store.lock);
+
+    TableSlab* slab = game->slab;
+    int slot = game->slot;
+    memset(game, 0, sizeof(Game));
+    game->slab = slab;
+    game->slot = slot;
+    memset(&slab->states[slot], 0, sizeof(PlayState));
+    METRIC_ADD(tablesLive, 1);
+    return game;
+}
+
+/*
+*   Gives a finished table back to the store, along with its name and the
+*   names of its players.
+*/
+void table_release(Game* game) {
+    release_name(game->name);
+    for (int i = 0; i < game->playerCount; i++) {
+        release_name(game->players[i].name);
+    }
+    pthread_mutex_lock(&store.lock);
+    store.free[store.freeCount++] = game;
+    pthread_mutex_unlock(&store.lock);
+    METRIC_ADD(tablesLive, -1);
+}
+
+/*
+*   FNV-1a hash of a name.
+*/
+static unsigned int hash_name(const char* text) {
+    unsigned int hash = 2166136261u;
+    for (; *text; text++) {
+        hash = (hash ^ (unsigned char)*text) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+*   Returns the one shared copy of a name, which must not be changed.
+*   Every call must be matched by a call to release_name.
+*/
+char* intern_name(const char* text) {
+    unsigned int hash = hash_name(text);
+    Name** bucket = &names.buckets[hash % NAME_BUCKETS];
+    pthread_mutex_lock(&names.lock);
+    Name* name = *bucket;
+    while (name != NULL &&
+            (name->hash != hash || strcmp(name->text, text))) {
+        name = name->next;
+    }
+    if (name == NULL) {
+        int length = strlen(text) + 1;
+        name = malloc(sizeof(Name) + length);
+        name->hash = hash;
+        name->references = 0;
+        memcpy(name->text, text, length);
+        name->next = *bucket;
+        *bucket = name;
+        METRIC_ADD(internedNames, 1);
+        METRIC_ADD(internedBytes, sizeof(Name) + length);
+    }
+    name->references++;
+    pthread_mutex_unlock(&names.lock);
+    return name->text;
+}
+
+/*
+*   Lets go of one use of an interned name, freeing it after the last.
+*/
+void release_name(char* text) {
+    if (text == NULL) {
+        return;
+    }
+    Name* name = (Name*)(text - offsetof(Name, text));
+    pthread_mutex_lock(&names.lock);
+    if (--name->references == 0) {
+        Name** link = &names.buckets[name->hash % NAME_BUCKETS];
+        while (*link != name) {
+            link = &(*link)->next;
+        }
+        *link = name->next;
+        METRIC_ADD(internedNames, -1);
+        long bytes = sizeof(Name) + strlen(text) + 1;
+        METRIC_ADD(internedBytes, -bytes);
+        free(name);
+    }
+    pthread_mutex_unlock(&names.lock);
+}
@@ -0,0 +1,50 @@
+#ifndef TABLES_H
+#define TABLES_H
+
+#include <stdint.h>
+#include "game.h"
+
+// Tables in each slab of the table store
+#define TABLE_SLAB_SIZE 1024
+// Hash buckets of the interned names
+#define NAME_BUCKETS 4096
+
+/*
+*   The state of a table read on every move. seats holds the connection id
+*   of each seat, points and tricks are per team. It fills one cache line
+*   of its own, since neighbouring tables are played by other threads and
+*   sharing a line with them would have every move on one table evict the
+*   line from the cores playing the others.
+*/
+typedef struct {
+    uint64_t hands[4] __attribute__((aligned(64)));
+    uint32_t seats[4];
+    int16_t points[2];
+    int16_t contractPoints;
+    uint8_t tricks[2];
+    uint8_t contractGoal;
+    uint8_t contractTeam;
+    char trumps;
+} PlayState;
+
+/*
+*   A slab of tables. The state read on every move is kept apart from the
+*   rest of each table, which is in its Game in the same slab.
+*/
+typedef struct TableSlab {
+    PlayState states[TABLE_SLAB_SIZE];
+    Game games[TABLE_SLAB_SIZE];
+    struct TableSlab* next;
+} TableSlab;
+
+/*
+*   One field of a table's state, used like a Game field.
+*/
+#define TABLE(game, field) ((game)->slab->states[(game)->slot].field)
+
+Game* table_create(void);
+void table_release(Game*);
+char* intern_name(const char*);
+void release_name(char*);
+
+#endif
@@ -0,0 +1,178 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+#include "metrics.h"
+
+/*
+*   One thread's spans. Only the owning thread writes them, so recording a
+*   span takes no lock. head counts every span ever recorded.
+*/
+typedef struct TraceRing {
+    TraceSpan spans[TRACE_RING_SIZE];
+    uint64_t head;
+    int thread;
+    struct TraceRing* next;
+} TraceRing;
+
+/*
+*   Which tables are traced and every thread's ring. Rings live as long as
+*   the server, like the threads that own them.
+*/
+static struct {
+    pthread_mutex_t lock;
+    TraceRing* rings;
+    int ringCount;
+    uint64_t threshold;
+    char* names[TRACE_NAMES];
+    int nameCount;
+} tracing = {PTHREAD_MUTEX_INITIALIZER};
+
+static __thread TraceRing* ring;
+
+static const char* spanNames[] = {
+    "deal_cards", "get_players_bid", "play_trick", "set_points"
+};
+
+/*
+*   Traces the given fraction, from 0 to 1, of all tables. Returns 0 if the
+*   fraction is not valid.
+*/
+int trace_sample_rate(const char* text) {
+    char* end;
+    double rate = strtod(text, &end);
+    if (*end != '\0' || end == text || rate < 0 || rate > 1) {
+        return 0;
+    }
+    tracing.threshold = rate * 4294967296.0;
+    return 1;
+}
+
+/*
+*   Traces every table with the given name that starts from now on.
+*/
+void trace_table(const char* name) {
+    pthread_mutex_lock(&tracing.lock);
+    if (tracing.nameCount < TRACE_NAMES) {
+        tracing.names[tracing.nameCount] = strdup(name);
+        __atomic_store_n(&tracing.nameCount, tracing.nameCount + 1,
+                __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&tracing.lock);
+}
+
+/*
+*   Decides whether a table that is starting is traced. Tables are sampled
+*   by a hash of their id, so the same fraction is picked however tables
+*   are spread over threads.
+*/
+int trace_choose(Game* game) {
+    uint64_t hash = (game->id * 0x9E3779B97F4A7C15ULL) >> 32;
+    int traced = hash < tracing.threshold;
+    int count = __atomic_load_n(&tracing.nameCount, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count && !traced; i++) {
+        traced = !strcmp(tracing.names[i], game->name);
+    }
+    if (traced) {
+        METRIC_ADD(tracedTables, 1);
+    }
+    return traced;
+}
+
+/*
+*   Returns the monotonic time in nanoseconds.
+*/
+uint64_t trace_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+*   Gives the calling thread its ring the first time it records a span.
+*/
+static TraceRing* create_ring(void) {
+    TraceRing* created = calloc(1, sizeof(TraceRing));
+    pthread_mutex_lock(&tracing.lock);
+    created->thread = ++tracing.ringCount;
+    created->next = tracing.rings;
+    tracing.rings = created;
+    pthread_mutex_unlock(&tracing.lock);
+    return created;
+}
+
+/*
+*   Records a span of a traced table that began at start and ends now.
+*/
+void trace_span(Game* game, int type, uint64_t start, int seat) {
+    if (ring == NULL) {
+        ring = create_ring();
+    }
+    TraceSpan* span = &ring->spans[ring->head & (TRACE_RING_SIZE - 1)];
+    span->start = start;
+    span->end = trace_clock();
+    span->table = game->id;
+    span->hand = game->hand;
+    span->type = type;
+    span->seat = seat;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    METRIC_ADD(traceSpans, 1);
+}
+
+/*
+*   Writes the spans in a ring that were not overwritten while they were
+*   being copied. Returns the number written.
+*/
+static long export_ring(FILE* file, TraceRing* traced, TraceSpan* copy,
+        long written) {
+    uint64_t head = __atomic_load_n(&traced->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for (uint64_t i = first; i < head; i++) {
+        copy[i - first] = traced->spans[i & (TRACE_RING_SIZE - 1)];
+    }
+    // The owner may have been writing over the oldest spans meanwhile
+    uint64_t now = __atomic_load_n(&traced->head, __ATOMIC_ACQUIRE);
+    uint64_t safe = now >= TRACE_RING_SIZE ? now - TRACE_RING_SIZE + 1 : 0;
+    long count = 0;
+    for (uint64_t i = first > safe ? first : safe; i < head; i++) {
+        TraceSpan* span = &copy[i - first];
+        fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"table\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%d,"
+                "\"args\":{\"hand\":%u,\"seat\":%d}}",
+                written + count ? "," : "", spanNames[span->type],
+                span->start / 1000.0, (span->end - span->start) / 1000.0,
+                span->table, traced->thread, span->hand, span->seat);
+        count++;
+    }
+    return count;
+}
+
+/*
+*   Writes every span still held by any thread to path as Chrome trace
+*   JSON, which Perfetto also reads. Each table is a process and each
+*   game thread a thread within it. Returns the number of spans written,
+*   or -1 if the file cannot be written.
+*/
+int trace_export(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    TraceSpan* copy = malloc(sizeof(TraceSpan) * TRACE_RING_SIZE);
+    long written = 0;
+    fprintf(file, "{\"traceEvents\":[");
+    pthread_mutex_lock(&tracing.lock);
+    for (TraceRing* traced = tracing.rings; traced != NULL;
+            traced = traced->next) {
+        written += export_ring(file, traced, copy, written);
+    }
+    pthread_mutex_unlock(&tracing.lock);
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    free(copy);
+    if (fclose(file)) {
+        return -1;
+    }
+    return written;
+}
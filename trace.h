@@ -0,0 +1,54 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "game.h"
+
+// Spans each thread keeps, a power of two. Older spans are overwritten.
+#define TRACE_RING_SIZE 4096
+// Most table names that can be picked for tracing
+#define TRACE_NAMES 16
+
+// What a span covers
+#define TRACE_DEAL 0
+#define TRACE_BID 1
+#define TRACE_TRICK 2
+#define TRACE_SCORE 3
+
+/*
+*   A finished span. Times are monotonic nanoseconds.
+*/
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint32_t table;
+    uint16_t hand;
+    uint8_t type;
+    int8_t seat;
+} TraceSpan;
+
+/*
+*   Takes the start time of a span, but only for a traced table.
+*/
+#define TRACE_START(game) \
+    (__builtin_expect((game)->traced, 0) ? trace_clock() : 0)
+
+/*
+*   Records a span that began at start, if the table is traced. seat is
+*   the player the span is about, or -1.
+*/
+#define TRACE_END(game, type, start, seat) \
+    do { \
+        if (__builtin_expect((game)->traced, 0)) { \
+            trace_span((game), (type), (start), (seat)); \
+        } \
+    } while (0)
+
+int trace_sample_rate(const char*);
+void trace_table(const char*);
+int trace_choose(Game*);
+uint64_t trace_clock(void);
+void trace_span(Game*, int, uint64_t, int);
+int trace_export(const char*);
+
+#endif
@@ -0,0 +1,533 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "connection.h"
+#include "metrics.h"
+
+// Submission queue entries in each ring
+#define URING_ENTRIES 64
+// Receive buffers provided to each ring, a power of two, and their size
+#define URING_BUFFERS 16
+#define URING_BUFFER_SIZE 2048
+// The buffer group every receive picks from
+#define URING_BUFFER_GROUP 0
+// Most accepted connections held between calls, the completion queue size
+#define URING_ACCEPTED (URING_ENTRIES * 2)
+
+// A request's kind is kept in the low bits of its user data, beside the
+// connection it is for
+#define TAG_RECEIVE 1
+#define TAG_SEND 2
+#define TAG_ACCEPT 3
+#define TAG_CANCEL 4
+#define TAG_TIMEOUT 5
+#define TAG_MASK 7
+
+/*
+*   An io_uring and the receive buffers provided to it. A connection has at
+*   most one multishot receive and one send in flight. A reactor's ring
+*   also keeps one multishot accept armed on its listening socket. A
+*   timeout wakes the thread when a slow connection is due to be dropped.
+*/
+typedef struct {
+    IoBackend base;
+    int fd;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned sqLocalTail;
+    unsigned queued;
+    struct io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+    struct io_uring_buf_ring* buffers;
+    size_t buffersSize;
+    char* bufferData;
+    unsigned short bufferTail;
+    struct __kernel_timespec timeout;
+    int timing;
+    int listenFD;
+    int accepting;
+    int acceptFailed;
+    int accepted[URING_ACCEPTED];
+    int acceptedCount;
+    int acceptedNext;
+} Uring;
+
+/*
+*   Hands the kernel every queued request, then waits until at least wait
+*   requests have completed.
+*/
+static void submit(Uring* ring, int wait) {
+    int result;
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    do {
+        result = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait,
+                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        METRIC_ADD(ioSyscalls, 1);
+    } while (result < 0 && errno == EINTR);
+    if (result > 0) {
+        ring->queued -= result;
+    }
+}
+
+/*
+*   Returns a cleared submission queue entry, submitting what is queued if
+*   the queue is full.
+*/
+static struct io_uring_sqe* next_sqe(Uring* ring) {
+    while (ring->sqLocalTail - __atomic_load_n(ring->sqHead,
+            __ATOMIC_ACQUIRE) == ring->sqEntries) {
+        submit(ring, 0);
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqLocalTail++;
+    ring->queued++;
+    return sqe;
+}
+
+/*
+*   Gives a receive buffer back to the kernel.
+*/
+static void provide_buffer(Uring* ring, int id) {
+    struct io_uring_buf* buffer =
+            &ring->buffers->bufs[ring->bufferTail & (URING_BUFFERS - 1)];
+    buffer->addr = (uintptr_t)(ring->bufferData + id * URING_BUFFER_SIZE);
+    buffer->len = URING_BUFFER_SIZE;
+    buffer->bid = id;
+    ring->bufferTail++;
+    __atomic_store_n(&ring->buffers->tail, ring->bufferTail,
+            __ATOMIC_RELEASE);
+}
+
+/*
+*   Arms a multishot receive on a connection, which keeps delivering data
+*   into provided buffers until it fails or the buffers run out.
+*/
+static void arm_receive(Uring* ring, Connection* connection) {
+    struct io_uring_sqe* sqe = next_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = (uintptr_t)connection | TAG_RECEIVE;
+    connection->receiving = 1;
+}
+
+/*
+*   Sends everything waiting on a connection, unless a send is already in
+*   flight.
+*/
+static void arm_send(IoBackend* io, Connection* connection) {
+    if (connection->sending) {
+        return;
+    }
+    struct io_uring_sqe* sqe = next_sqe((Uring*)io);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = connection->fd;
+    sqe->addr = (uintptr_t)connection->out;
+    sqe->len = connection->outLength;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)connection | TAG_SEND;
+    connection->sending = 1;
+}
+
+/*
+*   Arms a timeout for when the next slow connection is due to be dropped,
+*   unless one is already armed.
+*/
+static void arm_timeout(Uring* ring, int milliseconds) {
+    if (milliseconds < 0 || ring->timing) {
+        return;
+    }
+    ring->timeout.tv_sec = milliseconds / 1000;
+    ring->timeout.tv_nsec = (milliseconds % 1000) * 1000000L;
+    struct io_uring_sqe* sqe = next_sqe(ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&ring->timeout;
+    sqe->len = 1;
+    sqe->user_data = TAG_TIMEOUT;
+    ring->timing = 1;
+}
+
+/*
+*   Arms a multishot accept on the reactor's listening socket.
+*/
+static void arm_accept(Uring* ring) {
+    struct io_uring_sqe* sqe = next_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->listenFD;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = TAG_ACCEPT;
+    ring->accepting = 1;
+}
+
+/*
+*   Copies received data into its connection and recycles the buffer. A
+*   connection with no room left has sent far more than any move needs and
+*   is treated as closed.
+*/
+static void receive_data(Uring* ring, Connection* connection, int length,
+        unsigned flags) {
+    int id = flags >> IORING_CQE_BUFFER_SHIFT;
+    int held = connection->inEnd - connection->inStart;
+    if (held + length > CONNECTION_BUFFER) {
+        connection->closed = 1;
+    } else {
+        if (connection->inEnd + length > CONNECTION_BUFFER) {
+            memmove(connection->in, connection->in + connection->inStart,
+                    held);
+            connection->inStart = 0;
+            connection->inEnd = held;
+        }
+        memcpy(connection->in + connection->inEnd,
+                ring->bufferData + id * URING_BUFFER_SIZE, length);
+        connection->inEnd += length;
+    }
+    provide_buffer(ring, id);
+}
+
+/*
+*   Handles one completion.
+*/
+static void complete(Uring* ring, struct io_uring_cqe* cqe) {
+    Connection* connection = (Connection*)(uintptr_t)(cqe->user_data &
+            ~(uint64_t)TAG_MASK);
+    switch (cqe->user_data & TAG_MASK) {
+        case TAG_RECEIVE:
+            if (cqe->res > 0) {
+                receive_data(ring, connection, cqe->res, cqe->flags);
+            } else if (cqe->res != -ENOBUFS) {
+                connection->closed = 1;
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                connection->receiving = 0;
+            }
+            break;
+        case TAG_SEND:
+            // What is left is sent the next time the backend is serviced
+            connection->sending = 0;
+            free(connection->retired);
+            connection->retired = NULL;
+            if (cqe->res > 0 && cqe->res <= connection->outLength) {
+                memmove(connection->out, connection->out + cqe->res,
+                        connection->outLength - cqe->res);
+                connection->outLength -= cqe->res;
+            } else if (cqe->res < 0) {
+                // The player has gone, which their next read will show
+                connection->outLength = 0;
+            }
+            break;
+        case TAG_TIMEOUT:
+            ring->timing = 0;
+            break;
+        case TAG_ACCEPT:
+            if (cqe->res >= 0) {
+                ring->accepted[ring->acceptedCount++] = cqe->res;
+            } else if (cqe->res != -EAGAIN && cqe->res != -EINTR &&
+                    cqe->res != -ECONNABORTED) {
+                ring->acceptFailed = 1;
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                ring->accepting = 0;
+            }
+            break;
+    }
+}
+
+/*
+*   Handles every completion waiting in the ring, which needs no system
+*   call.
+*/
+static void reap(Uring* ring) {
+    unsigned head = *ring->cqHead;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        complete(ring, &ring->cqes[head & ring->cqMask]);
+        head++;
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/*
+*   Starts sending on every connection with messages waiting. The sends
+*   are submitted with whatever the thread waits for next.
+*/
+static int uring_flush(IoBackend* io) {
+    return io_backend_service(io, arm_send);
+}
+
+/*
+*   Sends what it can and waits for more input on a connection, usually
+*   with a single system call for both. Sends still in flight are left to
+*   complete while the thread waits for later moves.
+*/
+static int uring_receive(IoBackend* io, Connection* connection) {
+    Uring* ring = (Uring*)io;
+    int held = connection->inEnd - connection->inStart;
+    int timeout = uring_flush(io);
+    reap(ring);
+    while (!connection->closed &&
+            connection->inEnd - connection->inStart == held) {
+        if (!connection->receiving) {
+            arm_receive(ring, connection);
+        }
+        arm_timeout(ring, timeout);
+        submit(ring, 1);
+        reap(ring);
+        timeout = uring_flush(io);
+    }
+    if (ring->queued) {
+        submit(ring, 0);
+    }
+    return connection->inEnd - connection->inStart > held;
+}
+
+/*
+*   Cancels one of a connection's requests.
+*/
+static void cancel(Uring* ring, Connection* connection, int tag) {
+    struct io_uring_sqe* sqe = next_sqe(ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)connection | tag;
+    sqe->user_data = TAG_CANCEL;
+}
+
+/*
+*   Waits until a closing connection's messages have gone, or it is dropped
+*   for taking too long, and then until the ring no longer refers to it.
+*/
+static void uring_release(IoBackend* io, Connection* connection) {
+    Uring* ring = (Uring*)io;
+    while (connection->outLength && !connection->closed) {
+        arm_timeout(ring, uring_flush(io));
+        submit(ring, 1);
+        reap(ring);
+    }
+    if (connection->receiving) {
+        cancel(ring, connection, TAG_RECEIVE);
+    }
+    if (connection->sending) {
+        cancel(ring, connection, TAG_SEND);
+    }
+    while (connection->receiving || connection->sending) {
+        submit(ring, 1);
+        reap(ring);
+    }
+}
+
+/*
+*   Starts accepting on a listening socket. The reactor waits on the ring,
+*   which is readable whenever completions are waiting.
+*/
+static int uring_listen(IoBackend* io, int listenFD) {
+    Uring* ring = (Uring*)io;
+    ring->listenFD = listenFD;
+    arm_accept(ring);
+    submit(ring, 0);
+    return ring->fd;
+}
+
+/*
+*   Returns the next connection the multishot accept has taken. The peer's
+*   address is not part of the completion, so it is looked up.
+*/
+static int uring_accept(IoBackend* io, int listenFD, struct sockaddr_in* from,
+        socklen_t* fromSize) {
+    Uring* ring = (Uring*)io;
+    if (ring->acceptedNext == ring->acceptedCount) {
+        ring->acceptedNext = 0;
+        ring->acceptedCount = 0;
+        reap(ring);
+        if (!ring->accepting) {
+            arm_accept(ring);
+        }
+        if (ring->queued) {
+            submit(ring, 0);
+        }
+    }
+    if (ring->acceptedNext == ring->acceptedCount) {
+        return ring->acceptFailed ? -2 : -1;
+    }
+    int fd = ring->accepted[ring->acceptedNext++];
+    getpeername(fd, (struct sockaddr*)from, fromSize);
+    METRIC_ADD(ioSyscalls, 1);
+    return fd;
+}
+
+/*
+*   Unmaps and closes a ring.
+*/
+static void uring_destroy(IoBackend* io) {
+    Uring* ring = (Uring*)io;
+    if (ring->buffers != NULL && ring->buffers != MAP_FAILED) {
+        munmap(ring->buffers, ring->buffersSize);
+    }
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED &&
+            ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED) {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring->bufferData);
+    free(ring);
+}
+
+static const IoBackendOps uringOps = {
+    "uring",
+    uring_receive,
+    uring_flush,
+    uring_release,
+    uring_listen,
+    uring_accept,
+    uring_destroy
+};
+
+/*
+*   Maps a new ring's queues and registers its receive buffers. Returns 0
+*   on failure.
+*/
+static int map_ring(Uring* ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        return 0;
+    }
+    ring->sqRingSize = params.sq_off.array +
+            params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        return 0;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            return 0;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        return 0;
+    }
+
+    char* sq = ring->sqRing;
+    char* cq = ring->cqRing;
+    ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->sqLocalTail = *ring->sqTail;
+    unsigned* array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // The buffer ring must be page aligned, which mmap gives
+    ring->buffersSize = URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->buffers = mmap(NULL, ring->buffersSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->bufferData = malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+    if (ring->buffers == MAP_FAILED || ring->bufferData == NULL) {
+        return 0;
+    }
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uintptr_t)ring->buffers;
+    registration.ring_entries = URING_BUFFERS;
+    registration.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+            &registration, 1) < 0) {
+        return 0;
+    }
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        provide_buffer(ring, i);
+    }
+    return 1;
+}
+
+/*
+*   Creates an io_uring backend for the calling thread. Returns NULL if
+*   the ring cannot be set up.
+*/
+IoBackend* uring_backend_create(void) {
+    Uring* ring = calloc(1, sizeof(Uring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->base.ops = &uringOps;
+    ring->fd = -1;
+    if (!map_ring(ring)) {
+        uring_destroy(&ring->base);
+        return NULL;
+    }
+    return &ring->base;
+}
+
+/*
+*   Checks that the kernel has everything the backend uses by receiving a
+*   line over a socket pair with a multishot receive into a provided
+*   buffer, which are the newest features needed.
+*/
+int uring_supported(void) {
+    int pair[2];
+    IoBackend* io = uring_backend_create();
+    if (io == NULL) {
+        return 0;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+        io_backend_destroy(io);
+        return 0;
+    }
+    Connection* connection = connection_create(pair[0]);
+    connection_attach(connection, io);
+    int supported = write(pair[1], "\n", 1) == 1 &&
+            !strcmp(connection_read_line(connection), "") &&
+            connection->receiving;
+    connection_close(connection);
+    close(pair[1]);
+    io_backend_destroy(io);
+    return supported;
+}